@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * amp_fwbench - upload throughput benchmark
+ * Copyright 2021 Ampere Computing LLC.
+ *
+ * Runs the chunk upload of amp_fwupgrade, pipeline and all, over one
+ * image and prints one JSON object describing the run.  The backend is
+ * whatever libefivar picked from LIBEFIVAR_OPS, pointed at a scratch
+ * directory through EFIVARFS_PATH or VARS_PATH, or "memory", where the
+ * writes are taken here the way firmware would take them and never reach
+ * the kernel.  tests/bench-upload sweeps sizes, chunk sizes and backends.
+ *
+ * The upload variables are written through the efi_variable_open()
+ * handle wrappers below, which is where the per-chunk latency is
+ * measured; a chunk is timed from its offset write (or its record write)
+ * to the end of its data write.  In memory, an upload variable's handle
+ * has nothing of libefivar's behind it.
+ */
+
+#include "fix_coverity.h"
+
+#include <dlfcn.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+typedef int (*variable_open_fn)(efi_guid_t guid, const char *name,
+				mode_t mode, efi_variable_handle_t **handle);
+typedef int (*variable_read_fn)(efi_variable_handle_t *handle,
+				uint8_t **data, size_t *data_size,
+				uint32_t *attributes);
+typedef int (*variable_write_fn)(efi_variable_handle_t *handle,
+				 const struct iovec *iov, int iovcnt,
+				 uint32_t attributes);
+typedef void (*variable_close_fn)(efi_variable_handle_t *handle);
+
+/* What the wrappers hand out; libefivar's own handle is behind it. */
+struct bench_var {
+	char *name;
+	efi_variable_handle_t *real;	/* NULL in memory */
+};
+
+static struct {
+	bool memory;
+	variable_open_fn real_open;
+	variable_read_fn real_read;
+	variable_write_fn real_write;
+	variable_close_fn real_close;
+
+	uint8_t *mailbox;	/* memory: where firmware copies a chunk */
+	size_t mailbox_size;
+
+	uint64_t chunk_start;
+	uint64_t *latency;	/* ns */
+	size_t nlatency;
+	size_t alloc;
+} bench;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+record_latency(uint64_t start)
+{
+	uint64_t *latency;
+
+	if (bench.nlatency == bench.alloc) {
+		size_t alloc = bench.alloc ? bench.alloc * 2 : 4096;
+
+		latency = realloc(bench.latency, alloc * sizeof(*latency));
+		if (!latency)
+			return;
+		bench.latency = latency;
+		bench.alloc = alloc;
+	}
+	bench.latency[bench.nlatency++] = now_ns() - start;
+}
+
+static bool
+upload_variable(const char *name)
+{
+	return !strcmp(name, FWUP_SET_UPLOAD_OFFSET) ||
+	       !strcmp(name, FWUP_CONTINUE_UPLOAD) ||
+	       !strcmp(name, FWUP_UPLOAD_RECORD);
+}
+
+static int
+memory_set_iov(const struct iovec *iov, int iovcnt)
+{
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (off + iov[i].iov_len > bench.mailbox_size) {
+			errno = ENOSPC;
+			return -1;
+		}
+		memcpy(bench.mailbox + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	return 0;
+}
+
+int
+efi_variable_open(efi_guid_t guid, const char *name, mode_t mode,
+		  efi_variable_handle_t **handlep)
+{
+	struct bench_var *var;
+
+	var = calloc(1, sizeof(*var));
+	if (!var)
+		return -1;
+	var->name = strdup(name);
+	if (!var->name ||
+	    (!(bench.memory && upload_variable(name)) &&
+	     bench.real_open(guid, name, mode, &var->real) < 0)) {
+		free(var->name);
+		free(var);
+		return -1;
+	}
+	*handlep = (efi_variable_handle_t *)var;
+	return 0;
+}
+
+int
+efi_variable_read(efi_variable_handle_t *handle, uint8_t **data,
+		  size_t *data_size, uint32_t *attributes)
+{
+	struct bench_var *var = (struct bench_var *)handle;
+
+	if (!var->real) {
+		errno = ENOENT;
+		return -1;
+	}
+	return bench.real_read(var->real, data, data_size, attributes);
+}
+
+int
+efi_variable_write(efi_variable_handle_t *handle, const struct iovec *iov,
+		   int iovcnt, uint32_t attributes)
+{
+	struct bench_var *var = (struct bench_var *)handle;
+	uint64_t start = bench.chunk_start;
+	int rc;
+
+	if (!strcmp(var->name, FWUP_SET_UPLOAD_OFFSET))
+		bench.chunk_start = start = now_ns();
+	else if (!strcmp(var->name, FWUP_UPLOAD_RECORD))
+		start = now_ns();
+	if (!var->real)
+		rc = memory_set_iov(iov, iovcnt);
+	else
+		rc = bench.real_write(var->real, iov, iovcnt, attributes);
+	if (rc == 0 && upload_variable(var->name) &&
+	    strcmp(var->name, FWUP_SET_UPLOAD_OFFSET))
+		record_latency(start);
+	return rc;
+}
+
+void
+efi_variable_close(efi_variable_handle_t *handle)
+{
+	struct bench_var *var = (struct bench_var *)handle;
+
+	if (!var)
+		return;
+	if (var->real)
+		bench.real_close(var->real);
+	free(var->name);
+	free(var);
+}
+
+static size_t
+parse_size(const char *arg)
+{
+	char *end = NULL;
+	size_t size;
+
+	size = strtoul(arg, &end, 0);
+	if (end && (*end == 'K' || *end == 'k'))
+		size *= 1024;
+	else if (end && (*end == 'M' || *end == 'm'))
+		size *= 1024 * 1024;
+	return size;
+}
+
+/*
+ * Fill the image with something that doesn't compress or repeat, a
+ * megabyte at a time, so making it doesn't count against the peak RSS.
+ */
+static int
+make_image(const char *path, size_t size)
+{
+	static uint8_t buf[1024 * 1024];
+	uint64_t x = 0x9e3779b97f4a7c15;
+	struct stat sb;
+	size_t off, i;
+	int fd;
+
+	if (stat(path, &sb) == 0 && (size_t)sb.st_size == size)
+		return 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	for (off = 0; off < size; off += sizeof(buf)) {
+		size_t len = size - off < sizeof(buf) ? size - off : sizeof(buf);
+
+		for (i = 0; i + sizeof(x) <= len; i += sizeof(x)) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buf + i, &x, sizeof(x));
+		}
+		if (write(fd, buf, len) != (ssize_t)len) {
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/*
+ * Read and write system calls so far, from /proc/self/io.  Opens,
+ * closes and the like aren't counted there.
+ */
+static long long
+rw_syscalls(void)
+{
+	char line[128];
+	long long n, total = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/io", "re");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %lld", &n) == 1 ||
+		    sscanf(line, "syscw: %lld", &n) == 1)
+			total += n;
+	}
+	fclose(f);
+	return total;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(double pct)
+{
+	size_t i;
+
+	if (!bench.nlatency)
+		return 0;
+	i = (size_t)(pct / 100.0 * (bench.nlatency - 1) + 0.5);
+	return bench.latency[i] / 1000.0;
+}
+
+static void __attribute__((__noreturn__))
+usage(int ret)
+{
+	FILE *out = ret == 0 ? stdout : stderr;
+
+	fprintf(out,
+		"Usage: %s [OPTION...] <image>\n"
+		"  -b, --backend=memory         Take the writes in memory instead of libefivar\n"
+		"  -c, --chunk-size=<bytes>     Upload chunk size (accepts K and M suffixes)\n"
+		"  -s, --size=<bytes>           Create <image> with this size if it differs\n"
+		"      --chunk-crc              Append a CRC32 to each chunk\n"
+		"      --single-record          Use UpgradeUploadRecord writes\n"
+		"  -?, --help                   Show this help message\n",
+		program_invocation_short_name);
+	exit(ret);
+}
+
+#define OPT_CHUNK_CRC		0x100
+#define OPT_SINGLE_RECORD	0x101
+
+int
+main(int argc, char *argv[])
+{
+	const char *backend = NULL;
+	size_t chunk_size = FWUP_MAX_XFER_SIZE;
+	size_t size = 0;
+	bool chunk_crc = false, single_record = false;
+	long long syscalls;
+	struct rusage ru;
+	fwup_source_t src;
+	fwup_upload_t up;
+	uint64_t start, elapsed;
+	double seconds, mib;
+	int c, i = 0;
+	char *sopts = "b:c:s:?";
+	struct option lopts[] = {
+		{"backend", required_argument, 0, 'b'},
+		{"chunk-size", required_argument, 0, 'c'},
+		{"size", required_argument, 0, 's'},
+		{"chunk-crc", no_argument, 0, OPT_CHUNK_CRC},
+		{"single-record", no_argument, 0, OPT_SINGLE_RECORD},
+		{"help", no_argument, 0, '?'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
+		switch (c) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'c':
+			chunk_size = parse_size(optarg);
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case OPT_CHUNK_CRC:
+			chunk_crc = true;
+			break;
+		case OPT_SINGLE_RECORD:
+			single_record = true;
+			break;
+		case '?':
+			usage(optopt ? 1 : 0);
+		default:
+			usage(1);
+		}
+	}
+	if (optind != argc - 1 || chunk_size == 0)
+		usage(1);
+
+	if (backend && strcmp(backend, "memory")) {
+		fprintf(stderr, "%s: unknown backend \"%s\", set LIBEFIVAR_OPS for the others\n",
+			program_invocation_short_name, backend);
+		exit(1);
+	}
+	bench.memory = backend != NULL;
+	if (!bench.memory)
+		backend = efi_variables_backend();
+	bench.real_open = (variable_open_fn)dlsym(RTLD_NEXT,
+						  "efi_variable_open");
+	bench.real_read = (variable_read_fn)dlsym(RTLD_NEXT,
+						  "efi_variable_read");
+	bench.real_write = (variable_write_fn)dlsym(RTLD_NEXT,
+						    "efi_variable_write");
+	bench.real_close = (variable_close_fn)dlsym(RTLD_NEXT,
+						    "efi_variable_close");
+	if (!bench.real_open || !bench.real_read || !bench.real_write ||
+	    !bench.real_close)
+		errx(1, "can't find libefivar: %s", dlerror());
+
+	bench.mailbox_size = chunk_size + sizeof(fwup_record_header_t) +
+			     FWUP_CRC_TRAILER_SIZE;
+	bench.mailbox = malloc(bench.mailbox_size);
+	if (!bench.mailbox)
+		err(1, "malloc");
+
+	if (size && make_image(argv[optind], size) < 0)
+		err(1, "creating %s", argv[optind]);
+	if (fwup_source_open(&src, argv[optind]) < 0)
+		err(1, "%s", argv[optind]);
+
+	memset(&up, '\0', sizeof(up));
+	text_to_guid(FWUP_GUID_STR, &up.guid);
+	up.name = "UpgradeSCPRequest";
+	up.src = &src;
+	up.chunk_size = chunk_size;
+	up.chunk_crc = chunk_crc;
+	up.record = single_record;
+
+	syscalls = rw_syscalls();
+	start = now_ns();
+	if (fwup_upload_chunks(&up) < 0)
+		err(1, "upload on %s with %zu byte chunks", backend,
+		    chunk_size);
+	elapsed = now_ns() - start;
+	fwup_upload_close(&up);
+	syscalls = syscalls < 0 ? -1 : rw_syscalls() - syscalls;
+	getrusage(RUSAGE_SELF, &ru);
+
+	qsort(bench.latency, bench.nlatency, sizeof(*bench.latency), cmp_u64);
+	seconds = elapsed / 1e9;
+	mib = src.size / (1024.0 * 1024.0);
+
+	printf("{\"backend\":\"%s\",\"image_size\":%zu,\"chunk_size\":%zu,"
+	       "\"chunk_crc\":%s,\"single_record\":%s,"
+	       "\"chunks\":%zu,\"retries\":%u,\"seconds\":%.6f,"
+	       "\"mb_per_s\":%.2f,"
+	       "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+	       "\"syscalls_per_mib\":%.1f,\"peak_rss_kib\":%ld}\n",
+	       backend, src.size, chunk_size,
+	       chunk_crc ? "true" : "false",
+	       single_record ? "true" : "false",
+	       bench.nlatency, up.retries, seconds,
+	       seconds > 0 ? src.size / 1e6 / seconds : 0.0,
+	       percentile_us(50), percentile_us(90), percentile_us(99),
+	       percentile_us(100),
+	       syscalls < 0 || mib <= 0 ? -1.0 : syscalls / mib,
+	       ru.ru_maxrss);
+
+	fwup_source_close(&src);
+	free(bench.latency);
+	free(bench.mailbox);
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,965 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * amp_fwsim - firmware side of the FW upgrade protocol, for testing
+ * Copyright 2021 Ampere Computing LLC.
+ *
+ * Preload this into amp_fwupgrade (or any libamp_fwupgrade user) with a
+ * scratch efivarfs directory:
+ *
+ *   EFIVARFS_PATH=$scratch/ LIBEFIVAR_OPS=efivarfs \
+ *   LD_PRELOAD=src/amp_fwsim.so FWSIM=flash=500,busy=7 \
+ *	src/amp_fwupgrade -a image
+ *
+ * Writes to UpgradeSetUploadOffset, UpgradeContinueUpload,
+ * UpgradeUploadRecord and the Upgrade*Request variables are taken by the
+ * simulated firmware instead of the directory: the image is put back
+ * together and checked, and the flash is then reported in the request
+ * variable on disk, "<component>,IN_PROCESS,NN" up to "<component>,SUCCESS",
+ * the way firmware reports it.  A successful flash of an image with a
+ * version record updates that component's line in
+ * UpgradeFirmwareVersions, and with FWUP_CAP_DELTA the image stays
+ * staged for an UpgradeDeltaBase write to start the next upload from.
+ * Everything else goes through to libefivar.  efi_variable_open()
+ * handles are wrapped the same way, by the name they were opened with.
+ *
+ * Firmware runs SetVariable() synchronously, so a write doesn't return
+ * before it has been dealt with.  A separate process watching a plain
+ * directory can't offer that - back-to-back chunk writes would land on
+ * top of each other before it looked - which is why this sits in front
+ * of libefivar instead.
+ *
+ * FWSIM is a comma separated list of:
+ *   delay=<us>		sleep this long in every write
+ *   flash=<ms>		time the flash takes (default 1000)
+ *   busy=<n>		refuse every n-th chunk with EBUSY
+ *   corrupt=<n>	damage every n-th chunk on the way in
+ *   max-chunk=<bytes>	refuse bigger chunks with ENOSPC
+ *   caps=<mask>	publish UpgradeCapabilities; with FWUP_CAP_SPARSE,
+ *			holes in the upload are taken as fill, and with
+ *			FWUP_CAP_ELIDED_MAP they must match
+ *			UpgradeElidedRanges; with FWUP_CAP_DELTA, the
+ *			staged image is reported in UpgradeStagingDigest
+ *   crc		chunks carry a CRC32 trailer (--chunk-crc)
+ *   fail		fail the flash half way
+ *   image=<file>	the image the upload must reproduce
+ *   staging=<file>	keep the staging buffer in <file> between runs
+ */
+
+#include "fix_coverity.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+typedef int (*set_variable_fn)(efi_guid_t guid, const char *name,
+			       uint8_t *data, size_t data_size,
+			       uint32_t attributes, mode_t mode);
+typedef int (*get_variable_fn)(efi_guid_t guid, const char *name,
+			       uint8_t **data, size_t *data_size,
+			       uint32_t *attributes);
+typedef int (*get_variable_into_fn)(efi_guid_t guid, const char *name,
+				    uint8_t *buf, size_t bufsize,
+				    size_t *needed, uint32_t *attributes);
+typedef int (*variable_open_fn)(efi_guid_t guid, const char *name,
+				mode_t mode, efi_variable_handle_t **handle);
+typedef int (*variable_read_fn)(efi_variable_handle_t *handle,
+				uint8_t **data, size_t *data_size,
+				uint32_t *attributes);
+typedef int (*variable_write_fn)(efi_variable_handle_t *handle,
+				 const struct iovec *iov, int iovcnt,
+				 uint32_t attributes);
+typedef void (*variable_close_fn)(efi_variable_handle_t *handle);
+
+/* What efi_variable_open() hands out here; libefivar's is behind it. */
+struct sim_var {
+	efi_guid_t guid;
+	char *name;
+	efi_variable_handle_t *real;
+	uint8_t *buf;		/* the last answer firmware gave */
+};
+
+static const struct {
+	const char *request;
+	const char *component;
+} requests[] = {
+	{ "UpgradeATFUEFIRequest", "ATF" },
+	{ "UpgradeUEFIRequest", "UEFI" },
+	{ "UpgradeCFGUEFIRequest", "UEFICFG" },
+	{ "UpgradeSCPRequest", "SCP" },
+	{ "UpgradeSingleImageFullFlashRequest", "FW" },
+	{ "UpgradeSingleImageFWOnlyRequest", "FW" },
+	{ "UpgradeSingleImageClearSettingRequest", "FW" },
+};
+
+static struct {
+	unsigned long delay_us;
+	unsigned long flash_ms;
+	unsigned long busy;
+	unsigned long corrupt;
+	size_t max_chunk;
+	bool have_caps;
+	uint32_t caps;
+	bool crc;
+	bool fail;
+	char *image;
+	char *staging;
+} config = {
+	.flash_ms = 1000,
+};
+
+struct extent {
+	size_t start;
+	size_t end;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	set_variable_fn real_set;
+	get_variable_fn real_get;
+	get_variable_into_fn real_get_into;
+	variable_open_fn real_open;
+	variable_read_fn real_read;
+	variable_write_fn real_write;
+	variable_close_fn real_close;
+	efi_guid_t guid;
+
+	bool have_offset;
+	uint32_t offset;
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+	struct extent *extents;
+	size_t nextents;
+	unsigned long chunks;
+	unsigned long refused;
+	fwup_elided_range_t *elided;
+	size_t nelided;
+	size_t filled;
+	size_t reused;
+
+	uint8_t *staging;
+	size_t staging_size;
+	uint32_t staging_digest;
+} sim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct flash {
+	char *request;
+	const char *component;
+	bool ok;
+	char version[FWUP_VERSION_MAX + 1];
+};
+
+static void
+parse_config(void)
+{
+	char *opts, *opt, *save = NULL;
+	const char *env = getenv("FWSIM");
+
+	if (!env)
+		return;
+	opts = strdupa(env);
+	for (opt = strtok_r(opts, ",", &save); opt;
+	     opt = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(opt, '=');
+
+		if (value)
+			*value++ = '\0';
+		if (!strcmp(opt, "delay") && value)
+			config.delay_us = strtoul(value, NULL, 0);
+		else if (!strcmp(opt, "flash") && value)
+			config.flash_ms = strtoul(value, NULL, 0);
+		else if (!strcmp(opt, "busy") && value)
+			config.busy = strtoul(value, NULL, 0);
+		else if (!strcmp(opt, "corrupt") && value)
+			config.corrupt = strtoul(value, NULL, 0);
+		else if (!strcmp(opt, "max-chunk") && value)
+			config.max_chunk = strtoul(value, NULL, 0);
+		else if (!strcmp(opt, "caps") && value) {
+			config.caps = strtoul(value, NULL, 0);
+			config.have_caps = true;
+		} else if (!strcmp(opt, "crc"))
+			config.crc = true;
+		else if (!strcmp(opt, "fail"))
+			config.fail = true;
+		else if (!strcmp(opt, "image") && value)
+			config.image = strdup(value);
+		else if (!strcmp(opt, "staging") && value)
+			config.staging = strdup(value);
+		else
+			fprintf(stderr, "fwsim: ignoring \"%s\" in FWSIM\n", opt);
+	}
+}
+
+static void CONSTRUCTOR
+fwsim_init(void)
+{
+	sim.real_set = (set_variable_fn)dlsym(RTLD_NEXT, "efi_set_variable");
+	sim.real_get = (get_variable_fn)dlsym(RTLD_NEXT, "efi_get_variable");
+	sim.real_get_into = (get_variable_into_fn)dlsym(RTLD_NEXT,
+							"efi_get_variable_into");
+	sim.real_open = (variable_open_fn)dlsym(RTLD_NEXT, "efi_variable_open");
+	sim.real_read = (variable_read_fn)dlsym(RTLD_NEXT, "efi_variable_read");
+	sim.real_write = (variable_write_fn)dlsym(RTLD_NEXT,
+						  "efi_variable_write");
+	sim.real_close = (variable_close_fn)dlsym(RTLD_NEXT,
+						  "efi_variable_close");
+	text_to_guid(FWUP_GUID_STR, &sim.guid);
+	parse_config();
+}
+
+static const char *
+request_component(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+		if (!strcmp(requests[i].request, name))
+			return requests[i].component;
+	}
+	return NULL;
+}
+
+static void
+reset(void)
+{
+	free(sim.data);
+	free(sim.extents);
+	free(sim.elided);
+	sim.data = NULL;
+	sim.extents = NULL;
+	sim.elided = NULL;
+	sim.size = sim.alloc = sim.nextents = sim.nelided = sim.filled = 0;
+	sim.reused = 0;
+	sim.have_offset = false;
+	sim.chunks = sim.refused = 0;
+}
+
+/*
+ * Put data at offset and note the range as received; overlapping
+ * ranges, from retries and resumed uploads, are merged.
+ */
+static int
+store(size_t offset, const uint8_t *data, size_t len)
+{
+	size_t end = offset + len;
+	struct extent *extents;
+	size_t i, j;
+
+	if (end > sim.alloc) {
+		size_t alloc = sim.alloc ? sim.alloc : 1024 * 1024;
+		uint8_t *buf;
+
+		while (alloc < end)
+			alloc *= 2;
+		buf = realloc(sim.data, alloc);
+		if (!buf)
+			return -1;
+		sim.data = buf;
+		sim.alloc = alloc;
+	}
+	memcpy(sim.data + offset, data, len);
+	if (end > sim.size)
+		sim.size = end;
+
+	extents = realloc(sim.extents, (sim.nextents + 1) * sizeof(*extents));
+	if (!extents)
+		return -1;
+	sim.extents = extents;
+	extents[sim.nextents].start = offset;
+	extents[sim.nextents].end = end;
+	sim.nextents++;
+
+	/* Keep them sorted and disjoint. */
+	for (i = sim.nextents - 1; i > 0 && extents[i - 1].start > extents[i].start; i--) {
+		struct extent tmp = extents[i - 1];
+
+		extents[i - 1] = extents[i];
+		extents[i] = tmp;
+	}
+	for (i = 0, j = 1; j < sim.nextents; j++) {
+		if (extents[j].start <= extents[i].end) {
+			if (extents[j].end > extents[i].end)
+				extents[i].end = extents[j].end;
+		} else {
+			extents[++i] = extents[j];
+		}
+	}
+	sim.nextents = i + 1;
+	return 0;
+}
+
+/*
+ * With a pre-filled staging buffer, what wasn't written is fill.
+ * Firmware that takes a map of the skipped ranges holds the upload to
+ * it.
+ */
+static bool
+fill_holes(void)
+{
+	uint8_t fill = FWUP_CAP_FILL(config.caps);
+	size_t i, start, len;
+
+	if (!(config.caps & FWUP_CAP_SPARSE) || !sim.nextents ||
+	    sim.extents[0].start != 0)
+		return false;
+	if ((config.caps & FWUP_CAP_ELIDED_MAP) &&
+	    sim.nelided != sim.nextents - 1)
+		return false;
+
+	for (i = 1; i < sim.nextents; i++) {
+		start = sim.extents[i - 1].end;
+		len = sim.extents[i].start - start;
+		if ((config.caps & FWUP_CAP_ELIDED_MAP) &&
+		    (le32_to_cpu(sim.elided[i - 1].offset) != start ||
+		     le32_to_cpu(sim.elided[i - 1].length) != len))
+			return false;
+		memset(sim.data + start, fill, len);
+		sim.filled += len;
+	}
+	sim.extents[0].end = sim.extents[sim.nextents - 1].end;
+	sim.nextents = 1;
+	return true;
+}
+
+static bool
+verify(const char **why)
+{
+	const fwup_image_header_t *hdr;
+	uint8_t *expected;
+	struct stat sb;
+	bool ok;
+	int fd;
+
+	if ((sim.nextents != 1 || sim.extents[0].start != 0) && !fill_holes()) {
+		*why = "has holes";
+		return false;
+	}
+
+	if (config.image) {
+		fd = open(config.image, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || fstat(fd, &sb) < 0) {
+			*why = "can't be compared";
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+		if ((size_t)sb.st_size != sim.size) {
+			close(fd);
+			*why = "has the wrong size";
+			return false;
+		}
+		expected = malloc(sim.size ? sim.size : 1);
+		ok = expected &&
+		     pread(fd, expected, sim.size, 0) == (ssize_t)sim.size &&
+		     !memcmp(expected, sim.data, sim.size);
+		free(expected);
+		close(fd);
+		*why = ok ? "matches" : "differs";
+		return ok;
+	}
+
+	if (sim.size >= sizeof(*hdr)) {
+		fwup_image_header_t copy;
+
+		hdr = (const fwup_image_header_t *)sim.data;
+		if (le32_to_cpu(hdr->magic) == FWUP_IMAGE_MAGIC) {
+			memcpy(&copy, hdr, sizeof(copy));
+			copy.header_crc = 0;
+			if (le32_to_cpu(hdr->header_crc) != efi_crc32(&copy, sizeof(copy)) ||
+			    le64_to_cpu(hdr->image_size) != sim.size) {
+				*why = "fails its header check";
+				return false;
+			}
+		}
+	}
+	*why = "is complete";
+	return true;
+}
+
+/*
+ * The digest fwup_image_digest() gives, computed the simple way.
+ */
+static uint32_t
+digest(const uint8_t *data, size_t size)
+{
+	size_t nsegs = (size + FWUP_DIGEST_SEGMENT - 1) / FWUP_DIGEST_SEGMENT;
+	uint32_t *crcs;
+	uint32_t crc;
+	size_t i, len;
+
+	crcs = calloc(nsegs ? nsegs : 1, sizeof(*crcs));
+	if (!crcs)
+		return 0;
+	for (i = 0; i < nsegs; i++) {
+		len = size - i * FWUP_DIGEST_SEGMENT;
+		if (len > FWUP_DIGEST_SEGMENT)
+			len = FWUP_DIGEST_SEGMENT;
+		crcs[i] = cpu_to_le32(efi_crc32(data + i * FWUP_DIGEST_SEGMENT,
+						len));
+	}
+	crc = efi_crc32(crcs, nsegs * sizeof(*crcs));
+	free(crcs);
+	return crc;
+}
+
+/*
+ * Keep what was just uploaded in the staging buffer.
+ */
+static void
+stage(void)
+{
+	FILE *f;
+
+	free(sim.staging);
+	sim.staging = sim.data;
+	sim.staging_size = sim.size;
+	sim.staging_digest = digest(sim.data, sim.size);
+	sim.data = NULL;
+
+	if (config.staging) {
+		f = fopen(config.staging, "we");
+		if (f) {
+			fwrite(sim.staging, 1, sim.staging_size, f);
+			fclose(f);
+		}
+	}
+}
+
+/*
+ * Pick up what an earlier process left staged.
+ */
+static void
+load_staging(void)
+{
+	struct stat sb;
+	uint8_t *buf;
+	int fd;
+
+	if (sim.staging || !config.staging)
+		return;
+	fd = open(config.staging, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+		buf = malloc(sb.st_size);
+		if (buf && pread(fd, buf, sb.st_size, 0) == sb.st_size) {
+			sim.staging = buf;
+			sim.staging_size = sb.st_size;
+			sim.staging_digest = digest(buf, sb.st_size);
+		} else {
+			free(buf);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Start the upload from the staging buffer, if it holds what the host
+ * thinks it does.
+ */
+static int
+delta_base(const uint8_t *data, size_t len)
+{
+	fwup_delta_base_t base;
+	size_t size;
+
+	if (!(config.caps & FWUP_CAP_DELTA) || len != sizeof(base)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&base, data, sizeof(base));
+	load_staging();
+	if (!sim.staging ||
+	    le32_to_cpu(base.digest) != sim.staging_digest ||
+	    le64_to_cpu(base.base_size) != sim.staging_size) {
+		errno = ESTALE;
+		return -1;
+	}
+
+	reset();
+	size = le64_to_cpu(base.image_size);
+	if (size > sim.staging_size)
+		size = sim.staging_size;
+	if (store(0, sim.staging, size) < 0)
+		return -1;
+	sim.reused = size;
+	return 0;
+}
+
+static void
+publish(const char *request, const char *fmt, ...)
+{
+	char status[FWUP_STATUS_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(status, sizeof(status), fmt, ap);
+	va_end(ap);
+	sim.real_set(sim.guid, request, (uint8_t *)status, strlen(status) + 1,
+		     FWUP_ATTRS, 0644);
+}
+
+/*
+ * Replace component's line in UpgradeFirmwareVersions.
+ */
+static void
+record_version(const char *component, const char *version)
+{
+	char *old = NULL, *line, *save = NULL;
+	size_t old_size = 0, len = 0;
+	uint32_t attributes;
+	char buf[1024];
+
+	if (sim.real_get(sim.guid, FWUP_FIRMWARE_VERSIONS, (uint8_t **)&old,
+			 &old_size, &attributes) == 0) {
+		old = realloc(old, old_size + 1);
+		if (!old)
+			return;
+		old[old_size] = '\0';
+		for (line = strtok_r(old, "\n", &save); line;
+		     line = strtok_r(NULL, "\n", &save)) {
+			size_t n = strlen(component);
+
+			if (!strncmp(line, component, n) && line[n] == ',')
+				continue;
+			len += snprintf(buf + len, sizeof(buf) - len, "%s\n",
+					line);
+		}
+		free(old);
+	}
+	snprintf(buf + len, sizeof(buf) - len, "%s,%s\n", component, version);
+	sim.real_set(sim.guid, FWUP_FIRMWARE_VERSIONS, (uint8_t *)buf,
+		     strlen(buf), FWUP_ATTRS, 0644);
+}
+
+/*
+ * The version record of the image received so far, if it has one.
+ */
+static void
+image_version(char *version)
+{
+	const fwup_image_header_t *hdr = (const fwup_image_header_t *)sim.data;
+	const fwup_image_version_t *ver;
+
+	version[0] = '\0';
+	if (sim.size < sizeof(*hdr) + sizeof(*ver) ||
+	    le32_to_cpu(hdr->magic) != FWUP_IMAGE_MAGIC ||
+	    !(le32_to_cpu(hdr->flags) & FWUP_IMAGE_VERSIONED))
+		return;
+	ver = (const fwup_image_version_t *)(sim.data + sizeof(*hdr));
+	memcpy(version, ver->version, sizeof(ver->version));
+	version[sizeof(ver->version)] = '\0';
+}
+
+static void *
+flash(void *arg)
+{
+	struct flash *fl = arg;
+	unsigned int pct;
+
+	for (pct = 0; pct < 100; pct += 10) {
+		if (config.fail && pct == 50)
+			break;
+		publish(fl->request, "%s,IN_PROCESS,%u", fl->component, pct);
+		usleep(config.flash_ms * 100);
+	}
+	if (!fl->ok || config.fail) {
+		publish(fl->request, "%s,FAILED", fl->component);
+	} else {
+		if (fl->version[0])
+			record_version(fl->component, fl->version);
+		publish(fl->request, "%s,SUCCESS", fl->component);
+	}
+	free(fl->request);
+	free(fl);
+	return NULL;
+}
+
+/*
+ * The request carries the head of the image and starts the flash.
+ */
+static int
+start_flash(const char *request, const char *component, const uint8_t *data,
+	    size_t len)
+{
+	struct flash *fl;
+	const char *why;
+	pthread_t thread;
+
+	if (store(0, data, len) < 0)
+		return -1;
+
+	fl = calloc(1, sizeof(*fl));
+	if (!fl)
+		return -1;
+	fl->request = strdup(request);
+	fl->component = component;
+	fl->ok = verify(&why);
+	image_version(fl->version);
+	fprintf(stderr, "fwsim: %s: %zu bytes in %lu chunks, %lu refused, %zu filled, %zu reused, image %s\n",
+		request, sim.size, sim.chunks, sim.refused, sim.filled,
+		sim.reused, why);
+	if (fl->ok && (config.caps & FWUP_CAP_DELTA))
+		stage();
+	reset();
+
+	publish(request, "%s,IN_PROCESS,0", component);
+	if (pthread_create(&thread, NULL, flash, fl) != 0) {
+		free(fl->request);
+		free(fl);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+ * The checks firmware makes on every chunk, in the order it makes them.
+ */
+static int
+take_chunk(size_t offset, uint8_t *data, size_t len, bool crc_checked,
+	   uint32_t crc)
+{
+	unsigned long n;
+
+	if (config.max_chunk && len > config.max_chunk) {
+		errno = ENOSPC;
+		return -1;
+	}
+	n = ++sim.chunks;
+	if (config.busy && n % config.busy == 0) {
+		sim.refused++;
+		errno = EBUSY;
+		return -1;
+	}
+	if (config.corrupt && n % config.corrupt == 0 && len)
+		data[len / 2] ^= 0xff;
+	if (crc_checked && efi_crc32(data, len) != crc) {
+		sim.refused++;
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset + len > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	return store(offset, data, len);
+}
+
+static int
+firmware_write(const char *name, uint8_t *data, size_t len)
+{
+	const char *component;
+	uint32_t trailer = 0;
+
+	if (config.delay_us)
+		usleep(config.delay_us);
+
+	if (!strcmp(name, FWUP_SET_UPLOAD_OFFSET)) {
+		if (len != sizeof(sim.offset)) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(&sim.offset, data, sizeof(sim.offset));
+		sim.offset = le32_to_cpu(sim.offset);
+		sim.have_offset = true;
+		return 0;
+	}
+
+	if (!strcmp(name, FWUP_CONTINUE_UPLOAD)) {
+		if (!sim.have_offset) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (config.crc) {
+			if (len < sizeof(trailer)) {
+				errno = EINVAL;
+				return -1;
+			}
+			len -= sizeof(trailer);
+			memcpy(&trailer, data + len, sizeof(trailer));
+		}
+		return take_chunk(sim.offset, data, len, config.crc,
+				  le32_to_cpu(trailer));
+	}
+
+	if (!strcmp(name, FWUP_UPLOAD_RECORD)) {
+		fwup_record_header_t hdr;
+
+		if (len < sizeof(hdr)) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(&hdr, data, sizeof(hdr));
+		if (le32_to_cpu(hdr.magic) != FWUP_RECORD_MAGIC ||
+		    le32_to_cpu(hdr.length) != len - sizeof(hdr)) {
+			errno = EINVAL;
+			return -1;
+		}
+		return take_chunk(le32_to_cpu(hdr.offset), data + sizeof(hdr),
+				  len - sizeof(hdr), true, le32_to_cpu(hdr.crc));
+	}
+
+	if (!strcmp(name, FWUP_ELIDED_RANGES)) {
+		if (!(config.caps & FWUP_CAP_ELIDED_MAP) ||
+		    len % sizeof(*sim.elided)) {
+			errno = EINVAL;
+			return -1;
+		}
+		free(sim.elided);
+		sim.elided = malloc(len ? len : 1);
+		if (!sim.elided)
+			return -1;
+		memcpy(sim.elided, data, len);
+		sim.nelided = len / sizeof(*sim.elided);
+		return 0;
+	}
+
+	if (!strcmp(name, FWUP_DELTA_BASE))
+		return delta_base(data, len);
+
+	component = request_component(name);
+	return start_flash(name, component, data, len);
+}
+
+static int
+intercept(efi_guid_t guid, const char *name, const struct iovec *iov,
+	  int iovcnt, uint32_t attributes, mode_t mode)
+{
+	uint8_t *buf, *pos;
+	size_t len = 0;
+	int i, rc;
+
+	if (memcmp(&guid, &sim.guid, sizeof(guid)) ||
+	    (strcmp(name, FWUP_SET_UPLOAD_OFFSET) &&
+	     strcmp(name, FWUP_CONTINUE_UPLOAD) &&
+	     strcmp(name, FWUP_UPLOAD_RECORD) &&
+	     strcmp(name, FWUP_ELIDED_RANGES) &&
+	     strcmp(name, FWUP_DELTA_BASE) && !request_component(name)))
+		return 1;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		return -1;
+	for (i = 0, pos = buf; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+	rc = firmware_write(name, buf, len);
+	pthread_mutex_unlock(&sim.lock);
+	free(buf);
+
+	(void)attributes;
+	(void)mode;
+	return rc;
+}
+
+int PUBLIC
+efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		 size_t data_size, uint32_t attributes, mode_t mode)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = data_size, };
+	int rc;
+
+	rc = intercept(guid, name, &iov, 1, attributes, mode);
+	if (rc <= 0)
+		return rc;
+	return sim.real_set(guid, name, data, data_size, attributes, mode);
+}
+
+int PUBLIC
+efi_set_variable_iov(efi_guid_t guid, const char *name,
+		     const struct iovec *iov, int iovcnt,
+		     uint32_t attributes, mode_t mode)
+{
+	uint8_t *buf, *pos;
+	size_t len = 0;
+	int i, rc;
+
+	rc = intercept(guid, name, iov, iovcnt, attributes, mode);
+	if (rc <= 0)
+		return rc;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		return -1;
+	for (i = 0, pos = buf; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	rc = sim.real_set(guid, name, buf, len, attributes, mode);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Firmware answers for the offset it has, the features it offers and
+ * what it has staged; the status in the request variables is read from disk.
+ * Returns 1 for the variables it doesn't answer for.
+ */
+static int
+answer(efi_guid_t guid, const char *name, uint8_t **data,
+       size_t *data_size, uint32_t *attributes)
+{
+	fwup_staging_t staging;
+	uint32_t value;
+	void *answer = &value;
+	size_t size = sizeof(value);
+	bool have;
+
+	if (memcmp(&guid, &sim.guid, sizeof(guid)))
+		return 1;
+
+	if (!strcmp(name, FWUP_STAGING_DIGEST)) {
+		memset(&staging, '\0', sizeof(staging));
+		pthread_mutex_lock(&sim.lock);
+		load_staging();
+		have = (config.caps & FWUP_CAP_DELTA) && sim.staging;
+		staging.digest = cpu_to_le32(sim.staging_digest);
+		staging.size = cpu_to_le64(sim.staging_size);
+		pthread_mutex_unlock(&sim.lock);
+		answer = &staging;
+		size = sizeof(staging);
+	} else if (!strcmp(name, FWUP_SET_UPLOAD_OFFSET)) {
+		pthread_mutex_lock(&sim.lock);
+		have = sim.have_offset;
+		value = cpu_to_le32(sim.offset);
+		pthread_mutex_unlock(&sim.lock);
+	} else if (!strcmp(name, FWUP_CAPABILITIES)) {
+		have = config.have_caps;
+		value = cpu_to_le32(config.caps);
+	} else {
+		return 1;
+	}
+
+	if (!have) {
+		errno = ENOENT;
+		return -1;
+	}
+	*data = malloc(size);
+	if (!*data)
+		return -1;
+	memcpy(*data, answer, size);
+	*data_size = size;
+	*attributes = FWUP_ATTRS;
+	return 0;
+}
+
+int PUBLIC
+efi_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		 size_t *data_size, uint32_t *attributes)
+{
+	int rc;
+
+	rc = answer(guid, name, data, data_size, attributes);
+	if (rc <= 0)
+		return rc;
+	return sim.real_get(guid, name, data, data_size, attributes);
+}
+
+int PUBLIC
+efi_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+		      size_t bufsize, size_t *needed, uint32_t *attributes)
+{
+	uint8_t *data = NULL;
+	int rc;
+
+	rc = answer(guid, name, &data, needed, attributes);
+	if (rc > 0)
+		return sim.real_get_into(guid, name, buf, bufsize, needed,
+					 attributes);
+	if (rc < 0)
+		return rc;
+	if (*needed > bufsize) {
+		free(data);
+		errno = ERANGE;
+		return -1;
+	}
+	memcpy(buf, data, *needed);
+	free(data);
+	return 0;
+}
+
+int PUBLIC
+efi_variable_open(efi_guid_t guid, const char *name, mode_t mode,
+		  efi_variable_handle_t **handlep)
+{
+	struct sim_var *var;
+
+	var = calloc(1, sizeof(*var));
+	if (!var)
+		return -1;
+	var->guid = guid;
+	var->name = strdup(name);
+	if (!var->name || sim.real_open(guid, name, mode, &var->real) < 0) {
+		free(var->name);
+		free(var);
+		return -1;
+	}
+	*handlep = (efi_variable_handle_t *)var;
+	return 0;
+}
+
+int PUBLIC
+efi_variable_read(efi_variable_handle_t *handle, uint8_t **data,
+		  size_t *data_size, uint32_t *attributes)
+{
+	struct sim_var *var = (struct sim_var *)handle;
+	uint8_t *buf = NULL;
+	int rc;
+
+	rc = answer(var->guid, var->name, &buf, data_size, attributes);
+	if (rc < 0)
+		return rc;
+	if (rc > 0)
+		return sim.real_read(var->real, data, data_size, attributes);
+	free(var->buf);
+	var->buf = *data = buf;
+	return 0;
+}
+
+int PUBLIC
+efi_variable_write(efi_variable_handle_t *handle, const struct iovec *iov,
+		   int iovcnt, uint32_t attributes)
+{
+	struct sim_var *var = (struct sim_var *)handle;
+	int rc;
+
+	rc = intercept(var->guid, var->name, iov, iovcnt, attributes, 0);
+	if (rc <= 0)
+		return rc;
+	return sim.real_write(var->real, iov, iovcnt, attributes);
+}
+
+void PUBLIC
+efi_variable_close(efi_variable_handle_t *handle)
+{
+	struct sim_var *var = (struct sim_var *)handle;
+
+	if (!var)
+		return;
+	sim.real_close(var->real);
+	free(var->buf);
+	free(var->name);
+	free(var);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -14,6 +14,8 @@
 #include <err.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -23,20 +25,62 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <signal.h>
 
 extern char *optarg;
 extern int optind, opterr, optopt;
 
-#include "efivar.h"
+#include "fwupgrade.h"
 
 #define VER_MAJOR	1
 #define VER_MINOR	4
 
 #define ACTION_USAGE		0x00
 #define ACTION_UPGRADE		0x01
+#define ACTION_SHOW_STATUS	0x02
+#define ACTION_DAEMON		0x04
+#define ACTION_INVENTORY	0x08
+
+#define OPT_CHUNK_SIZE		0x100
+
+#define OPT_JOURNAL		0x101
+#define OPT_CHUNK_CRC		0x102
+#define OPT_SINGLE_RECORD	0x103
+#define OPT_MANIFEST		0x104
+#define OPT_JSON		0x105
+#define OPT_STATS		0x106
+#define OPT_STATUS_FILE		0x107
+#define OPT_SHOW_STATUS		0x108
+#define OPT_DAEMON		0x109
+#define OPT_CONNECT		0x10a
+#define OPT_SOCKET		0x10b
+#define OPT_FORCE		0x10c
+#define OPT_INVENTORY		0x10d
+#define OPT_SPARSE		0x10e
+#define OPT_DELTA		0x10f
+#define OPT_DELTA_CACHE		0x110
+#define OPT_PACE		0x111
+#define OPT_DUTY_CYCLE		0x112
+#define OPT_CPU			0x113
 
 static int verbose = 0;
-static char fwupgrade_guid[] = {"38b9ed29-d7c6-4bf4-9678-9da058bd2e99"};
+static size_t chunk_size = 0;
+static bool resume = false;
+static bool chunk_crc = false;
+static bool single_record = false;
+static bool force = false;
+static bool sparse = false;
+static bool delta = false;
+static const char *delta_cache = NULL;
+static fwup_pace_t pace = { .cpu = -1, };
+static bool pacing = false;
+static bool json_output = false;
+static bool stats = false;
+static const char *status_file = AMP_FWUP_STATUS_FILE;
+static fwup_shared_t shared = { .fd = -1, };
+static const char *socket_path = FWUP_DAEMON_SOCKET;
+static bool connect_daemon = false;
+static char *journal_path = NULL;
 static char full_fw_name[] = {"UpgradeATFUEFIRequest"};
 static char uefi_fw_name[] = {"UpgradeUEFIRequest"};
 static char ueficfg_fw_name[] = {"UpgradeCFGUEFIRequest"};
@@ -44,222 +88,445 @@ static char scp_fw_name[] = {"UpgradeSCPRequest"};
 static char single_full_flash_name[] = {"UpgradeSingleImageFullFlashRequest"};
 static char single_fw_only_name[] = {"UpgradeSingleImageFWOnlyRequest"};
 static char single_clear_setting_name[] = {"UpgradeSingleImageClearSettingRequest"};
-static char setup_load_offset_name[] = "UpgradeSetUploadOffset";
-static char continue_upload_name[] = "UpgradeContinueUpload";
+static fwup_progress_t progress;
+static fwup_progress_t batch_events;
+static size_t negotiated_chunk_size = 0;
 
-static int
-parse_status(char *data, char **str_left, char **str_right)
-{
-	if (!data)
-		return -1;
-
-	*str_left = strchr(data, ',');
-	if (!*str_left)
-		return -1;
+/*
+ * Components, in the order a batch upgrades them: SCP first, then the
+ * ATF/UEFI images, then board settings.  A single image carries all of
+ * them, so it can't be combined with anything else.
+ */
+static const struct component {
+	int opt;
+	const char *key;
+	const char *name;
+	int order;
+	bool single;
+} components[] = {
+	{ 's', "scp", scp_fw_name, 0, false },
+	{ 'a', "allfw", full_fw_name, 1, false },
+	{ 'u', "uefi", uefi_fw_name, 2, false },
+	{ 'c', "ueficfg", ueficfg_fw_name, 3, false },
+	{ 'F', "fullfw", single_full_flash_name, 1, true },
+	{ 'f', "atfuefi", single_fw_only_name, 1, true },
+	{ 'C', "clear", single_clear_setting_name, 1, true },
+};
+
+#define MAX_JOBS	(sizeof(components) / sizeof(components[0]))
+
+struct job {
+	const struct component *comp;
+	const char *infile;
+	fwup_upgrade_t upg;
+};
+
+static struct job jobs[MAX_JOBS];
+static unsigned int njobs = 0;
 
-	data[(long)(*str_left) - (long)data] = '\0';
-	*str_right = *str_left + 1;
-	*str_left = data;
+static void
+add_job(int opt, const char *infile)
+{
+	const struct component *comp = NULL;
+	unsigned int i;
 
-	return 0;
+	for (i = 0; i < MAX_JOBS; i++) {
+		if (components[i].opt == opt)
+			comp = &components[i];
+	}
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].comp == comp) {
+			fprintf(stderr, "amp_fwupgrade: --%s given more than once\n",
+				comp->key);
+			exit(1);
+		}
+	}
+	jobs[njobs].comp = comp;
+	jobs[njobs].infile = infile;
+	njobs++;
 }
 
-static void poll_status(const char *name)
+/*
+ * A manifest lists one component per line, as the long option name and
+ * the image, e.g. "scp altra_scp.dbu.sig.img".  Relative image paths are
+ * taken from the manifest's directory; '#' starts a comment.
+ */
+static void
+load_manifest(const char *path)
 {
-	char *str_status = NULL;
-	size_t str_status_size = 0;
-	uint32_t attributes = 0;
-	efi_guid_t guid;
-	char *str_left, *str_right;
-	int rc;
-	unsigned long ul;
-	int first_run = true;
-	int num_retry = 5;
-
-	rc = text_to_guid(fwupgrade_guid, &guid);
-	if (rc < 0)
-		return;
+	char *dir, *line = NULL;
+	size_t linesz = 0;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Could not use \"%s\": %m\n", path);
+		exit(1);
+	}
+	dir = dirname(strdupa(path));
+
+	while (getline(&line, &linesz, f) >= 0) {
+		char *key, *file, *extra, *save = NULL;
+		const struct component *comp = NULL;
+		unsigned int i;
+
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		key = strtok_r(line, " \t", &save);
+		if (!key)
+			continue;
+		file = strtok_r(NULL, " \t", &save);
+		extra = strtok_r(NULL, " \t", &save);
+		for (i = 0; i < MAX_JOBS; i++) {
+			if (!strcmp(components[i].key, key))
+				comp = &components[i];
+		}
+		if (!comp || !file || extra) {
+			fprintf(stderr, "%s:%u: expected \"<component> <image>\"\n",
+				path, lineno);
+			exit(1);
+		}
 
-	do {
-		usleep(50000); /* Sleep 50 ms */
-		rc = efi_get_variable(guid, name, (uint8_t **)&str_status, &str_status_size,
-				&attributes);
-		if (rc < 0) {
-			if (num_retry > 0) {
-				if (verbose) {
-					fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
-					fprintf(stderr, "amp_fwupgrade(%d): retrying\n", __LINE__);
-				}
-				num_retry--;
-				continue;
-			}
+		if (file[0] == '/' || !strcmp(file, "-"))
+			file = strdup(file);
+		else if (asprintf(&file, "%s/%s", dir, file) < 0)
+			file = NULL;
+		if (!file) {
 			fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
 			exit(1);
 		}
+		add_job(comp->opt, file);
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Put the batch in upgrade order and check every image before the
+ * first byte goes to firmware.
+ */
+static void
+schedule_jobs(void)
+{
+	unsigned int i, j, stdin_users = 0;
+	struct job tmp;
 
-		str_status[str_status_size - 1] = '\0';
-		rc = parse_status(str_status, &str_left, &str_right);
-		if (rc < 0) {
-			fprintf(stderr, "amp_fwupgrade(%d): failed to parse status\n", __LINE__);
-			if (str_status)
-				free(str_status);
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].comp->single && njobs > 1) {
+			fprintf(stderr, "amp_fwupgrade: --%s is a single image and can't be combined with other components\n",
+				jobs[i].comp->key);
 			exit(1);
 		}
+		if (!strcmp(jobs[i].infile, "-"))
+			stdin_users++;
+	}
+	if (stdin_users > 1) {
+		fprintf(stderr, "amp_fwupgrade: only one image can come from standard input\n");
+		exit(1);
+	}
+	if (journal_path && njobs > 1) {
+		fprintf(stderr, "amp_fwupgrade: --journal takes a single component\n");
+		exit(1);
+	}
 
-		if (!strcmp(str_left, "NULL")) {
-			/* Not started */
-			free(str_status);
-			return;
-		}
-		if (strstr(str_right, "IN_PROCESS,")) {
-			if (first_run)
-				fprintf(stdout, "Upgrading %s ", str_left);
-			rc = parse_status(str_right, &str_left, &str_right);
-			if (rc < 0) {
-				fprintf(stderr, "\namp_fwupgrade(%d): failed to parse percentage process\n", __LINE__);
-				free(str_status);
-				exit(1);
-			}
-			ul = strtoul(str_right, NULL, 0);
-			if (ul > 0) {
-				if (first_run)
-					fprintf(stdout, "processed: %2lu%%", ul);
-				else
-					fprintf(stdout, "\b\b\b%2lu%%", ul);
-			}
-			fflush(stdout);
-		} else {
-			if (!strcmp(str_right, "SUCCESS")) {
-				fprintf(stdout, "\b\b\b100%%\n");
-				fprintf(stdout, "Upgraded %s succesfully\n", str_left);
-			}
-			else
-				fprintf(stderr, "\nError while upgrading %s with status %s\n", str_left, str_right);
-			free(str_status);
-			return;
-		}
-		if (first_run)
-			first_run = false;
-		free(str_status);
-	} while (1);
+	/* Stable, so equal ranks keep the order they were given in. */
+	for (i = 1; i < njobs; i++) {
+		tmp = jobs[i];
+		for (j = i; j > 0 && jobs[j - 1].comp->order > tmp.comp->order; j--)
+			jobs[j] = jobs[j - 1];
+		jobs[j] = tmp;
+	}
 }
 
 static void
-start_fwupgrade(const char *name, void *data, size_t data_size)
+open_jobs(void)
 {
-	#define MAX_XFER_SIZE		(1024 * 1024)
-	size_t str_status_size = 0;
-	uint32_t attributes = 0;
-	efi_guid_t guid;
-	char *str_status = NULL;
-	char *str_left, *str_right;
+	unsigned int i;
+
+	for (i = 0; i < njobs; i++) {
+		fwup_upgrade_t *upg = &jobs[i].upg;
+
+		upg->name = jobs[i].comp->name;
+		upg->filename = jobs[i].infile;
+		upg->chunk_size = chunk_size;
+		upg->chunk_crc = chunk_crc;
+		upg->single_record = single_record;
+		upg->resume = resume;
+		upg->force = force;
+		upg->sparse = sparse;
+		upg->delta = delta;
+		upg->journal_path = journal_path;
+		upg->cache_dir = delta_cache;
+		upg->pace = pacing ? &pace : NULL;
+		upg->progress = &progress;
+		upg->wake_fd = -1;
+		if (fwup_upgrade_open(upg) < 0)
+			exit(1);
+	}
+}
+
+/*
+ * With --json, messages become events too: the current component's
+ * while one is running, otherwise ones that belong to no component.
+ */
+static void
+json_message(bool warning, const char *message, void *data UNUSED)
+{
+	fwup_progress_message(progress.events ? &progress : &batch_events,
+			      warning, message);
+}
+
+static int
+upgrade(struct job *job)
+{
+	fwup_upgrade_t *upg = &job->upg;
+	int error = 0;
 	int rc;
-	uint32_t up_loaded;
-	uint32_t xfer_size;
 
-	fprintf(stdout, "amp_fwupgrade: Initializing\n");
-	rc = text_to_guid(fwupgrade_guid, &guid);
+	if (json_output) {
+		fwup_progress_init(&progress, upg->name);
+		fwup_progress_events(&progress, stdout, upg->filename);
+	} else if (fwup_progress_start(&progress, upg->name) < 0) {
+		fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
+		exit(1);
+	}
+	if (shared.page)
+		fwup_progress_publish(&progress, &shared);
+	upg->negotiated = negotiated_chunk_size;
+	rc = fwup_upgrade_send(upg);
+	fwup_upgrade_close(upg);
+	if (rc == 0) {
+		negotiated_chunk_size = upg->negotiated;
+		rc = fwup_upgrade_poll(upg);
+	}
 	if (rc < 0)
-		return;
+		error = errno;
+
+	if (rc == 0 && upg->current) {
+		/* Said so already. */
+	} else if (rc == 0 && upg->result[0] && !json_output) {
+		fprintf(stdout, "\b\b\b100%%\n");
+		fprintf(stdout, "Upgraded %s succesfully\n", upg->component);
+	} else if (rc < 0 && upg->result[0]) {
+		fprintf(stderr, "\nError while upgrading %s with status %s\n",
+			upg->component, upg->result);
+	}
+	fwup_progress_result(&progress, upg->component, upg->result, error);
+	if (stats)
+		fwup_progress_summary(&progress, json_output ? stderr : stdout);
+	fwup_progress_stop(&progress);
+	memset(&progress, '\0', sizeof(progress));
+	return rc;
+}
 
-	rc = efi_get_variable(guid, name, (uint8_t **)&str_status, &str_status_size,
-			      &attributes);
-	if (rc == 0) {
-		rc = parse_status(str_status, &str_left, &str_right);
-		if (rc < 0) {
-			fprintf(stderr, "amp_fwupgrade(%d): failed to parse status\n", __LINE__);
-			if (str_status)
-				free(str_status);
+/*
+ * With --connect the daemon does the work; its events are copied to
+ * stdout as they come.
+ */
+static void
+connect_jobs(void)
+{
+	char image[PATH_MAX];
+	uint32_t flags;
+	unsigned int i;
+
+	if (journal_path) {
+		fprintf(stderr, "amp_fwupgrade: --journal can't be used with --connect\n");
+		exit(1);
+	}
+	if (delta_cache) {
+		fprintf(stderr, "amp_fwupgrade: --delta-cache can't be used with --connect\n");
+		exit(1);
+	}
+	if (pacing) {
+		fprintf(stderr, "amp_fwupgrade: pacing is set on the daemon, not with --connect\n");
+		exit(1);
+	}
+	flags = (chunk_crc ? AMP_FWUP_CHUNK_CRC : 0) |
+		(single_record ? AMP_FWUP_SINGLE_RECORD : 0) |
+		(resume ? AMP_FWUP_RESUME : 0) |
+		(force ? AMP_FWUP_FORCE : 0) |
+		(sparse ? AMP_FWUP_SPARSE : 0) |
+		(delta ? AMP_FWUP_DELTA : 0);
+
+	for (i = 0; i < njobs; i++) {
+		if (!strcmp(jobs[i].infile, "-")) {
+			fprintf(stderr, "amp_fwupgrade: the daemon can't read standard input\n");
 			exit(1);
 		}
-
-		/* Only upgrade if has not started */
-		if (strstr(str_right, "IN_PROCESS")) {
-			fprintf(stderr, "amp_fwupgrade: Can't start upgrading: (%s,%s)\n", str_left, str_right);
-			free(str_status);
+		if (!realpath(jobs[i].infile, image)) {
+			fprintf(stderr, "amp_fwupgrade: %s: %m\n", jobs[i].infile);
 			exit(1);
 		}
-	}
-
-	if (data_size > MAX_XFER_SIZE) {
-		up_loaded = 0;
-		while (up_loaded < data_size) {
-			rc = efi_set_variable(guid, setup_load_offset_name,
-						(uint8_t *) &up_loaded, sizeof(up_loaded),
-						EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_RUNTIME_ACCESS | EFI_VARIABLE_BOOTSERVICE_ACCESS, 0644);
-			if (rc < 0) {
-				fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
-				exit(1);
-			}
-			xfer_size = data_size - up_loaded;
-			if (xfer_size > MAX_XFER_SIZE)
-				xfer_size = MAX_XFER_SIZE;
-			rc = efi_set_variable(guid, continue_upload_name,
-					(uint8_t *) data + up_loaded, xfer_size,
-					EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_RUNTIME_ACCESS | EFI_VARIABLE_BOOTSERVICE_ACCESS, 0644);
-			if (rc < 0) {
-				fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
-				exit(1);
-			}
-			up_loaded += xfer_size;
+		if (fwup_daemon_request(socket_path, jobs[i].comp->name, image,
+					chunk_size, flags, stdout) < 0) {
+			if (errno != EIO)
+				fprintf(stderr, "amp_fwupgrade: %s: %m\n",
+					socket_path);
+			exit(1);
 		}
 	}
+}
 
-	if (data_size > MAX_XFER_SIZE)
-		xfer_size = MAX_XFER_SIZE;
-	else
-		xfer_size = data_size;
-	rc = efi_set_variable(guid, name,
-				data, xfer_size,
-				EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_RUNTIME_ACCESS | EFI_VARIABLE_BOOTSERVICE_ACCESS, 0644);
+/*
+ * One line a fleet rollout can collect from every node.
+ */
+static void
+summary(unsigned int upgraded, unsigned int current, unsigned int failed)
+{
+	fwup_info("Summary: %u upgraded, %u already current, %u failed, %u not attempted",
+		  upgraded, current, failed, njobs - upgraded - current - failed);
+}
 
-	free(str_status);
+static void
+run_jobs(void)
+{
+	unsigned int upgraded = 0, current = 0;
+	unsigned int i;
 
-	if (rc < 0) {
-		fprintf(stderr, "amp_fwupgrade(%d): %m\n", __LINE__);
+	schedule_jobs();
+	if (connect_daemon) {
+		connect_jobs();
+		return;
+	}
+	/* The daemon owns the upgrade variables while it runs. */
+	if (fwup_daemon_running(socket_path)) {
+		fprintf(stderr, "amp_fwupgrade: a daemon is running on %s, use --connect\n",
+			socket_path);
 		exit(1);
 	}
-	fprintf(stdout, "amp_fwupgrade: Upgrade is in process, do not terminate this application\n");
+	open_jobs();
+
+	/* Nice to have; the upgrade goes ahead without it. */
+	if (fwup_shared_open(&shared, status_file) < 0) {
+		if (errno == EBUSY)
+			fwup_warn("%s: another amp_fwupgrade is publishing its status there",
+				  status_file);
+		else if (verbose)
+			fwup_warn("not publishing status to %s: %m",
+				  status_file);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (njobs > 1)
+			fwup_info("Component %u of %u: %s from %s", i + 1,
+				  njobs, jobs[i].comp->key, jobs[i].infile);
+		if (upgrade(&jobs[i]) < 0) {
+			if (i + 1 < njobs)
+				fwup_warn("stopping, %u component(s) not upgraded",
+					  njobs - i - 1);
+			summary(upgraded, current, 1);
+			exit(1);
+		}
+		if (jobs[i].upg.current)
+			current++;
+		else
+			upgraded++;
+	}
+	summary(upgraded, current, 0);
 }
 
 static void
-prepare_data(const char *filename, uint8_t **data, size_t *data_size)
+run_daemon(void)
 {
-	int fd = -1;
-	void *buf;
-	size_t buflen = 0;
-	struct stat statbuf;
-	int rc;
-
-	if (filename == NULL) {
-		fprintf(stderr, "Input filename must be provided.\n");
+	if (njobs) {
+		fprintf(stderr, "amp_fwupgrade: --daemon takes its components from clients\n");
 		exit(1);
 	}
+	/* Its log is most likely going to a file. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	fwup_daemon_run(socket_path, status_file, pacing ? &pace : NULL);
+	fprintf(stderr, "amp_fwupgrade: %s: %m\n", socket_path);
+	exit(1);
+}
+
+/*
+ * What firmware says it runs, one component per line.
+ */
+static void
+show_inventory(void)
+{
+	char version[FWUP_VERSION_MAX + 1];
+	const char *component, *shown[MAX_JOBS];
+	unsigned int i, j, nshown = 0;
+
+	for (i = 0; i < MAX_JOBS; i++) {
+		component = fwup_request_component(components[i].name);
+		for (j = 0; j < nshown; j++) {
+			if (!strcmp(shown[j], component))
+				break;
+		}
+		if (j < nshown)
+			continue;
+		shown[nshown++] = component;
+		if (fwup_running_version(component, version, sizeof(version)) < 0)
+			fprintf(stdout, "%s: unknown\n", component);
+		else
+			fprintf(stdout, "%s: %s\n", component, version);
+	}
+}
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		goto err;
+static void
+show_status(void)
+{
+	static const char * const states[] = {
+		[AMP_FWUP_STARTING] = "starting",
+		[AMP_FWUP_UPLOADING] = "uploading",
+		[AMP_FWUP_REQUESTING] = "requesting",
+		[AMP_FWUP_FLASHING] = "flashing",
+		[AMP_FWUP_SUCCEEDED] = "succeeded",
+		[AMP_FWUP_FAILED] = "failed",
+		[AMP_FWUP_CANCELLED] = "cancelled",
+	};
+	amp_fwup_status_t st;
+	bool running;
 
-	memset(&statbuf, '\0', sizeof (statbuf));
-	rc = fstat(fd, &statbuf);
-	if (rc < 0)
-		goto err;
-
-	buflen = statbuf.st_size;
-	buf = mmap(NULL, buflen, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
-	if (buf == MAP_FAILED)
-		goto err;
-
-	*data = buf;
-	*data_size = buflen;
-
-	close(fd);
-	return;
-err:
-	if (fd >= 0)
-		close(fd);
-	fprintf(stderr, "Could not use \"%s\": %m\n", filename);
-	exit(1);
+	if (fwup_shared_read(status_file, &st) < 0) {
+		fprintf(stderr, "amp_fwupgrade: %s: %m\n", status_file);
+		exit(1);
+	}
+	running = kill(st.pid, 0) == 0 || errno == EPERM;
+
+	fprintf(stdout, "%.*s: %s", (int)sizeof(st.request), st.request,
+		st.state < sizeof(states) / sizeof(states[0]) ?
+		states[st.state] : "unknown");
+	if (st.component[0])
+		fprintf(stdout, " %.*s", (int)sizeof(st.component),
+			st.component);
+	fprintf(stdout, ", %" PRIu64 " of %" PRIu64 " bytes uploaded, flash %u%%",
+		st.uploaded, st.total, st.percent);
+	if (st.error)
+		fprintf(stdout, ", %s", strerror(st.error));
+	fprintf(stdout, " (pid %u%s)\n", st.pid, running ? "" : ", exited");
+}
+
+static size_t
+parse_size(const char *arg)
+{
+	unsigned long long size;
+	size_t multiplier = 1;
+	char *end = NULL;
+
+	errno = 0;
+	size = strtoull(arg, &end, 0);
+	if (errno || end == arg)
+		return 0;
+	switch (*end) {
+		case 'k':
+		case 'K':
+			multiplier = 1024;
+			end++;
+			break;
+		case 'm':
+		case 'M':
+			multiplier = 1024 * 1024;
+			end++;
+			break;
+	}
+	if (*end != '\0' || size > SIZE_MAX / multiplier)
+		return 0;
+	return size * multiplier;
 }
 
 static void __attribute__((__noreturn__))
@@ -283,6 +550,47 @@ usage(int ret)
 		"                   , --fullfw=<file>       -F: Full flash\n"
 		"                   , --atfuefi=<file>      -f: Only ATF and UEFI be flashed\n"
 		"                   , --clear=<file>        -C: Only erase FW setting\n"
+		"  <file> may be - to read the image from standard input\n"
+		"  zstd and xz compressed images are decompressed on the fly\n"
+		"  Several components may be given; they are upgraded one after another\n"
+		"      --manifest=<file>               Upgrade the components listed in <file>,\n"
+		"                                      one \"<component> <image>\" per line,\n"
+		"                                      e.g. \"scp altra_scp.img\"\n"
+		"Upload options:\n"
+		"      --chunk-size=<bytes>            Use <bytes> per upload chunk instead of probing\n"
+		"                                      (1K to 8M; accepts K and M suffixes)\n"
+		"      --chunk-crc                     Append a CRC32 to each chunk for firmware to verify\n"
+		"      --single-record                 Send offset and data in one write when firmware supports it\n"
+		"      --sparse                        Skip chunks of erased flash when firmware pre-fills them\n"
+		"      --delta                         Send only the chunks changed since the last upload\n"
+		"                                      when firmware still holds it\n"
+		"      --delta-cache=<dir>             Keep the images compared with in <dir>\n"
+		"                                      (default: " FWUP_CACHE_DIR ")\n"
+		"  -r, --resume                        Resume an interrupted upload of the same image\n"
+		"      --force                         Flash images firmware reports it already runs,\n"
+		"                                      or whose name is for another component\n"
+		"      --pace=<bytes>                  Upload at most <bytes> a second, from the --cpu\n"
+		"                                      CPU at idle priority (1K to 8M; accepts K and M suffixes)\n"
+		"      --duty-cycle=<percent>          Spend at most <percent> of the upload time writing\n"
+		"      --cpu=<n>                       Upload from CPU <n> at idle priority\n"
+		"                                      (firmware calls still run on any CPU)\n"
+		"      --journal=<file>                Keep the resume journal in <file>\n"
+		"                                      (default: " FWUP_JOURNAL_DIR "/<request>.journal)\n"
+		"Output options:\n"
+		"      --json                          Report progress as JSON lines on stdout, one event\n"
+		"                                      per phase change, chunk and flash step\n"
+		"      --stats                         Print how long each phase took\n"
+		"      --status-file=<file>            Publish progress for other programs in <file>\n"
+		"                                      (default: " AMP_FWUP_STATUS_FILE ")\n"
+		"      --show-status                   Show the progress published there and exit\n"
+		"      --inventory                     Show the firmware versions running and exit\n"
+		"Daemon options:\n"
+		"      --daemon                        Run upgrades for clients of the daemon socket,\n"
+		"                                      one at a time, until killed\n"
+		"      --connect                       Have the daemon run the upgrade; its progress is\n"
+		"                                      reported as with --json\n"
+		"      --socket=<file>                 Use <file> as the daemon socket\n"
+		"                                      (default: " FWUP_DAEMON_SOCKET ")\n"
 		"Help options:\n"
 		"  -?, --help                          Show this help message\n"
 		"      --usage                         Display brief usage message\n"
@@ -310,11 +618,8 @@ int main(int argc, char *argv[])
 	int c = 0;
 	int i = 0;
 	int action = 0;
-	uint8_t *data = NULL;
-	size_t data_size = 0;
-	char *infile = NULL;
-	char *name = NULL;
-	char *sopts = "a:c:u:s:f:F:C:v?V";
+	char *end = NULL;
+	char *sopts = "a:c:u:s:f:F:C:rv?V";
 	struct option lopts[] = {
 		{"allfw", required_argument, 0, 'a'},
 		{"ueficfg", required_argument, 0, 'c'},
@@ -323,6 +628,27 @@ int main(int argc, char *argv[])
 		{"fullfw", required_argument, 0, 'F'},
 		{"atfuefi", required_argument, 0, 'f'},
 		{"clear", required_argument, 0, 'C'},
+		{"manifest", required_argument, 0, OPT_MANIFEST},
+		{"chunk-size", required_argument, 0, OPT_CHUNK_SIZE},
+		{"resume", no_argument, 0, 'r'},
+		{"journal", required_argument, 0, OPT_JOURNAL},
+		{"chunk-crc", no_argument, 0, OPT_CHUNK_CRC},
+		{"single-record", no_argument, 0, OPT_SINGLE_RECORD},
+		{"json", no_argument, 0, OPT_JSON},
+		{"stats", no_argument, 0, OPT_STATS},
+		{"status-file", required_argument, 0, OPT_STATUS_FILE},
+		{"show-status", no_argument, 0, OPT_SHOW_STATUS},
+		{"force", no_argument, 0, OPT_FORCE},
+		{"sparse", no_argument, 0, OPT_SPARSE},
+		{"delta", no_argument, 0, OPT_DELTA},
+		{"delta-cache", required_argument, 0, OPT_DELTA_CACHE},
+		{"pace", required_argument, 0, OPT_PACE},
+		{"duty-cycle", required_argument, 0, OPT_DUTY_CYCLE},
+		{"cpu", required_argument, 0, OPT_CPU},
+		{"inventory", no_argument, 0, OPT_INVENTORY},
+		{"daemon", no_argument, 0, OPT_DAEMON},
+		{"connect", no_argument, 0, OPT_CONNECT},
+		{"socket", required_argument, 0, OPT_SOCKET},
 		{"help", no_argument, 0, '?'},
 		{"usage", no_argument, 0, 0},
 		{"verbose", no_argument, 0, 'v'},
@@ -333,40 +659,104 @@ int main(int argc, char *argv[])
 	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
 		switch (c) {
 			case 'a':
-				infile = optarg;
-				name = full_fw_name;
-				action |= ACTION_UPGRADE;
-				break;
 			case 'c':
-				infile = optarg;
-				name = ueficfg_fw_name;
-				action |= ACTION_UPGRADE;
-				break;
 			case 'u':
-				infile = optarg;
-				name = uefi_fw_name;
-				action |= ACTION_UPGRADE;
-				break;
 			case 's':
-				infile = optarg;
-				name = scp_fw_name;
-				action |= ACTION_UPGRADE;
-				break;
 			case 'F':
-				infile = optarg;
-				name = single_full_flash_name;
-				action |= ACTION_UPGRADE;
-				break;
 			case 'f':
-				infile = optarg;
-				name = single_fw_only_name;
+			case 'C':
+				add_job(c, optarg);
 				action |= ACTION_UPGRADE;
 				break;
-			case 'C':
-				infile = optarg;
-				name = single_clear_setting_name;
+			case OPT_MANIFEST:
+				load_manifest(optarg);
 				action |= ACTION_UPGRADE;
 				break;
+			case OPT_CHUNK_SIZE:
+				chunk_size = parse_size(optarg);
+				if (chunk_size < FWUP_CHUNK_SIZE_MIN ||
+				    chunk_size > FWUP_CHUNK_SIZE_MAX) {
+					fprintf(stderr, "Invalid chunk size \"%s\": must be %d to %d bytes\n",
+						optarg, FWUP_CHUNK_SIZE_MIN, FWUP_CHUNK_SIZE_MAX);
+					exit(1);
+				}
+				break;
+			case 'r':
+				resume = true;
+				break;
+			case OPT_CHUNK_CRC:
+				chunk_crc = true;
+				break;
+			case OPT_SINGLE_RECORD:
+				single_record = true;
+				break;
+			case OPT_JSON:
+				json_output = true;
+				break;
+			case OPT_STATS:
+				stats = true;
+				break;
+			case OPT_STATUS_FILE:
+				status_file = optarg;
+				break;
+			case OPT_SHOW_STATUS:
+				action |= ACTION_SHOW_STATUS;
+				break;
+			case OPT_FORCE:
+				force = true;
+				break;
+			case OPT_SPARSE:
+				sparse = true;
+				break;
+			case OPT_DELTA:
+				delta = true;
+				break;
+			case OPT_DELTA_CACHE:
+				delta_cache = optarg;
+				delta = true;
+				break;
+			case OPT_PACE:
+				pace.rate = parse_size(optarg);
+				if (!pace.rate) {
+					fprintf(stderr, "Invalid upload rate \"%s\"\n", optarg);
+					exit(1);
+				}
+				pacing = true;
+				break;
+			case OPT_DUTY_CYCLE:
+				pace.duty = strtoul(optarg, &end, 10);
+				if (end == optarg || *end != '\0' ||
+				    pace.duty < 1 || pace.duty > 100) {
+					fprintf(stderr, "Invalid duty cycle \"%s\"\n", optarg);
+					exit(1);
+				}
+				pacing = true;
+				break;
+			case OPT_CPU:
+				pace.cpu = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' ||
+				    pace.cpu < 0 || pace.cpu >= CPU_SETSIZE) {
+					fprintf(stderr, "Invalid CPU \"%s\"\n", optarg);
+					exit(1);
+				}
+				pacing = true;
+				break;
+			case OPT_INVENTORY:
+				action |= ACTION_INVENTORY;
+				break;
+			case OPT_DAEMON:
+				action |= ACTION_DAEMON;
+				break;
+			case OPT_CONNECT:
+				connect_daemon = true;
+				break;
+			case OPT_SOCKET:
+				socket_path = optarg;
+				break;
+			case OPT_JOURNAL:
+				journal_path = optarg;
+				resume = true;
+				break;
 			case 'v':
 				verbose += 1;
 				break;
@@ -385,11 +775,24 @@ int main(int argc, char *argv[])
 
 	efi_set_verbose(verbose, stderr);
 
+	if (json_output) {
+		fwup_progress_init(&batch_events, NULL);
+		fwup_progress_events(&batch_events, stdout, NULL);
+		fwup_set_message_sink(json_message, NULL);
+	}
+
 	switch (action) {
 		case ACTION_UPGRADE:
-			prepare_data(infile, &data, &data_size);
-			start_fwupgrade(name, data, data_size);
-			poll_status(name);
+			run_jobs();
+			break;
+		case ACTION_SHOW_STATUS:
+			show_status();
+			break;
+		case ACTION_DAEMON:
+			run_daemon();
+			break;
+		case ACTION_INVENTORY:
+			show_inventory();
 			break;
 		case ACTION_USAGE:
 		default:
@@ -6,7 +6,6 @@
 
 #include "fix_coverity.h"
 
-#include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/magic.h>
@@ -29,39 +28,37 @@
 #endif
 
 static char const default_efivarfs_path[] = "/sys/firmware/efi/efivars/";
-static char *efivarfs_path;
+static struct store_dir *efivarfs_dir;
 
+/* read each time, so a program can point us somewhere else */
 static char const *
 get_efivarfs_path(void)
 {
-	if (efivarfs_path)
-		return efivarfs_path;
+	char const *path = secure_getenv("EFIVARFS_PATH");
 
-	efivarfs_path = secure_getenv("EFIVARFS_PATH");
-	if (efivarfs_path)
-		efivarfs_path = strdup(efivarfs_path);
-	else
-		efivarfs_path = strdup(default_efivarfs_path);
-
-	if (!efivarfs_path)
-		err(1, "couldn't allocate memory");
+	return path ? path : default_efivarfs_path;
+}
 
-	return efivarfs_path;
+static void DESTRUCTOR
+fini_efivarfs_dir(void)
+{
+	put_store_dir(&efivarfs_dir);
 }
 
-static void CONSTRUCTOR
-init_efivarfs_path(void)
+static int
+get_efivarfs_dirfd(void)
 {
-	get_efivarfs_path();
+	int dfd = get_store_dirfd(get_efivarfs_path(), &efivarfs_dir);
+
+	if (dfd < 0)
+		efi_error("open(%s, O_PATH) failed", get_efivarfs_path());
+	return dfd;
 }
 
-static void DESTRUCTOR
-fini_efivarfs_path(void)
+static int
+efivarfs_store_changed(void)
 {
-	if (efivarfs_path) {
-		free(efivarfs_path);
-		efivarfs_path = NULL;
-	}
+	return store_dir_changed(get_efivarfs_path(), &efivarfs_dir);
 }
 
 static int
@@ -98,13 +95,32 @@ efivarfs_probe(void)
 	return 0;
 }
 
-#define make_efivarfs_path(str, guid, name) ({				\
-		asprintf(str, "%s%s-" GUID_FORMAT, get_efivarfs_path(),	\
-			name, (guid).a, (guid).b, (guid).c,		\
-			bswap_16((guid).d),				\
-			(guid).e[0], (guid).e[1], (guid).e[2],		\
-			(guid).e[3], (guid).e[4], (guid).e[5]);		\
-	})
+/*
+ * Variables are files named "<name>-<guid>" in the efivarfs directory;
+ * the name is built in a buffer of EFIVARFS_NAME_SIZE on the stack.
+ */
+#define EFIVARFS_NAME_SIZE	(NAME_MAX + 1)
+
+/* reads of small variables into a caller's buffer bounce off the stack */
+#define EFIVARFS_BOUNCE_SIZE	4096
+
+static int
+make_efivarfs_name(char *file, efi_guid_t guid, const char *name)
+{
+	int rc;
+
+	rc = snprintf(file, EFIVARFS_NAME_SIZE, "%s-" GUID_FORMAT, name,
+		      guid.a, guid.b, guid.c, bswap_16(guid.d),
+		      guid.e[0], guid.e[1], guid.e[2],
+		      guid.e[3], guid.e[4], guid.e[5]);
+	if (rc < 0)
+		return -1;
+	if (rc >= EFIVARFS_NAME_SIZE) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
 
 static int
 efivarfs_set_fd_immutable(int fd, int immutable)
@@ -155,13 +171,13 @@ efivarfs_make_fd_mutable(int fd, unsigned long *orig_attrs)
 }
 
 static int
-efivarfs_set_immutable(char *path, int immutable)
+efivarfs_set_immutable(int dfd, const char *path, int immutable)
 {
 	__typeof__(errno) error = 0;
 	int fd;
 	int rc = 0;
 
-	fd = open(path, O_RDONLY);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		if (errno == ENOTTY) {
 			efi_error("open(%s, O_RDONLY) failed", path);
@@ -184,57 +200,157 @@ efivarfs_set_immutable(char *path, int immutable)
 static int
 efivarfs_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 {
-	char *path = NULL;
+	char path[EFIVARFS_NAME_SIZE];
+	int dfd;
 	int rc = 0;
-	int ret = -1;
-	__typeof__(errno) errno_value;
 
-	rc = make_efivarfs_path(&path, guid, name);
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	rc = make_efivarfs_name(path, guid, name);
 	if (rc < 0) {
-		efi_error("make_efivarfs_path failed");
-		goto err;
+		efi_error("make_efivarfs_name failed");
+		return -1;
 	}
 
 	struct stat statbuf = { 0, };
-	rc = stat(path, &statbuf);
+	rc = fstatat(dfd, path, &statbuf, 0);
 	if (rc < 0) {
 		efi_error("stat(%s) failed", path);
-		goto err;
+		return -1;
 	}
 
-	ret = 0;
 	/* Compensate for the size of the Attributes field. */
 	*size = statbuf.st_size - sizeof (uint32_t);
-err:
-	errno_value = errno;
+	return 0;
+}
 
-	if (path)
-		free(path);
+/*
+ * The attributes are the first four bytes of the file.  efivarfs still
+ * has firmware fetch the whole variable for a read of any size, but
+ * reading only those four saves copying and allocating the data.  The
+ * read refreshes the inode size, so take that afterwards.
+ */
+static int
+efivarfs_read_metadata(int dfd, const char *path, size_t *size,
+		       uint32_t *attributes)
+{
+	struct stat st;
+	int errno_value;
+	ssize_t sz;
+	int fd;
+	int rc = -1;
 
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s) failed", path);
+		return -1;
+	}
+
+	/* See efivarfs_get_variable() about the rate limiter. */
+	if (geteuid() != 0)
+		usleep(10000);
+	do {
+		sz = pread(fd, attributes, sizeof(*attributes), 0);
+	} while (sz < 0 && errno == EINTR);
+	if (sz < 0) {
+		efi_error("read(%s) failed", path);
+		goto err;
+	}
+	if ((size_t)sz < sizeof(*attributes)) {
+		errno = ENODATA;
+		efi_error("%s has no attributes", path);
+		goto err;
+	}
+
+	if (size) {
+		if (fstat(fd, &st) < 0) {
+			efi_error("fstat(%s) failed", path);
+			goto err;
+		}
+		*size = st.st_size > (off_t)sizeof(*attributes)
+			? st.st_size - sizeof(*attributes) : 0;
+	}
+	rc = 0;
+err:
+	errno_value = errno;
+	close(fd);
 	errno = errno_value;
-	return ret;
+	return rc;
 }
 
 static int
 efivarfs_get_variable_attributes(efi_guid_t guid, const char *name,
 			    uint32_t *attributes)
 {
-	int ret = -1;
-
-	uint8_t *data;
-	size_t data_size;
-	uint32_t attribs;
+	char path[EFIVARFS_NAME_SIZE];
+	int dfd;
 
-	ret = efi_get_variable(guid, name, &data, &data_size, &attribs);
-	if (ret < 0) {
-		efi_error("efi_get_variable failed");
-		return ret;
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (make_efivarfs_name(path, guid, name) < 0) {
+		efi_error("make_efivarfs_name failed");
+		return -1;
 	}
 
-	*attributes = attribs;
-	if (data)
-		free(data);
-	return ret;
+	return efivarfs_read_metadata(dfd, path, NULL, attributes);
+}
+
+static int
+efivarfs_get_variables_metadata(const efi_guid_t *guid,
+				efi_variable_metadata_t **entries,
+				size_t *n_entries)
+{
+	int dfd;
+
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	return generic_get_variables_metadata(dfd, guid,
+					      efivarfs_read_metadata,
+					      entries, n_entries);
+}
+
+/*
+ * One pread() of the whole variable, attributes first, into the bufsize
+ * bytes at buf.  efivarfs has only ->read, not ->read_iter, so a preadv()
+ * is one ->read, and one GetVariable() call, per iovec, and its pieces
+ * can come from different versions of a variable firmware is updating.
+ * A read that fills buf may have been cut short, so that fails with
+ * ERANGE and *needed set to the size to try again with: the inode's,
+ * which the read has just brought up to date, and a byte to tell a
+ * short buffer from an exact fit, but at least double bufsize.
+ * Otherwise *needed is the number of bytes read.
+ */
+static int
+efivarfs_read_fd(int fd, uint8_t *buf, size_t bufsize, size_t *needed)
+{
+	struct stat st;
+	ssize_t sz;
+
+	do {
+		sz = pread(fd, buf, bufsize, 0);
+	} while (sz < 0 && errno == EINTR);
+	if (sz < 0) {
+		efi_error("pread(%d) failed", fd);
+		return -1;
+	}
+	if ((size_t)sz == bufsize) {
+		*needed = bufsize ? bufsize * 2 : 4096;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)*needed)
+			*needed = st.st_size + 1;
+		errno = ERANGE;
+		return -1;
+	}
+	if ((size_t)sz < sizeof (uint32_t)) {
+		errno = ENODATA;
+		efi_error("fd %d is too short for a variable (%zd bytes)",
+			  fd, sz);
+		return -1;
+	}
+	*needed = sz;
+	return 0;
 }
 
 static int
@@ -245,9 +361,12 @@ efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	int ret = -1;
 	size_t size = 0;
 	uint32_t ret_attributes = 0;
-	uint8_t *ret_data;
+	uint8_t *ret_data = NULL;
+	uint8_t *new_data;
+	struct stat st;
 	int fd = -1;
-	char *path = NULL;
+	char path[EFIVARFS_NAME_SIZE];
+	int dfd;
 	int rc;
 	int ratelimit;
 
@@ -260,46 +379,140 @@ efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	 */
 	ratelimit = geteuid() == 0 ? 0 : 10000;
 
-	rc = make_efivarfs_path(&path, guid, name);
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		goto err;
+	rc = make_efivarfs_name(path, guid, name);
 	if (rc < 0) {
-		efi_error("make_efivarfs_path failed");
+		efi_error("make_efivarfs_name failed");
 		goto err;
 	}
 
-	fd = open(path, O_RDONLY);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		efi_error("open(%s)", path);
 		goto err;
 	}
 
-	usleep(ratelimit);
-	rc = read(fd, &ret_attributes, sizeof (ret_attributes));
-	if (rc < 0) {
-		efi_error("read failed");
-		goto err;
+	/*
+	 * The inode size is the attributes and data as last read, so one
+	 * read of that much, and the byte read_fd() wants past it, normally
+	 * gets it all.
+	 */
+	size = 4096;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		size = st.st_size + 1;
+	for (;;) {
+		new_data = realloc(ret_data, size);
+		if (!new_data) {
+			efi_error("could not allocate memory");
+			goto err;
+		}
+		ret_data = new_data;
+
+		usleep(ratelimit);
+		rc = efivarfs_read_fd(fd, ret_data, size, &size);
+		if (rc == 0)
+			break;
+		if (errno != ERANGE) {
+			efi_error("efivarfs_read_fd(%s) failed", path);
+			goto err;
+		}
 	}
 
-	usleep(ratelimit);
-	rc = read_file(fd, &ret_data, &size);
-	if (rc < 0) {
-		efi_error("read_file failed");
-		goto err;
-	}
+	/* move the data to the front, with room left to NUL it */
+	memcpy(&ret_attributes, ret_data, sizeof (ret_attributes));
+	size -= sizeof (ret_attributes);
+	memmove(ret_data, ret_data + sizeof (ret_attributes), size);
+	ret_data[size] = '\0';
 
 	*attributes = ret_attributes;
 	*data = ret_data;
-	*data_size = size - 1; // read_file pads out 1 extra byte to NUL it */
+	*data_size = size;
+	ret_data = NULL;
 
 	ret = 0;
 err:
 	errno_value = errno;
 
+	free(ret_data);
 	if (fd >= 0)
 		close(fd);
 
-	if (path)
-		free(path);
+	errno = errno_value;
+	return ret;
+}
+
+static int
+efivarfs_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			   size_t bufsize, size_t *needed,
+			   uint32_t *attributes)
+{
+	__typeof__(errno) errno_value;
+	char path[EFIVARFS_NAME_SIZE];
+	uint8_t bounce[EFIVARFS_BOUNCE_SIZE];
+	uint8_t *rec = bounce;
+	size_t recsize;
+	struct stat st;
+	int fd = -1;
+	int ret = -1;
+	int dfd;
+
+	if (bufsize > SSIZE_MAX - sizeof (*attributes) - 1) {
+		errno = EINVAL;
+		efi_error("buffer size %zu is too large", bufsize);
+		return -1;
+	}
+
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (make_efivarfs_name(path, guid, name) < 0) {
+		efi_error("make_efivarfs_name failed");
+		return -1;
+	}
+
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s)", path);
+		return -1;
+	}
+
+	/* Don't have firmware read out a variable that can't fit. */
+	if (fstat(fd, &st) == 0 &&
+	    st.st_size > (off_t)(sizeof (*attributes) + bufsize)) {
+		*needed = st.st_size - sizeof (*attributes);
+		errno = ERANGE;
+		goto err;
+	}
+
+	/* the attributes come in the same read, so read into a bounce */
+	recsize = sizeof (*attributes) + bufsize + 1;
+	if (recsize > sizeof (bounce)) {
+		rec = malloc(recsize);
+		if (!rec) {
+			efi_error("could not allocate memory");
+			goto err;
+		}
+	}
 
+	/* See efivarfs_get_variable() about the rate limiter. */
+	if (geteuid() != 0)
+		usleep(10000);
+	if (efivarfs_read_fd(fd, rec, recsize, needed) < 0) {
+		if (errno == ERANGE)
+			*needed -= sizeof (*attributes) + 1;
+		goto err;
+	}
+	memcpy(attributes, rec, sizeof (*attributes));
+	*needed -= sizeof (*attributes);
+	memcpy(buf, rec + sizeof (*attributes), *needed);
+	ret = 0;
+err:
+	errno_value = errno;
+	if (rec != bounce)
+		free(rec);
+	close(fd);
 	errno = errno_value;
 	return ret;
 }
@@ -307,37 +520,50 @@ err:
 static int
 efivarfs_del_variable(efi_guid_t guid, const char *name)
 {
-	char *path;
-	int rc = make_efivarfs_path(&path, guid, name);
+	char path[EFIVARFS_NAME_SIZE];
+	int dfd = get_efivarfs_dirfd();
+	int rc;
+
+	if (dfd < 0)
+		return -1;
+	rc = make_efivarfs_name(path, guid, name);
 	if (rc < 0) {
-		efi_error("make_efivarfs_path failed");
+		efi_error("make_efivarfs_name failed");
 		return -1;
 	}
 
-	efivarfs_set_immutable(path, 0);
-	rc = unlink(path);
+	efivarfs_set_immutable(dfd, path, 0);
+	rc = unlinkat(dfd, path, 0);
 	if (rc < 0)
 		efi_error("unlink failed");
 
-	__typeof__(errno) errno_value = errno;
-	free(path);
-	errno = errno_value;
-
 	return rc;
 }
 
+/*
+ * efivarfs only implements ->write(), not ->write_iter(), so a writev()
+ * reaches it as one write() per iovec, and each write() is taken to be a
+ * complete variable.  The attributes and every piece of the payload must
+ * therefore go down in a single contiguous write; gathering the caller's
+ * iovecs straight into that buffer is the only copy made.
+ */
 static int
-efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
-		      size_t data_size, uint32_t attributes, mode_t mode)
+efivarfs_set_variable_iov(efi_guid_t guid, const char *name,
+			  const struct iovec *iov, int iovcnt,
+			  uint32_t attributes, mode_t mode)
 {
-	char *path;
+	char path[EFIVARFS_NAME_SIZE];
+	size_t data_size = 0;
 	size_t alloc_size;
 	uint8_t *buf;
+	uint8_t *pos;
+	int i;
 	int rfd = -1;
 	struct stat rfd_stat;
 	unsigned long orig_attrs = 0;
 	int restore_immutable_fd = -1;
 	int wfd = -1;
+	int dfd;
 	int open_wflags;
 	int ret = -1;
 	int save_errno;
@@ -348,14 +574,21 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 
-	if (data_size > (size_t)-1 - sizeof (attributes)) {
-		errno = EOVERFLOW;
-		efi_error("data_size too large (%zu)", data_size);
-		return -1;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t)-1 - sizeof (attributes) -
+				     data_size) {
+			errno = EOVERFLOW;
+			efi_error("data_size too large");
+			return -1;
+		}
+		data_size += iov[i].iov_len;
 	}
 
-	if (make_efivarfs_path(&path, guid, name) < 0) {
-		efi_error("make_efivarfs_path failed");
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (make_efivarfs_name(path, guid, name) < 0) {
+		efi_error("make_efivarfs_name failed");
 		return -1;
 	}
 
@@ -374,7 +607,7 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	 * opening the file for reading is not necessary, but it doesn't hurt
 	 * either.
 	 */
-	rfd = open(path, O_RDONLY);
+	rfd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
 	if (rfd != -1) {
 		/* save the containing device and the inode number for later */
 		if (fstat(rfd, &rfd_stat) == -1) {
@@ -398,13 +631,13 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	 * *replaced* between the two open()s, we'll catch that later with
 	 * fstat() comparison.
 	 */
-	open_wflags = O_WRONLY;
+	open_wflags = O_WRONLY | O_CLOEXEC;
 	if (attributes & EFI_VARIABLE_APPEND_WRITE)
 		open_wflags |= O_APPEND;
 	if (rfd == -1)
 		open_wflags |= O_CREAT | O_EXCL;
 
-	wfd = open(path, open_wflags, mode);
+	wfd = openat(dfd, path, open_wflags, mode);
 	if (wfd == -1) {
 		efi_error("failed to %s %s for %s",
 			  rfd == -1 ? "create" : "open",
@@ -442,7 +675,11 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	}
 
 	memcpy(buf, &attributes, sizeof (attributes));
-	memcpy(buf + sizeof (attributes), data, data_size);
+	pos = buf + sizeof (attributes);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
 
 	if (write(wfd, buf, alloc_size) == -1) {
 		efi_error("writing to fd %d failed", wfd);
@@ -456,7 +693,8 @@ err:
 	save_errno = errno;
 
 	/* if we're exiting with error and created the file, remove it */
-	if (ret == -1 && rfd == -1 && wfd != -1 && unlink(path) == -1)
+	if (ret == -1 && rfd == -1 && wfd != -1 &&
+	    unlinkat(dfd, path, 0) == -1)
 		efi_error("failed to unlink %s", path);
 
 	ioctl(restore_immutable_fd, FS_IOC_SETFLAGS, &orig_attrs);
@@ -467,12 +705,24 @@ err:
 		close(rfd);
 
 	free(buf);
-	free(path);
 
 	errno = save_errno;
 	return ret;
 }
 
+static int
+efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		      size_t data_size, uint32_t attributes, mode_t mode)
+{
+	struct iovec iov = {
+		.iov_base = data,
+		.iov_len = data_size,
+	};
+
+	return efivarfs_set_variable_iov(guid, name, &iov, 1, attributes,
+					 mode);
+}
+
 static int
 efivarfs_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	size_t data_size, uint32_t attributes)
@@ -498,33 +748,259 @@ efivarfs_get_next_variable_name(efi_guid_t **guid, char **name)
 static int
 efivarfs_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 {
-	char *path;
-	int rc = make_efivarfs_path(&path, guid, name);
+	char path[EFIVARFS_NAME_SIZE];
+	int dfd = get_efivarfs_dirfd();
+	int rc;
+
+	if (dfd < 0)
+		return -1;
+	rc = make_efivarfs_name(path, guid, name);
 	if (rc < 0) {
-		efi_error("make_efivarfs_path failed");
+		efi_error("make_efivarfs_name failed");
 		return -1;
 	}
 
-	rc = chmod(path, mode);
-	int saved_errno = errno;
+	rc = fchmodat(dfd, path, mode, 0);
 	if (rc < 0)
 		efi_error("chmod(%s,0%o) failed", path, mode);
-	free(path);
-	errno = saved_errno;
 	return -1;
 }
 
+/*
+ * Handles do once what efivarfs_set_variable_iov() does on every call:
+ * build the path, open the file for reading and, at the first write, for
+ * writing, check both are the same inode and clear its immutable flag.
+ * The flag is put back when the handle is closed.  A variable that
+ * doesn't exist yet is created by the first write.
+ */
+static int
+efivarfs_resolve(efi_variable_handle_t *handle, bool writable)
+{
+	int flags = O_WRONLY | O_CLOEXEC;
+	struct stat st;
+	int dfd;
+
+	dfd = get_efivarfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (handle->rfd < 0) {
+		handle->rfd = openat(dfd, handle->path,
+				     O_RDONLY | O_CLOEXEC);
+		if (handle->rfd < 0 && (errno != ENOENT || !writable)) {
+			efi_error("open(%s, O_RDONLY) failed", handle->path);
+			return -1;
+		}
+		if (handle->rfd >= 0) {
+			if (fstat(handle->rfd, &st) < 0) {
+				efi_error("fstat() failed on r/o fd %d",
+					  handle->rfd);
+				return -1;
+			}
+			handle->dev = st.st_dev;
+			handle->ino = st.st_ino;
+		}
+	}
+	if (!writable || handle->wfd >= 0)
+		return 0;
+
+	if (handle->rfd >= 0) {
+		if (!handle->restore_flags &&
+		    efivarfs_make_fd_mutable(handle->rfd,
+					     &handle->orig_flags) == 0 &&
+		    (handle->orig_flags & FS_IMMUTABLE_FL))
+			handle->restore_flags = true;
+	} else {
+		flags |= O_CREAT | O_EXCL;
+	}
+
+	handle->wfd = openat(dfd, handle->path, flags,
+			     handle->mode);
+	if (handle->wfd < 0) {
+		efi_error("failed to %s %s for writing",
+			  handle->rfd < 0 ? "create" : "open", handle->path);
+		return -1;
+	}
+	if (fstat(handle->wfd, &st) < 0) {
+		efi_error("fstat() failed on w/o fd %d", handle->wfd);
+		return -1;
+	}
+	if (handle->rfd >= 0 &&
+	    (st.st_dev != handle->dev || st.st_ino != handle->ino)) {
+		errno = EINVAL;
+		efi_error("r/o fd %d and w/o fd %d refer to different files",
+			  handle->rfd, handle->wfd);
+		return -1;
+	}
+	handle->dev = st.st_dev;
+	handle->ino = st.st_ino;
+
+	/* A protected variable we just created is immutable already. */
+	if (handle->rfd < 0 && !handle->restore_flags &&
+	    efivarfs_make_fd_mutable(handle->wfd, &handle->orig_flags) == 0 &&
+	    (handle->orig_flags & FS_IMMUTABLE_FL))
+		handle->restore_flags = true;
+	return 0;
+}
+
+static void
+efivarfs_unresolve(efi_variable_handle_t *handle)
+{
+	int fd = handle->rfd >= 0 ? handle->rfd : handle->wfd;
+
+	if (handle->restore_flags && fd >= 0)
+		ioctl(fd, FS_IOC_SETFLAGS, &handle->orig_flags);
+	handle->restore_flags = false;
+	if (handle->wfd >= 0)
+		close(handle->wfd);
+	if (handle->rfd >= 0)
+		close(handle->rfd);
+	handle->rfd = handle->wfd = -1;
+}
+
+static int
+efivarfs_open_variable(efi_variable_handle_t *handle)
+{
+	char path[EFIVARFS_NAME_SIZE];
+
+	if (strlen(handle->name) > 1024) {
+		errno = EINVAL;
+		efi_error("name too long (%zu of 1024)", strlen(handle->name));
+		return -1;
+	}
+	if (get_efivarfs_dirfd() < 0)
+		return -1;
+	if (make_efivarfs_name(path, handle->guid, handle->name) < 0) {
+		efi_error("make_efivarfs_name failed");
+		return -1;
+	}
+	handle->path = strdup(path);
+	if (!handle->path) {
+		efi_error("strdup failed");
+		return -1;
+	}
+
+	if (efivarfs_resolve(handle, false) < 0 && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+static int
+efivarfs_read_variable(efi_variable_handle_t *handle, uint8_t **data,
+		       size_t *data_size, uint32_t *attributes)
+{
+	size_t size = handle->alloc > 4096 ? handle->alloc : 4096;
+
+	if (handle->rfd < 0 && efivarfs_resolve(handle, false) < 0)
+		return -1;
+
+	for (;;) {
+		if (handle_reserve(handle, size) < 0) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		/* See efivarfs_get_variable() about the rate limiter. */
+		if (geteuid() != 0)
+			usleep(10000);
+		if (efivarfs_read_fd(handle->rfd, handle->buf, handle->alloc,
+				     &size) == 0)
+			break;
+		if (errno != ERANGE) {
+			efi_error("efivarfs_read_fd(%s) failed", handle->path);
+			return -1;
+		}
+	}
+
+	memcpy(attributes, handle->buf, sizeof (*attributes));
+	*data = handle->buf + sizeof (*attributes);
+	*data_size = size - sizeof (*attributes);
+	return 0;
+}
+
+/*
+ * One write() of the attributes and the gathered data, as in
+ * efivarfs_set_variable_iov().
+ */
+static int
+efivarfs_write_variable(efi_variable_handle_t *handle,
+			const struct iovec *iov, int iovcnt,
+			uint32_t attributes)
+{
+	size_t size = sizeof(attributes);
+	bool created = handle->rfd < 0 && handle->wfd < 0;
+	uint8_t *pos;
+	int i;
+
+	/* O_APPEND is per open file; leave appends to the by-name path. */
+	if (attributes & EFI_VARIABLE_APPEND_WRITE)
+		return efivarfs_set_variable_iov(handle->guid, handle->name,
+						 iov, iovcnt, attributes,
+						 handle->mode);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t)-1 - size) {
+			errno = EOVERFLOW;
+			efi_error("data_size too large");
+			return -1;
+		}
+		size += iov[i].iov_len;
+	}
+
+	if (handle->wfd < 0 && efivarfs_resolve(handle, true) < 0)
+		goto err;
+	if (handle_reserve(handle, size) < 0) {
+		efi_error("malloc(%zu) failed", size);
+		goto err;
+	}
+
+	memcpy(handle->buf, &attributes, sizeof(attributes));
+	pos = handle->buf + sizeof(attributes);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	if (write(handle->wfd, handle->buf, size) == -1) {
+		efi_error("writing to fd %d failed", handle->wfd);
+		goto err;
+	}
+	return 0;
+err:
+	/* Don't leave behind a variable we created and couldn't write. */
+	if (created && handle->wfd >= 0) {
+		int saved_errno = errno;
+
+		efivarfs_unresolve(handle);
+		unlinkat(get_efivarfs_dirfd(), handle->path, 0);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+static void
+efivarfs_close_variable(efi_variable_handle_t *handle)
+{
+	efivarfs_unresolve(handle);
+}
+
 struct efi_var_operations efivarfs_ops = {
 	.name = "efivarfs",
 	.probe = efivarfs_probe,
 	.set_variable = efivarfs_set_variable,
+	.set_variable_iov = efivarfs_set_variable_iov,
 	.append_variable = efivarfs_append_variable,
 	.del_variable = efivarfs_del_variable,
 	.get_variable = efivarfs_get_variable,
+	.get_variable_into = efivarfs_get_variable_into,
 	.get_variable_attributes = efivarfs_get_variable_attributes,
 	.get_variable_size = efivarfs_get_variable_size,
 	.get_next_variable_name = efivarfs_get_next_variable_name,
+	.get_variables_metadata = efivarfs_get_variables_metadata,
 	.chmod_variable = efivarfs_chmod_variable,
+	.open_variable = efivarfs_open_variable,
+	.read_variable = efivarfs_read_variable,
+	.write_variable = efivarfs_write_variable,
+	.close_variable = efivarfs_close_variable,
+	.store_changed = efivarfs_store_changed,
 };
 
 // vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * libamp_fwupgrade - asynchronous upgrade sessions
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <efivar/amp_fwupgrade.h>
+
+#include "fwupgrade.h"
+
+/*
+ * Each session runs the same upload and poll engine as the tool, on its
+ * own thread.  The caller learns about the end through the done
+ * callback, through done_fd becoming readable, or by asking; cancelling
+ * sets a flag the engine checks between chunks and status polls, and
+ * pokes wake_fd so a poll doesn't sit out its interval first.
+ */
+struct amp_fwup {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool finished;
+	bool free_on_exit;
+	amp_fwup_state_t state;
+	int error;
+	int done_fd;
+	int wake_fd;
+
+	fwup_upgrade_t upg;
+	fwup_progress_t progress;
+	char *request;
+	char *image;
+	char *journal;
+	amp_fwup_done_t done;
+	amp_fwup_log_t message_fn;
+	void *data;
+	char last_message[512];
+};
+
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool active = false;
+
+static void
+destroy(amp_fwup_t *fwup)
+{
+	if (fwup->done_fd >= 0)
+		close(fwup->done_fd);
+	if (fwup->wake_fd >= 0)
+		close(fwup->wake_fd);
+	fwup_progress_stop(&fwup->progress);
+	pthread_cond_destroy(&fwup->cond);
+	pthread_mutex_destroy(&fwup->lock);
+	free(fwup->request);
+	free(fwup->image);
+	free(fwup->journal);
+	free(fwup);
+}
+
+/*
+ * Warnings are kept, so amp_fwup_message() can say why a session
+ * failed.
+ */
+static void
+log_message(bool warning, const char *message, void *data)
+{
+	amp_fwup_t *fwup = data;
+
+	if (warning) {
+		pthread_mutex_lock(&fwup->lock);
+		strncpy(fwup->last_message, message,
+			sizeof(fwup->last_message) - 1);
+		pthread_mutex_unlock(&fwup->lock);
+	}
+	if (fwup->message_fn)
+		fwup->message_fn(fwup, warning, message, fwup->data);
+}
+
+static void *
+run(void *arg)
+{
+	amp_fwup_t *fwup = arg;
+	fwup_upgrade_t *upg = &fwup->upg;
+	bool free_on_exit;
+	int error = 0;
+
+	fwup_set_message_sink(log_message, fwup);
+
+	if (fwup_upgrade_open(upg) < 0 || fwup_upgrade_send(upg) < 0 ||
+	    fwup_upgrade_poll(upg) < 0)
+		error = errno;
+	if (error == EIO && upg->result[0])
+		fwup_warn("Error while upgrading %s with status %s",
+			  upg->component, upg->result);
+	else if (error == ECANCELED)
+		fwup_info("%s cancelled", upg->name);
+
+	pthread_mutex_lock(&fwup->lock);
+	if (!error)
+		fwup->state = AMP_FWUP_SUCCEEDED;
+	else if (error == ECANCELED)
+		fwup->state = AMP_FWUP_CANCELLED;
+	else
+		fwup->state = AMP_FWUP_FAILED;
+	fwup->error = error;
+	pthread_mutex_unlock(&fwup->lock);
+
+	fwup_upgrade_close(upg);
+	fwup_set_message_sink(NULL, NULL);
+
+	/* Let the callback start the next component. */
+	pthread_mutex_lock(&active_lock);
+	active = false;
+	pthread_mutex_unlock(&active_lock);
+
+	pthread_mutex_lock(&fwup->lock);
+	fwup->finished = true;
+	pthread_cond_broadcast(&fwup->cond);
+	pthread_mutex_unlock(&fwup->lock);
+	eventfd_write(fwup->done_fd, 1);
+
+	if (fwup->done)
+		fwup->done(fwup, fwup->data);
+
+	pthread_mutex_lock(&fwup->lock);
+	free_on_exit = fwup->free_on_exit;
+	pthread_mutex_unlock(&fwup->lock);
+	if (free_on_exit)
+		destroy(fwup);
+	return NULL;
+}
+
+int NONNULL(1, 2) PUBLIC
+amp_fwup_start(const amp_fwup_options_t *options, amp_fwup_t **fwupp)
+{
+	amp_fwup_t *fwup;
+	int rc;
+
+	if (!options->request || !options->image ||
+	    !fwup_request_known(options->request)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fwup = calloc(1, sizeof(*fwup));
+	if (!fwup)
+		return -1;
+	pthread_mutex_init(&fwup->lock, NULL);
+	pthread_cond_init(&fwup->cond, NULL);
+	fwup->done_fd = -1;
+	fwup->wake_fd = -1;
+	fwup->request = strdup(options->request);
+	fwup->image = strdup(options->image);
+	if (options->journal)
+		fwup->journal = strdup(options->journal);
+	fwup->done = options->done;
+	fwup->message_fn = options->message;
+	fwup->data = options->data;
+	fwup_progress_init(&fwup->progress, fwup->request);
+	if (!fwup->request || !fwup->image ||
+	    (options->journal && !fwup->journal))
+		goto err;
+
+	fwup->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	fwup->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fwup->done_fd < 0 || fwup->wake_fd < 0)
+		goto err;
+
+	fwup->upg.name = fwup->request;
+	fwup->upg.filename = fwup->image;
+	fwup->upg.chunk_size = options->chunk_size;
+	fwup->upg.chunk_crc = !!(options->flags & AMP_FWUP_CHUNK_CRC);
+	fwup->upg.single_record = !!(options->flags & AMP_FWUP_SINGLE_RECORD);
+	fwup->upg.resume = !!(options->flags & AMP_FWUP_RESUME);
+	fwup->upg.force = !!(options->flags & AMP_FWUP_FORCE);
+	fwup->upg.sparse = !!(options->flags & AMP_FWUP_SPARSE);
+	fwup->upg.delta = !!(options->flags & AMP_FWUP_DELTA);
+	fwup->upg.journal_path = fwup->journal;
+	fwup->upg.progress = &fwup->progress;
+	fwup->upg.wake_fd = fwup->wake_fd;
+
+	pthread_mutex_lock(&active_lock);
+	if (active) {
+		pthread_mutex_unlock(&active_lock);
+		errno = EBUSY;
+		goto err;
+	}
+	rc = pthread_create(&fwup->thread, NULL, run, fwup);
+	if (rc != 0) {
+		pthread_mutex_unlock(&active_lock);
+		errno = rc;
+		goto err;
+	}
+	active = true;
+	pthread_mutex_unlock(&active_lock);
+
+	*fwupp = fwup;
+	return 0;
+err:
+	rc = errno;
+	destroy(fwup);
+	errno = rc;
+	return -1;
+}
+
+int NONNULL(1, 2) PUBLIC
+amp_fwup_progress(amp_fwup_t *fwup, amp_fwup_progress_t *progress)
+{
+	fwup_progress_t *p = &fwup->progress;
+
+	memset(progress, '\0', sizeof(*progress));
+
+	pthread_mutex_lock(&p->lock);
+	progress->state = fwup_phase_state(p->phase);
+	progress->uploaded = p->uploaded;
+	progress->total = p->total;
+	progress->percent = p->percent;
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_mutex_lock(&fwup->lock);
+	if (fwup->finished) {
+		progress->state = fwup->state;
+		progress->error = fwup->error;
+		if (fwup->state == AMP_FWUP_SUCCEEDED)
+			progress->percent = 100;
+	}
+	pthread_mutex_unlock(&fwup->lock);
+	return 0;
+}
+
+/*
+ * Readable once the session has finished; suits poll() and event loops.
+ */
+int NONNULL(1) PUBLIC
+amp_fwup_fd(amp_fwup_t *fwup)
+{
+	return fwup->done_fd;
+}
+
+/*
+ * Stop uploading, or stop following a flash already handed to
+ * firmware; that one carries on regardless.
+ */
+int NONNULL(1) PUBLIC
+amp_fwup_cancel(amp_fwup_t *fwup)
+{
+	__atomic_store_n(&fwup->upg.cancel, true, __ATOMIC_SEQ_CST);
+	eventfd_write(fwup->wake_fd, 1);
+	return 0;
+}
+
+int NONNULL(1) PUBLIC
+amp_fwup_wait(amp_fwup_t *fwup)
+{
+	int error;
+
+	pthread_mutex_lock(&fwup->lock);
+	while (!fwup->finished)
+		pthread_cond_wait(&fwup->cond, &fwup->lock);
+	error = fwup->error;
+	pthread_mutex_unlock(&fwup->lock);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The last warning, which for a failed session says why.
+ */
+const char PUBLIC NONNULL(1) *
+amp_fwup_message(amp_fwup_t *fwup)
+{
+	return fwup->last_message;
+}
+
+/*
+ * What amp_fwupgrade last published, in path or AMP_FWUP_STATUS_FILE.
+ */
+int NONNULL(2) PUBLIC
+amp_fwup_status_read(const char *path, amp_fwup_status_t *status)
+{
+	return fwup_shared_read(path ? path : AMP_FWUP_STATUS_FILE, status);
+}
+
+/*
+ * Cancel the session if it is still running, wait for it, and free it.
+ * From the done callback, the session is freed once the callback returns.
+ */
+void PUBLIC
+amp_fwup_free(amp_fwup_t *fwup)
+{
+	if (!fwup)
+		return;
+
+	if (pthread_equal(pthread_self(), fwup->thread)) {
+		pthread_detach(fwup->thread);
+		pthread_mutex_lock(&fwup->lock);
+		fwup->free_on_exit = true;
+		pthread_mutex_unlock(&fwup->lock);
+		return;
+	}
+
+	amp_fwup_cancel(fwup);
+	amp_fwup_wait(fwup);
+	pthread_join(fwup->thread, NULL);
+	destroy(fwup);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,620 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - daemon mode and its clients
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * The daemon owns the upgrade variables: clients connect to its socket
+ * and ask for an upgrade with one line,
+ *
+ *   upgrade <TAB> <request> <TAB> <image> <TAB> <chunk size> <TAB> <flags>
+ *
+ * where the image is an absolute path, the chunk size is 0 to negotiate,
+ * and flags are AMP_FWUP_* bits.  Requests run one at a time on a single
+ * executor thread, in the order they came in.  One that matches a request
+ * already queued or running - same request, same image file, same
+ * options - joins it instead of being run again.  Every client of a job
+ * gets its --json events as they happen, starting with a "queued" event,
+ * and the connection is closed after the "result" event.  Events are
+ * never waited on: a client too slow to take one is dropped, rather than
+ * holding up the job and everyone else following it.  Each connection's
+ * request is read on a thread of its own, so one that is slow to send it
+ * doesn't keep others out either.
+ *
+ * The executor keeps the chunk size it negotiated and the last few images
+ * open, mapped and already checked, so a repeated request skips straight
+ * to the upload.  An image checked with AMP_FWUP_FORCE is kept apart from
+ * the same image checked without it, which is held to every check.
+ */
+#define CLIENT_TIMEOUT_SEC	5
+#define REQUEST_MAX		(PATH_MAX + 128)
+#define IMAGE_CACHE_SIZE	4
+
+struct image_key {
+	char request[64];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	bool force;		/* checked with AMP_FWUP_FORCE */
+};
+
+struct subscriber {
+	int fd;
+	struct subscriber *next;
+};
+
+struct job {
+	struct job *next;
+	struct image_key key;
+	char *image;
+	size_t chunk_size;
+	uint32_t flags;
+	struct subscriber *subscribers;
+	fwup_progress_t progress;
+};
+
+struct cached_image {
+	bool used;
+	struct image_key key;
+	uint64_t last_used;
+	fwup_source_t src;
+	fwup_image_info_t info;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *queue;
+	struct job *running;
+	size_t negotiated;
+	fwup_shared_t shared;
+	const fwup_pace_t *pace;
+	struct cached_image cache[IMAGE_CACHE_SIZE];
+} server = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.shared = { .fd = -1, },
+};
+
+static bool
+key_equal(const struct image_key *a, const struct image_key *b)
+{
+	return !strcmp(a->request, b->request) && a->dev == b->dev &&
+	       a->ino == b->ino && a->size == b->size &&
+	       a->mtime.tv_sec == b->mtime.tv_sec &&
+	       a->mtime.tv_nsec == b->mtime.tv_nsec && a->force == b->force;
+}
+
+static int
+send_all(int fd, const char *buf, size_t size, int flags)
+{
+	ssize_t sz;
+
+	while (size) {
+		sz = send(fd, buf, size, MSG_NOSIGNAL | flags);
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz <= 0)
+			return -1;
+		buf += sz;
+		size -= sz;
+	}
+	return 0;
+}
+
+static int
+make_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, '\0', sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int
+connect_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (make_address(&addr, path) < 0)
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int saved_errno = errno;
+
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+bool
+fwup_daemon_running(const char *path)
+{
+	int fd = connect_socket(path);
+
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+/*
+ * Events go to every client of the job; one that has gone away, or whose
+ * socket is too full to take the whole event, is dropped, and the job
+ * carries on for the others.  Nothing here blocks, so server.lock is only
+ * held for as long as it takes to queue the event on each socket.
+ */
+static ssize_t
+events_write(void *cookie, const char *buf, size_t size)
+{
+	struct job *job = cookie;
+	struct subscriber **s, *gone;
+
+	pthread_mutex_lock(&server.lock);
+	for (s = &job->subscribers; *s; ) {
+		if (send_all((*s)->fd, buf, size, MSG_DONTWAIT) < 0) {
+			gone = *s;
+			*s = gone->next;
+			close(gone->fd);
+			free(gone);
+			continue;
+		}
+		s = &(*s)->next;
+	}
+	pthread_mutex_unlock(&server.lock);
+	return size;
+}
+
+static void
+job_message(bool warning, const char *message, void *data)
+{
+	struct job *job = data;
+
+	fwup_progress_message(&job->progress, warning, message);
+}
+
+static void
+reply(int fd, const char *request, const char *event, int position,
+      int error)
+{
+	char buf[256];
+	int len;
+
+	if (error)
+		len = snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"t\":%.6f,\"request\":%s%s%s,\"ok\":false,\"errno\":%d,\"error\":\"%s\"}\n",
+			       event, fwup_now_ns() / 1e9,
+			       request ? "\"" : "", request ? request : "null",
+			       request ? "\"" : "", error, strerror(error));
+	else
+		len = snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"t\":%.6f,\"request\":\"%s\",\"position\":%d}\n",
+			       event, fwup_now_ns() / 1e9, request, position);
+	send_all(fd, buf, len, MSG_DONTWAIT);
+}
+
+static struct cached_image *
+cache_lookup(const struct image_key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_CACHE_SIZE; i++) {
+		if (server.cache[i].used && key_equal(&server.cache[i].key, key))
+			return &server.cache[i];
+	}
+	return NULL;
+}
+
+/*
+ * Keep a checked, mapped image for next time, in place of the one used
+ * least recently.  Streams - compressed images - are used up by the
+ * upload and can't be kept.
+ */
+static struct cached_image *
+cache_insert(const struct image_key *key, fwup_upgrade_t *upg)
+{
+	struct cached_image *c = &server.cache[0];
+	unsigned int i;
+
+	if (!upg->src.mapped)
+		return NULL;
+
+	for (i = 0; i < IMAGE_CACHE_SIZE; i++) {
+		if (!server.cache[i].used) {
+			c = &server.cache[i];
+			break;
+		}
+		if (server.cache[i].last_used < c->last_used)
+			c = &server.cache[i];
+	}
+	if (c->used)
+		fwup_source_close(&c->src);
+
+	c->used = true;
+	c->key = *key;
+	c->src = upg->src;
+	c->info = upg->info;
+	return c;
+}
+
+static void
+run_job(struct job *job)
+{
+	static const cookie_io_functions_t events_io = {
+		.write = events_write,
+	};
+	struct cached_image *cached;
+	fwup_upgrade_t upg;
+	FILE *events;
+	int error = 0;
+
+	memset(&upg, '\0', sizeof(upg));
+	upg.name = job->key.request;
+	upg.filename = job->image;
+	upg.chunk_size = job->chunk_size;
+	upg.chunk_crc = !!(job->flags & AMP_FWUP_CHUNK_CRC);
+	upg.single_record = !!(job->flags & AMP_FWUP_SINGLE_RECORD);
+	upg.resume = !!(job->flags & AMP_FWUP_RESUME);
+	upg.force = !!(job->flags & AMP_FWUP_FORCE);
+	upg.sparse = !!(job->flags & AMP_FWUP_SPARSE);
+	upg.delta = !!(job->flags & AMP_FWUP_DELTA);
+	upg.pace = server.pace;
+	upg.progress = &job->progress;
+	upg.wake_fd = -1;
+
+	fwup_progress_init(&job->progress, job->key.request);
+	events = fopencookie(job, "w", events_io);
+	if (events)
+		fwup_progress_events(&job->progress, events, job->image);
+	if (server.shared.page)
+		fwup_progress_publish(&job->progress, &server.shared);
+	fwup_set_message_sink(job_message, job);
+
+	cached = cache_lookup(&job->key);
+	if (cached) {
+		upg.src = cached->src;
+		upg.src.filename = job->image;
+		upg.src_open = true;
+		upg.info = cached->info;
+	} else if (fwup_upgrade_open(&upg) < 0) {
+		error = errno;
+		goto done;
+	} else {
+		cached = cache_insert(&job->key, &upg);
+	}
+	if (cached)
+		cached->last_used = fwup_now_ns();
+
+	if (!upg.chunk_size)
+		upg.negotiated = server.negotiated;
+	if (fwup_upgrade_send(&upg) < 0) {
+		error = errno;
+		goto done;
+	}
+	if (!upg.chunk_size)
+		server.negotiated = upg.negotiated;
+	if (fwup_upgrade_poll(&upg) < 0)
+		error = errno;
+done:
+	if (!cached)
+		fwup_upgrade_close(&upg);
+	fwup_progress_result(&job->progress, upg.component, upg.result,
+			     error);
+	fwup_set_message_sink(NULL, NULL);
+	fwup_info("%s from %s: %s", job->key.request, job->image,
+		  error ? strerror(error) : "done");
+	if (events)
+		fclose(events);
+	fwup_progress_stop(&job->progress);
+}
+
+static void
+free_job(struct job *job)
+{
+	struct subscriber *s;
+
+	while ((s = job->subscribers)) {
+		job->subscribers = s->next;
+		close(s->fd);
+		free(s);
+	}
+	free(job->image);
+	free(job);
+}
+
+static void *
+executor(void *arg UNUSED)
+{
+	struct job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&server.lock);
+		while (!server.queue)
+			pthread_cond_wait(&server.cond, &server.lock);
+		job = server.queue;
+		server.queue = job->next;
+		server.running = job;
+		pthread_mutex_unlock(&server.lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&server.lock);
+		server.running = NULL;
+		pthread_mutex_unlock(&server.lock);
+		free_job(job);
+	}
+	return NULL;
+}
+
+/*
+ * Read the request line, and queue it or add the client to the same job
+ * already queued.  The connection then belongs to the job.  Runs on a
+ * thread of its own for each connection.
+ */
+static void *
+handle_client(void *arg)
+{
+	int fd = (intptr_t)arg;
+	struct timeval tv = { .tv_sec = CLIENT_TIMEOUT_SEC, };
+	char buf[REQUEST_MAX], *fields[5], *save = NULL, *end;
+	struct subscriber *sub = NULL;
+	struct job *job = NULL, **tail, *j;
+	unsigned long long chunk_size, flags;
+	struct stat sb;
+	size_t len = 0;
+	ssize_t sz;
+	int position = 0;
+	int i;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(buf) - 1 && !memchr(buf, '\n', len)) {
+		sz = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz <= 0)
+			break;
+		len += sz;
+	}
+	buf[len] = '\0';
+	if (!memchr(buf, '\n', len)) {
+		reply(fd, NULL, "result", 0, EPROTO);
+		goto err;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+
+	for (i = 0; i < 5; i++)
+		fields[i] = strtok_r(i ? NULL : buf, "\t", &save);
+	if (!fields[4] || strcmp(fields[0], "upgrade")) {
+		reply(fd, NULL, "result", 0, EPROTO);
+		goto err;
+	}
+	if (!fwup_request_known(fields[1])) {
+		reply(fd, NULL, "result", 0, EINVAL);
+		goto err;
+	}
+	chunk_size = strtoull(fields[3], &end, 0);
+	if (*end || (chunk_size && (chunk_size < FWUP_CHUNK_SIZE_MIN ||
+				    chunk_size > FWUP_CHUNK_SIZE_MAX))) {
+		reply(fd, fields[1], "result", 0, EINVAL);
+		goto err;
+	}
+	flags = strtoull(fields[4], &end, 0);
+	if (*end || fields[2][0] != '/') {
+		reply(fd, fields[1], "result", 0, EINVAL);
+		goto err;
+	}
+	if (stat(fields[2], &sb) < 0) {
+		reply(fd, fields[1], "result", 0, errno);
+		goto err;
+	}
+
+	job = calloc(1, sizeof(*job));
+	sub = calloc(1, sizeof(*sub));
+	if (!job || !sub || !(job->image = strdup(fields[2]))) {
+		reply(fd, fields[1], "result", 0, ENOMEM);
+		goto err;
+	}
+	strncpy(job->key.request, fields[1], sizeof(job->key.request) - 1);
+	job->key.dev = sb.st_dev;
+	job->key.ino = sb.st_ino;
+	job->key.size = sb.st_size;
+	job->key.mtime = sb.st_mtim;
+	job->key.force = !!(flags & AMP_FWUP_FORCE);
+	job->chunk_size = chunk_size;
+	job->flags = flags;
+	sub->fd = fd;
+
+	pthread_mutex_lock(&server.lock);
+	j = server.running;
+	for (tail = &server.queue; ; tail = &(*tail)->next) {
+		if (j && key_equal(&j->key, &job->key) &&
+		    j->chunk_size == job->chunk_size && j->flags == job->flags)
+			break;
+		if (!*tail) {
+			j = NULL;
+			break;
+		}
+		j = *tail;
+		position++;
+	}
+	if (j) {
+		/* The same upgrade is already on its way; follow that one. */
+		sub->next = j->subscribers;
+		j->subscribers = sub;
+		reply(fd, j->key.request, "queued", server.running == j ? 0 : position, 0);
+		pthread_mutex_unlock(&server.lock);
+		fwup_info("%s from %s: joined", job->key.request, job->image);
+		free(job->image);
+		free(job);
+		return NULL;
+	}
+	job->subscribers = sub;
+	*tail = job;
+	position += server.running ? 1 : 0;
+	reply(fd, job->key.request, "queued", position, 0);
+	pthread_cond_signal(&server.cond);
+	pthread_mutex_unlock(&server.lock);
+	fwup_info("%s from %s: queued at %d", job->key.request, job->image,
+		  position);
+	return NULL;
+err:
+	if (job)
+		free(job->image);
+	free(job);
+	free(sub);
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Serve upgrade requests on path until killed, publishing progress in
+ * status_file.  Every upload is paced with pace, if set.
+ */
+int
+fwup_daemon_run(const char *path, const char *status_file,
+		const fwup_pace_t *pace)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int lfd, fd, rc;
+
+	if (make_address(&addr, path) < 0)
+		return -1;
+	if (fwup_daemon_running(path)) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if (mkdir(dirname(strdupa(path)), 0755) < 0 && errno != EEXIST)
+		return -1;
+	unlink(path);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0)
+		return -1;
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0600) < 0 || listen(lfd, 16) < 0)
+		goto err;
+
+	if (fwup_shared_open(&server.shared, status_file) < 0)
+		fwup_warn("not publishing status to %s: %m", status_file);
+	server.pace = pace;
+
+	rc = pthread_create(&thread, NULL, executor, NULL);
+	if (rc != 0) {
+		errno = rc;
+		goto err;
+	}
+	fwup_info("Waiting for requests on %s", path);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				fwup_warn("accept: %m");
+			continue;
+		}
+		rc = pthread_create(&thread, &attr, handle_client,
+				    (void *)(intptr_t)fd);
+		if (rc != 0) {
+			errno = rc;
+			fwup_warn("not serving a client: %m");
+			close(fd);
+		}
+	}
+err:
+	rc = errno;
+	close(lfd);
+	errno = rc;
+	return -1;
+}
+
+/*
+ * Have the daemon on path run one upgrade, copying its events to out.
+ * Returns 0 once it has reported success.
+ */
+int
+fwup_daemon_request(const char *path, const char *request,
+		    const char *image, size_t chunk_size, uint32_t flags,
+		    FILE *out)
+{
+	char *line = NULL, *msg = NULL;
+	size_t linesz = 0;
+	bool ok = false, finished = false;
+	FILE *f;
+	int len;
+	int fd;
+
+	len = asprintf(&msg, "upgrade\t%s\t%s\t%zu\t%u\n", request, image,
+		       chunk_size, flags);
+	if (len < 0)
+		return -1;
+
+	fd = connect_socket(path);
+	if (fd < 0 || send_all(fd, msg, len, 0) < 0) {
+		int saved_errno = errno;
+
+		if (fd >= 0)
+			close(fd);
+		free(msg);
+		errno = saved_errno;
+		return -1;
+	}
+	free(msg);
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	while (getline(&line, &linesz, f) >= 0) {
+		fputs(line, out);
+		fflush(out);
+		if (strstr(line, "\"event\":\"result\"")) {
+			finished = true;
+			ok = strstr(line, "\"ok\":true") != NULL;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	if (!finished) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (!ok) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - compressed image input
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+
+#include "fwupgrade.h"
+
+/*
+ * A decoder thread reads the compressed image and writes the plain one
+ * into one end of a socket pair; the other end replaces the source's fd,
+ * so from there on the image is an ordinary stream.  Decoding overlaps
+ * with the efivarfs writes, and the plain image is never on disk.
+ *
+ * A socket pair rather than a pipe so that a reader that stops early
+ * costs the decoder an EPIPE, not a SIGPIPE.
+ */
+
+#define DECODER_BUF_SIZE	(128 * 1024)
+
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+struct decoder {
+	pthread_t thread;
+	int in_fd;
+	int out_fd;
+	uint8_t prefix[FWUP_MAGIC_MAX];
+	size_t prefix_len;
+	const char *format;
+	int error;
+};
+
+const char *
+fwup_decompress_format(const uint8_t *magic, size_t len)
+{
+	if (len >= sizeof(zstd_magic) &&
+	    !memcmp(magic, zstd_magic, sizeof(zstd_magic)))
+		return "zstd";
+	if (len >= sizeof(xz_magic) &&
+	    !memcmp(magic, xz_magic, sizeof(xz_magic)))
+		return "xz";
+	return NULL;
+}
+
+/*
+ * Fill buf from the saved prefix, then the input.  Returns 0 at the end.
+ */
+static ssize_t
+read_input(struct decoder *dec, uint8_t *buf, size_t len)
+{
+	ssize_t sz;
+
+	if (dec->prefix_len) {
+		sz = dec->prefix_len < len ? dec->prefix_len : len;
+		memcpy(buf, dec->prefix, sz);
+		memmove(dec->prefix, dec->prefix + sz, dec->prefix_len - sz);
+		dec->prefix_len -= sz;
+		return sz;
+	}
+
+	do {
+		sz = read(dec->in_fd, buf, len);
+	} while (sz < 0 && errno == EINTR);
+	return sz;
+}
+
+static int
+write_output(struct decoder *dec, const uint8_t *buf, size_t len)
+{
+	ssize_t sz;
+
+	while (len) {
+		sz = send(dec->out_fd, buf, len, MSG_NOSIGNAL);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sz;
+		len -= sz;
+	}
+	return 0;
+}
+
+#ifdef HAVE_LIBZSTD
+static int
+decode_zstd(struct decoder *dec, uint8_t *ibuf, uint8_t *obuf)
+{
+	ZSTD_DStream *ds;
+	ZSTD_inBuffer in = { ibuf, 0, 0 };
+	ZSTD_outBuffer out = { obuf, DECODER_BUF_SIZE, 0 };
+	size_t ret = 1;
+	ssize_t sz;
+	int rc = -1;
+
+	ds = ZSTD_createDStream();
+	if (!ds) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ZSTD_initDStream(ds);
+
+	for (;;) {
+		if (in.pos == in.size) {
+			sz = read_input(dec, ibuf, DECODER_BUF_SIZE);
+			if (sz < 0)
+				goto out;
+			if (sz == 0)
+				break;
+			in.size = sz;
+			in.pos = 0;
+		}
+		out.pos = 0;
+		ret = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(ret)) {
+			errno = EBADMSG;
+			goto out;
+		}
+		if (write_output(dec, obuf, out.pos) < 0)
+			goto out;
+	}
+
+	/* Flush whatever the last frame still holds. */
+	while (ret != 0) {
+		out.pos = 0;
+		ret = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(ret) || out.pos == 0) {
+			/* Input ended in the middle of a frame. */
+			errno = EBADMSG;
+			goto out;
+		}
+		if (write_output(dec, obuf, out.pos) < 0)
+			goto out;
+	}
+	rc = 0;
+out:
+	ZSTD_freeDStream(ds);
+	return rc;
+}
+#endif
+
+#ifdef HAVE_LIBLZMA
+static int
+decode_xz(struct decoder *dec, uint8_t *ibuf, uint8_t *obuf)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret ret;
+	ssize_t sz;
+	int rc = -1;
+
+	if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strm.next_out = obuf;
+	strm.avail_out = DECODER_BUF_SIZE;
+	for (;;) {
+		if (strm.avail_in == 0 && action == LZMA_RUN) {
+			sz = read_input(dec, ibuf, DECODER_BUF_SIZE);
+			if (sz < 0)
+				goto out;
+			if (sz == 0)
+				action = LZMA_FINISH;
+			strm.next_in = ibuf;
+			strm.avail_in = sz;
+		}
+
+		ret = lzma_code(&strm, action);
+		if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+			if (write_output(dec, obuf,
+					 DECODER_BUF_SIZE - strm.avail_out) < 0)
+				goto out;
+			strm.next_out = obuf;
+			strm.avail_out = DECODER_BUF_SIZE;
+		}
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret != LZMA_OK) {
+			errno = ret == LZMA_MEM_ERROR ? ENOMEM : EBADMSG;
+			goto out;
+		}
+	}
+	rc = 0;
+out:
+	lzma_end(&strm);
+	return rc;
+}
+#endif
+
+static void *
+decoder_thread(void *arg)
+{
+	struct decoder *dec = arg;
+	uint8_t *ibuf, *obuf;
+	int rc = -1;
+
+	ibuf = malloc(DECODER_BUF_SIZE);
+	obuf = malloc(DECODER_BUF_SIZE);
+	if (!ibuf || !obuf)
+		goto out;
+
+#ifdef HAVE_LIBZSTD
+	if (!strcmp(dec->format, "zstd"))
+		rc = decode_zstd(dec, ibuf, obuf);
+#endif
+#ifdef HAVE_LIBLZMA
+	if (!strcmp(dec->format, "xz"))
+		rc = decode_xz(dec, ibuf, obuf);
+#endif
+out:
+	if (rc < 0)
+		dec->error = errno;
+	free(ibuf);
+	free(obuf);
+	/* The reader sees end of input, then asks us how it went. */
+	shutdown(dec->out_fd, SHUT_WR);
+	return NULL;
+}
+
+static bool
+format_supported(const char *format)
+{
+#ifdef HAVE_LIBZSTD
+	if (!strcmp(format, "zstd"))
+		return true;
+#endif
+#ifdef HAVE_LIBLZMA
+	if (!strcmp(format, "xz"))
+		return true;
+#endif
+	return false;
+}
+
+/*
+ * The plain size, when the file says so up front: from the frame headers
+ * for zstd, and from the index in the stream footer for xz.  Only for
+ * regular files, since both need to look at more than the first bytes.
+ */
+static bool
+plain_size(int fd, const char *format, size_t *size)
+{
+	struct stat statbuf;
+	bool known = false;
+	uint8_t *map;
+
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+	    statbuf.st_size == 0)
+		return false;
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+#ifdef HAVE_LIBZSTD
+	if (!strcmp(format, "zstd")) {
+		const uint8_t *frame = map;
+		size_t left = statbuf.st_size;
+		unsigned long long plain, total = 0;
+		size_t csize;
+
+		/* Every frame has to carry its content size. */
+		known = true;
+		while (left && known) {
+			plain = ZSTD_getFrameContentSize(frame, left);
+			csize = ZSTD_findFrameCompressedSize(frame, left);
+			if (plain == ZSTD_CONTENTSIZE_UNKNOWN ||
+			    plain == ZSTD_CONTENTSIZE_ERROR ||
+			    ZSTD_isError(csize) || total + plain > SIZE_MAX) {
+				known = false;
+				break;
+			}
+			total += plain;
+			frame += csize;
+			left -= csize;
+		}
+		if (known)
+			*size = total;
+	}
+#endif
+#ifdef HAVE_LIBLZMA
+	if (!strcmp(format, "xz") &&
+	    (size_t)statbuf.st_size >= 2 * LZMA_STREAM_HEADER_SIZE) {
+		const uint8_t *footer = map + statbuf.st_size - LZMA_STREAM_HEADER_SIZE;
+		lzma_stream_flags flags;
+		lzma_index *idx = NULL;
+		uint64_t memlimit = UINT64_MAX;
+		size_t pos = 0;
+
+		if (lzma_stream_footer_decode(&flags, footer) == LZMA_OK &&
+		    flags.backward_size <= (lzma_vli)statbuf.st_size - 2 * LZMA_STREAM_HEADER_SIZE &&
+		    lzma_index_buffer_decode(&idx, &memlimit, NULL,
+					     footer - flags.backward_size, &pos,
+					     flags.backward_size) == LZMA_OK) {
+			/* Only a single stream is described by this index. */
+			if (lzma_index_stream_size(idx) == (lzma_vli)statbuf.st_size) {
+				*size = lzma_index_uncompressed_size(idx);
+				known = true;
+			}
+			lzma_index_end(idx, NULL);
+		}
+	}
+#endif
+
+	munmap(map, statbuf.st_size);
+	return known;
+}
+
+/*
+ * Put a decoder between src->fd and the reader.  prefix holds bytes
+ * already read from a stream while sniffing the format.
+ */
+int
+fwup_decompress_start(fwup_source_t *src, const uint8_t *prefix,
+		      size_t prefix_len)
+{
+	struct decoder *dec;
+	int sv[2];
+	int rc;
+
+	if (!format_supported(src->format)) {
+		fwup_warn("%s images are not supported by this build",
+			  src->format);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	dec = calloc(1, sizeof(*dec));
+	if (!dec)
+		return -1;
+	dec->format = src->format;
+	dec->in_fd = src->fd;
+	if (prefix_len)
+		memcpy(dec->prefix, prefix, prefix_len);
+	dec->prefix_len = prefix_len;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		free(dec);
+		return -1;
+	}
+	dec->out_fd = sv[1];
+
+	src->size_known = !prefix_len && plain_size(src->fd, src->format,
+						    &src->size);
+	if (src->size_known)
+		fwup_info("Decompressing %s image, %zu bytes", src->format,
+			  src->size);
+	else
+		fwup_info("Decompressing %s image", src->format);
+	posix_fadvise(src->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	rc = pthread_create(&dec->thread, NULL, decoder_thread, dec);
+	if (rc != 0) {
+		close(sv[0]);
+		close(sv[1]);
+		free(dec);
+		src->size_known = false;
+		errno = rc;
+		return -1;
+	}
+
+	src->fd = sv[0];
+	src->decoder = dec;
+	return 0;
+}
+
+/*
+ * Wait for the decoder and report how it went.
+ */
+int
+fwup_decompress_end(fwup_source_t *src)
+{
+	struct decoder *dec = src->decoder;
+	int error;
+
+	if (!dec)
+		return 0;
+
+	pthread_join(dec->thread, NULL);
+	error = dec->error;
+	close(dec->in_fd);
+	close(dec->out_fd);
+	free(dec);
+	src->decoder = NULL;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
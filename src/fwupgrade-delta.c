@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - reference images for delta uploads
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * The cache holds each image handed to firmware under its digest and
+ * size, "<digest>-<size>.img", and a symlink per request naming the one
+ * it last uploaded.  Images no request points at any more are removed,
+ * so there's at most one per component.  Firmware's staging digest says
+ * whether a reference is still what it holds.
+ */
+
+static int
+make_dir(const char *dir)
+{
+	char *parent = dirname(strdupa(dir));
+
+	if (mkdir(parent, 0700) < 0 && errno != EEXIST)
+		return -1;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/*
+ * Map the image last uploaded for request, if there is one.
+ */
+int
+fwup_delta_open(fwup_delta_t *delta, const char *dir, const char *request)
+{
+	char target[NAME_MAX + 1];
+	unsigned long long size;
+	unsigned int digest;
+	struct stat sb;
+	char *path;
+	ssize_t len;
+	void *map;
+	int fd;
+
+	memset(delta, '\0', sizeof(*delta));
+	if (!dir)
+		dir = FWUP_CACHE_DIR;
+
+	if (asprintfa(&path, "%s/%s", dir, request) < 0)
+		return -1;
+	len = readlink(path, target, sizeof(target) - 1);
+	if (len < 0)
+		return -1;
+	target[len] = '\0';
+	if (sscanf(target, "%08x-%llu.img", &digest, &size) != 2 ||
+	    strchr(target, '/')) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (asprintfa(&path, "%s/%s", dir, target) < 0)
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || (unsigned long long)sb.st_size != size ||
+	    size == 0) {
+		close(fd);
+		errno = EBADMSG;
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	delta->map = map;
+	delta->size = size;
+	delta->digest = digest;
+	return 0;
+}
+
+void
+fwup_delta_close(fwup_delta_t *delta)
+{
+	if (delta->map)
+		munmap(delta->map, delta->size);
+	delta->map = NULL;
+	delta->size = 0;
+}
+
+static int
+write_image(int fd, const fwup_source_t *src)
+{
+	const uint8_t *data = src->map;
+	size_t left = src->size;
+	ssize_t sz;
+
+	while (left) {
+		sz = write(fd, data, left);
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz <= 0)
+			return -1;
+		data += sz;
+		left -= sz;
+	}
+	return fsync(fd);
+}
+
+/*
+ * Whether any request's link still names target.
+ */
+static bool
+still_used(const char *dir, const char *target)
+{
+	char other[NAME_MAX + 1];
+	struct dirent *de;
+	bool used = false;
+	ssize_t len;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return true;
+	while (!used && (de = readdir(d)) != NULL) {
+		if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+			continue;
+		len = readlinkat(dirfd(d), de->d_name, other, sizeof(other) - 1);
+		if (len < 0)
+			continue;
+		other[len] = '\0';
+		used = !strcmp(other, target);
+	}
+	closedir(d);
+	return used;
+}
+
+/*
+ * Keep a copy of the image just uploaded for request, as the reference
+ * its next upload is compared with.  Only mapped images can be copied
+ * without reading them again.
+ */
+int
+fwup_delta_remember(const char *dir, const char *request,
+		    const fwup_source_t *src, uint32_t digest)
+{
+	char target[NAME_MAX + 1], old[NAME_MAX + 1];
+	char *path, *tmp, *link;
+	struct stat sb;
+	ssize_t len;
+	int fd, rc;
+
+	if (!src->mapped) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!dir)
+		dir = FWUP_CACHE_DIR;
+	if (make_dir(dir) < 0)
+		return -1;
+
+	snprintf(target, sizeof(target), "%08x-%zu.img", digest, src->size);
+	if (asprintfa(&path, "%s/%s", dir, target) < 0 ||
+	    asprintfa(&link, "%s/%s", dir, request) < 0)
+		return -1;
+
+	if (stat(path, &sb) < 0 || (size_t)sb.st_size != src->size) {
+		if (asprintfa(&tmp, "%s/.%s.XXXXXX", dir, target) < 0)
+			return -1;
+		fd = mkostemp(tmp, O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		rc = write_image(fd, src);
+		if (close(fd) < 0)
+			rc = -1;
+		if (rc == 0)
+			rc = rename(tmp, path);
+		if (rc < 0) {
+			int saved_errno = errno;
+
+			unlink(tmp);
+			errno = saved_errno;
+			return -1;
+		}
+	}
+
+	len = readlink(link, old, sizeof(old) - 1);
+	old[len < 0 ? 0 : len] = '\0';
+	if (!strcmp(old, target))
+		return 0;
+
+	if (asprintfa(&tmp, "%s/.%s.link", dir, request) < 0)
+		return -1;
+	unlink(tmp);
+	if (symlink(target, tmp) < 0 || rename(tmp, link) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	if (old[0] && !strchr(old, '/') && !still_used(dir, old) &&
+	    asprintfa(&path, "%s/%s", dir, old) >= 0)
+		unlink(path);
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
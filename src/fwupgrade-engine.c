@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - upgrade of one component, start to finish
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fwupgrade.h"
+
+/*
+ * Where messages from this thread go.  Only the thread that runs an
+ * upgrade reports anything; the helper threads it starts stay quiet.
+ */
+static __thread fwup_message_fn message_fn;
+static __thread void *message_data;
+
+void
+fwup_set_message_sink(fwup_message_fn fn, void *data)
+{
+	message_fn = fn;
+	message_data = data;
+}
+
+static void
+message(bool warning, const char *fmt, va_list ap)
+{
+	int saved_errno = errno;
+	char buf[512];
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (message_fn)
+		message_fn(warning, buf, message_data);
+	else
+		fprintf(warning ? stderr : stdout, "amp_fwupgrade: %s\n", buf);
+	errno = saved_errno;
+}
+
+void
+fwup_info(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	message(false, fmt, ap);
+	va_end(ap);
+}
+
+void
+fwup_warn(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	message(true, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Split "left,right" in place.
+ */
+static int
+parse_status(char *data, char **str_left, char **str_right)
+{
+	char *comma;
+
+	if (!data)
+		return -1;
+
+	comma = strchr(data, ',');
+	if (!comma)
+		return -1;
+
+	*comma = '\0';
+	*str_left = data;
+	*str_right = comma + 1;
+	return 0;
+}
+
+static efi_guid_t
+fwup_guid(void)
+{
+	efi_guid_t guid;
+
+	text_to_guid(FWUP_GUID_STR, &guid);
+	return guid;
+}
+
+/*
+ * Open the image and fail on a bad one now, not after uploading all of
+ * it.
+ */
+int
+fwup_upgrade_open(fwup_upgrade_t *upg)
+{
+	if (fwup_source_open(&upg->src, upg->filename) < 0) {
+		fwup_warn("Could not use \"%s\": %m", upg->filename);
+		return -1;
+	}
+	upg->src_open = true;
+
+	if (fwup_image_preflight(&upg->src, upg->name, upg->force,
+				 &upg->info) < 0) {
+		if (errno != EBADMSG && errno != EINVAL)
+			fwup_warn("reading %s: %m", upg->filename);
+		return -1;
+	}
+	return 0;
+}
+
+void
+fwup_upgrade_close(fwup_upgrade_t *upg)
+{
+	if (upg->src_open)
+		fwup_source_close(&upg->src);
+	upg->src_open = false;
+}
+
+/*
+ * Pick up an earlier, interrupted upload of the same image.  A journal
+ * problem only costs us the ability to resume, so it isn't fatal.
+ */
+static void
+open_journal(fwup_upgrade_t *upg, fwup_upload_t *up, fwup_journal_t *journal)
+{
+	char *path = (char *)upg->journal_path;
+	size_t resume_at = 0, resume_chunk = 0, fw_offset;
+	int rc;
+
+	if (!upg->info.has_digest) {
+		fwup_warn("not resumable: %s is not a regular file",
+			  upg->filename);
+		return;
+	}
+
+	if (!path && asprintfa(&path, "%s/%s.journal", FWUP_JOURNAL_DIR, up->name) < 0) {
+		fwup_warn("not resumable: %m");
+		return;
+	}
+
+	rc = fwup_journal_open(journal, path, up->name, upg->info.digest,
+			       up->src->size, &resume_at, &resume_chunk);
+	if (rc < 0) {
+		fwup_warn("not resumable: %s: %m", path);
+		return;
+	}
+	up->journal = journal;
+
+	if (resume_at == 0 || resume_chunk == 0)
+		return;
+
+	/* Trust firmware over the journal if it has seen less. */
+	if (!up->record && fwup_firmware_offset(up->guid, &fw_offset) == 0 &&
+	    fw_offset < resume_at)
+		resume_at = fw_offset;
+
+	up->start = resume_at;
+	up->chunk_size = upg->chunk_size ? upg->chunk_size : resume_chunk;
+	fwup_info("Resuming upload at offset %zu of %zu", up->start,
+		  up->src->size);
+}
+
+/*
+ * Find the version firmware says component runs, from the
+ * "<component>,<version>" lines of UpgradeFirmwareVersions.
+ */
+int
+fwup_running_version(const char *component, char *version, size_t size)
+{
+	char *str_left, *str_right, *line, *save = NULL;
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	char *text;
+	int rc;
+
+	rc = efi_get_variable(fwup_guid(), FWUP_FIRMWARE_VERSIONS, &data,
+			      &data_size, &attributes);
+	if (rc < 0)
+		return -1;
+	text = strndupa((char *)data, data_size);
+	free(data);
+
+	for (line = strtok_r(text, "\r\n", &save); line;
+	     line = strtok_r(NULL, "\r\n", &save)) {
+		if (parse_status(line, &str_left, &str_right) < 0 ||
+		    strcmp(str_left, component))
+			continue;
+		strncpy(version, str_right, size - 1);
+		version[size - 1] = '\0';
+		return 0;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/*
+ * Reflashing what firmware already runs costs downtime for nothing, so
+ * an image whose version firmware reports for its component is skipped
+ * unless forced.  Images without a version are always flashed.
+ */
+static bool
+upgrade_current(fwup_upgrade_t *upg)
+{
+	const char *component = fwup_request_component(upg->name);
+	char running[FWUP_VERSION_MAX + 1];
+
+	upg->current = false;
+	if (!upg->info.has_version || !component)
+		return false;
+
+	if (fwup_running_version(component, running, sizeof(running)) < 0) {
+		if (efi_get_verbose())
+			fwup_warn("running %s version unknown: %m", component);
+		return false;
+	}
+	if (strcmp(running, upg->info.version)) {
+		fwup_info("%s version %s, upgrading to %s", component, running,
+			  upg->info.version);
+		return false;
+	}
+	if (upg->force) {
+		fwup_info("%s is already at version %s, flashing it anyway",
+			  component, running);
+		return false;
+	}
+
+	fwup_info("%s is already at version %s, skipping", component, running);
+	upg->current = true;
+	strncpy(upg->component, component, sizeof(upg->component) - 1);
+	strncpy(upg->result, "CURRENT", sizeof(upg->result) - 1);
+	return true;
+}
+
+/*
+ * Tell firmware which ranges of a sparse upload it didn't get.  A
+ * resumed upload only knows about the ranges since it resumed, which
+ * would be a wrong map, so firmware gets none and relies on its fill.
+ */
+static int
+write_elided(fwup_upgrade_t *upg, fwup_upload_t *up, bool resumed)
+{
+	unsigned int attempt = 0;
+	int rc;
+
+	if (resumed) {
+		fwup_info("Resumed, not sending the map of skipped ranges");
+		return 0;
+	}
+	do {
+		rc = efi_set_variable(up->guid, FWUP_ELIDED_RANGES,
+				      (uint8_t *)up->elided,
+				      up->nelided * sizeof(*up->elided),
+				      FWUP_ATTRS, 0644);
+	} while (rc < 0 && fwup_retry(&attempt, errno, false));
+	if (rc < 0)
+		fwup_warn("writing %s for %s: %m", FWUP_ELIDED_RANGES,
+			  upg->name);
+	return rc;
+}
+
+/*
+ * Have firmware start a delta upload from its staging contents, when
+ * those are the image last uploaded for this request and we still have
+ * a copy of it to compare with.  Any mismatch just means a full upload.
+ */
+static void
+start_delta(fwup_upgrade_t *upg, fwup_upload_t *up, uint32_t caps,
+	    fwup_delta_t *delta)
+{
+	fwup_staging_t staging;
+	fwup_delta_base_t base;
+	unsigned int attempt = 0;
+	int rc;
+
+	if (!(caps & FWUP_CAP_DELTA)) {
+		fwup_info("Firmware can't start from its staging contents, uploading all of the image");
+		return;
+	}
+	if (fwup_delta_open(delta, upg->cache_dir, upg->name) < 0) {
+		if (errno == ENOENT)
+			fwup_info("No earlier image of %s to compare with",
+				  upg->name);
+		else
+			fwup_warn("no delta reference for %s: %m", upg->name);
+		return;
+	}
+	if (fwup_firmware_staging(up->guid, &staging) < 0 ||
+	    le32_to_cpu(staging.digest) != delta->digest ||
+	    le64_to_cpu(staging.size) != delta->size) {
+		fwup_info("Firmware no longer holds the earlier image, uploading all of it");
+		fwup_delta_close(delta);
+		return;
+	}
+
+	memset(&base, '\0', sizeof(base));
+	base.digest = cpu_to_le32(delta->digest);
+	base.base_size = cpu_to_le64(delta->size);
+	base.image_size = cpu_to_le64(up->src->size);
+	do {
+		rc = efi_set_variable(up->guid, FWUP_DELTA_BASE,
+				      (uint8_t *)&base, sizeof(base),
+				      FWUP_ATTRS, 0644);
+	} while (rc < 0 && fwup_retry(&attempt, errno, false));
+	if (rc < 0) {
+		fwup_warn("writing %s for %s: %m", FWUP_DELTA_BASE, upg->name);
+		fwup_delta_close(delta);
+		return;
+	}
+
+	up->ref = delta->map;
+	up->ref_size = delta->size;
+	fwup_info("Uploading changes against image 0x%08x", delta->digest);
+}
+
+/*
+ * What pacing cost and saved, once the upload is over.
+ */
+static void
+end_pacing(fwup_pacer_t *pacer)
+{
+	fwup_info("Paced upload: CPU stalled %.1f ms in %lu chunks, at most %.1f ms a chunk, %.1f s spent waiting",
+		  pacer->stall_ns / 1e6, pacer->chunks,
+		  pacer->max_stall_ns / 1e6, pacer->slept_ns / 1e9);
+	fwup_pacer_end(pacer);
+}
+
+/*
+ * Upload the image and write the request variable, which hands it to
+ * firmware.  From then on the flash can't be called back.
+ */
+int
+fwup_upgrade_send(fwup_upgrade_t *upg)
+{
+	const char *name = upg->name;
+	fwup_source_t *src = &upg->src;
+	size_t str_status_size = 0;
+	uint32_t attributes = 0;
+	char *str_status = NULL;
+	char *str_left, *str_right;
+	const uint8_t *head;
+	size_t xfer_size, got;
+	fwup_journal_t journal;
+	fwup_delta_t delta = { 0, };
+	fwup_pacer_t pacer;
+	fwup_upload_t up = {
+		.guid = fwup_guid(),
+		.name = name,
+		.src = src,
+		.chunk_crc = upg->chunk_crc,
+		.progress = upg->progress,
+		.cancel = &upg->cancel,
+	};
+	unsigned int attempt = 0;
+	uint32_t caps = 0;
+	bool resumed;
+	size_t requested;
+	uint64_t start;
+	int saved_errno;
+	int rc;
+
+	if (upgrade_current(upg))
+		return 0;
+
+	fwup_info("Initializing");
+
+	rc = efi_get_variable(up.guid, name, (uint8_t **)&str_status,
+			      &str_status_size, &attributes);
+	if (rc == 0) {
+		rc = parse_status(str_status, &str_left, &str_right);
+		if (rc < 0) {
+			fwup_warn("failed to parse status");
+			free(str_status);
+			errno = EPROTO;
+			return -1;
+		}
+
+		/* Only upgrade if has not started */
+		if (strstr(str_right, "IN_PROCESS")) {
+			fwup_warn("Can't start upgrading: (%s,%s)", str_left,
+				  str_right);
+			free(str_status);
+			errno = EBUSY;
+			return -1;
+		}
+	}
+	free(str_status);
+
+	if (upg->single_record || upg->sparse || upg->delta)
+		fwup_firmware_caps(up.guid, &caps);
+	if (upg->single_record) {
+		up.record = !!(caps & FWUP_CAP_RECORD);
+		if (!up.record)
+			fwup_info("Firmware has no single-record upload, using offset and data writes");
+	}
+	if (upg->sparse) {
+		up.sparse = !!(caps & FWUP_CAP_SPARSE);
+		up.fill = FWUP_CAP_FILL(caps);
+		if (!up.sparse)
+			fwup_info("Firmware doesn't pre-fill its staging buffer, uploading every chunk");
+	}
+
+	/* Probing writes chunks too, so it is paced along with them. */
+	if (upg->pace) {
+		fwup_pacer_begin(&pacer, upg->pace);
+		up.pacer = &pacer;
+	}
+
+	if (upg->resume)
+		open_journal(upg, &up, &journal);
+	resumed = up.start != 0;
+
+	/* A resumed upload already has its base; a stream has no size. */
+	if (upg->delta && !resumed && src->size_known)
+		start_delta(upg, &up, caps, &delta);
+
+	if (!up.start && !upg->chunk_size && upg->negotiated) {
+		/* Same backend and firmware as the last component. */
+		up.chunk_size = upg->negotiated;
+		fwup_info("Transfer size %zu bytes (as before)", up.chunk_size);
+		if (upg->progress)
+			fwup_progress_probe(upg->progress,
+					    efi_variables_backend(),
+					    up.chunk_size, "reused", 0);
+	} else {
+		requested = up.start ? up.chunk_size : upg->chunk_size;
+		start = fwup_now_ns();
+		rc = fwup_negotiate_chunk_size(&up, requested);
+		if (rc < 0)
+			goto err;
+		upg->negotiated = up.chunk_size;
+		if (upg->progress)
+			fwup_progress_probe(upg->progress,
+					    efi_variables_backend(),
+					    up.chunk_size,
+					    !requested ? "probed" :
+					    up.start ? "journal" : "requested",
+					    fwup_now_ns() - start);
+	}
+
+	/*
+	 * The request carries the head of the image.  Read one byte past it
+	 * to learn whether anything is left over for the chunks.
+	 */
+	xfer_size = FWUP_MAX_XFER_SIZE;
+	if (xfer_size > up.chunk_size)
+		xfer_size = up.chunk_size;
+	if (fwup_source_peek(src, xfer_size + 1, &head, &got) < 0 || got == 0) {
+		if (got == 0)
+			errno = ENODATA;
+		fwup_warn("reading %s: %m", src->filename);
+		goto err;
+	}
+
+	if (got > xfer_size) {
+		rc = fwup_upload_chunks(&up);
+		if (rc < 0)
+			goto err;
+	} else {
+		xfer_size = got;
+	}
+	if (up.ref)
+		fwup_info("%zu of %zu bytes unchanged, not sent",
+			  up.unchanged_bytes, src->size);
+	if (up.elided_bytes) {
+		fwup_info("Skipped %zu of %zu bytes of 0x%02x fill",
+			  up.elided_bytes, src->size, up.fill);
+		if ((caps & FWUP_CAP_ELIDED_MAP) &&
+		    write_elided(upg, &up, resumed) < 0)
+			goto err;
+	}
+	if (upg->progress)
+		fwup_progress_phase(upg->progress, FWUP_PHASE_REQUEST);
+
+	if (upg->cancel) {
+		errno = ECANCELED;
+		goto err;
+	}
+
+	do {
+		rc = efi_set_variable(up.guid, name, (uint8_t *)head,
+				      xfer_size, FWUP_ATTRS, 0644);
+	} while (rc < 0 && fwup_retry(&attempt, errno, false));
+	if (rc < 0) {
+		fwup_warn("writing %s: %m", name);
+		goto err;
+	}
+
+	if (up.journal)
+		fwup_journal_close(up.journal, true);
+	fwup_upload_close(&up);
+	free(up.elided);
+	fwup_delta_close(&delta);
+	if (up.pacer)
+		end_pacing(up.pacer);
+
+	/* What firmware stages now is the reference for the next upload. */
+	if (upg->delta && upg->info.has_digest &&
+	    fwup_delta_remember(upg->cache_dir, name, src,
+				upg->info.digest) < 0)
+		fwup_warn("not keeping %s for delta uploads: %m",
+			  src->filename);
+
+	fwup_info("Upgrade is in process, do not terminate this application");
+	return 0;
+err:
+	saved_errno = errno;
+	if (upg->progress)
+		fwup_progress_phase(upg->progress, FWUP_PHASE_DONE);
+	if (up.journal)
+		fwup_journal_close(up.journal, false);
+	fwup_upload_close(&up);
+	free(up.elided);
+	fwup_delta_close(&delta);
+	if (up.pacer)
+		end_pacing(up.pacer);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Follow the flash until firmware reports how it went.  The final
+ * status is left in upg->component and upg->result; a failure reported
+ * by firmware comes back as EIO.  A skipped upgrade has nothing to
+ * follow; its result is "CURRENT".
+ */
+int
+fwup_upgrade_poll(fwup_upgrade_t *upg)
+{
+	char *str_status = NULL;
+	char *str_left, *str_right;
+	fwup_status_t st;
+	unsigned long ul;
+	int num_retry = 5;
+	int saved_errno;
+	int rc;
+
+	if (upg->current) {
+		if (upg->progress)
+			fwup_progress_phase(upg->progress, FWUP_PHASE_DONE);
+		return 0;
+	}
+
+	upg->component[0] = '\0';
+	upg->result[0] = '\0';
+
+	fwup_status_open(&st, fwup_guid(), upg->name);
+	st.wake_fd = upg->wake_fd;
+	do {
+		fwup_status_wait(&st);
+		if (upg->cancel) {
+			errno = ECANCELED;
+			rc = -1;
+			break;
+		}
+
+		rc = fwup_status_read(&st, &str_status);
+		if (rc < 0) {
+			if (num_retry > 0) {
+				if (efi_get_verbose())
+					fwup_warn("reading status: %m, retrying");
+				num_retry--;
+				continue;
+			}
+			fwup_warn("reading status: %m");
+			break;
+		}
+
+		rc = parse_status(str_status, &str_left, &str_right);
+		if (rc < 0) {
+			fwup_warn("failed to parse status");
+			errno = EPROTO;
+			break;
+		}
+
+		if (!strcmp(str_left, "NULL")) {
+			/* Not started */
+			strncpy(upg->component, str_left,
+				sizeof(upg->component) - 1);
+			break;
+		}
+		if (!strncmp(str_right, "IN_PROCESS,", strlen("IN_PROCESS,"))) {
+			char *component = str_left;
+
+			rc = parse_status(str_right, &str_left, &str_right);
+			if (rc < 0) {
+				fwup_warn("failed to parse percentage process");
+				errno = EPROTO;
+				break;
+			}
+			ul = strtoul(str_right, NULL, 0);
+			if (upg->progress)
+				fwup_progress_flash(upg->progress, component,
+						    ul);
+			fwup_status_update(&st, ul);
+		} else {
+			strncpy(upg->component, str_left,
+				sizeof(upg->component) - 1);
+			strncpy(upg->result, str_right,
+				sizeof(upg->result) - 1);
+			if (strcmp(str_right, "SUCCESS")) {
+				errno = EIO;
+				rc = -1;
+			}
+			break;
+		}
+	} while (1);
+	saved_errno = errno;
+	fwup_status_close(&st);
+
+	if (upg->progress)
+		fwup_progress_phase(upg->progress, FWUP_PHASE_DONE);
+	errno = saved_errno;
+	return rc < 0 ? -1 : 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
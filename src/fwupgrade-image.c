@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - image helpers
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+struct digest_job {
+	const uint8_t *data;
+	size_t data_size;
+	uint32_t *crcs;
+	size_t first;
+	size_t last;
+};
+
+static void *
+digest_segments(void *arg)
+{
+	struct digest_job *job = arg;
+	size_t i;
+
+	for (i = job->first; i < job->last; i++) {
+		size_t off = i * FWUP_DIGEST_SEGMENT;
+		size_t len = job->data_size - off;
+
+		if (len > FWUP_DIGEST_SEGMENT)
+			len = FWUP_DIGEST_SEGMENT;
+		job->crcs[i] = cpu_to_le32(efi_crc32(job->data + off, len));
+	}
+	return NULL;
+}
+
+/*
+ * The image digest identifies an image; it says nothing about its
+ * authenticity, which the firmware checks against the dbu signature.
+ * It is the CRC32 of the list of CRC32s of each FWUP_DIGEST_SEGMENT
+ * sized piece of the image, so segments are hashed on several threads,
+ * each taking a contiguous run of them.
+ */
+int
+fwup_image_digest(const uint8_t *data, size_t data_size, uint32_t *digest)
+{
+	size_t nsegs = (data_size + FWUP_DIGEST_SEGMENT - 1) / FWUP_DIGEST_SEGMENT;
+	struct digest_job jobs[FWUP_DIGEST_THREADS];
+	pthread_t threads[FWUP_DIGEST_THREADS];
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads, per, i;
+	size_t started = 0;
+	uint32_t *crcs;
+
+	crcs = calloc(nsegs ? nsegs : 1, sizeof(*crcs));
+	if (!crcs)
+		return -1;
+
+	nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+	if (nthreads > FWUP_DIGEST_THREADS)
+		nthreads = FWUP_DIGEST_THREADS;
+	if (nthreads > nsegs)
+		nthreads = nsegs ? nsegs : 1;
+	per = (nsegs + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].data = data;
+		jobs[i].data_size = data_size;
+		jobs[i].crcs = crcs;
+		jobs[i].first = i * per < nsegs ? i * per : nsegs;
+		jobs[i].last = (i + 1) * per < nsegs ? (i + 1) * per : nsegs;
+	}
+
+	/* The calling thread takes the first run itself. */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, digest_segments, &jobs[i]) != 0)
+			break;
+		started = i;
+	}
+	digest_segments(&jobs[0]);
+	for (i = started + 1; i < nthreads; i++)
+		digest_segments(&jobs[i]);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	*digest = efi_crc32(crcs, nsegs * sizeof(*crcs));
+	free(crcs);
+	return 0;
+}
+
+static const struct {
+	const char *request;
+	uint32_t type;
+	const char *component;
+} request_types[] = {
+	{ "UpgradeATFUEFIRequest", FWUP_IMAGE_ATFUEFI, "ATF" },
+	{ "UpgradeUEFIRequest", FWUP_IMAGE_UEFI, "UEFI" },
+	{ "UpgradeCFGUEFIRequest", FWUP_IMAGE_UEFICFG, "UEFICFG" },
+	{ "UpgradeSCPRequest", FWUP_IMAGE_SCP, "SCP" },
+	{ "UpgradeSingleImageFullFlashRequest", FWUP_IMAGE_SINGLE, "FW" },
+	{ "UpgradeSingleImageFWOnlyRequest", FWUP_IMAGE_SINGLE, "FW" },
+	{ "UpgradeSingleImageClearSettingRequest", FWUP_IMAGE_SINGLE, "FW" },
+};
+
+bool
+fwup_request_known(const char *name)
+{
+	return fwup_request_component(name) != NULL;
+}
+
+/*
+ * The component firmware names in its status for a request.
+ */
+const char *
+fwup_request_component(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(request_types) / sizeof(request_types[0]); i++) {
+		if (!strcmp(request_types[i].request, name))
+			return request_types[i].component;
+	}
+	return NULL;
+}
+
+static const char *
+type_name(uint32_t type)
+{
+	switch (type) {
+	case FWUP_IMAGE_ATFUEFI:
+		return "ATF and UEFI";
+	case FWUP_IMAGE_UEFI:
+		return "UEFI";
+	case FWUP_IMAGE_UEFICFG:
+		return "UEFI and board settings";
+	case FWUP_IMAGE_SCP:
+		return "SCP";
+	case FWUP_IMAGE_SINGLE:
+		return "single image";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Images as Ampere ships them carry no header we can read, only the dbu
+ * signature firmware checks, but their names say what they hold:
+ * altra_scp_*, jade_aptiov_atf_*, jade_aptiovcfg_* and jade_aptiov_*.
+ * Returns 0 for a name that doesn't say.
+ */
+static uint32_t
+type_from_filename(const char *filename)
+{
+	const char *base = strrchr(filename, '/');
+
+	base = base ? base + 1 : filename;
+	if (strcasestr(base, "scp"))
+		return FWUP_IMAGE_SCP;
+	if (strcasestr(base, "aptiovcfg"))
+		return FWUP_IMAGE_UEFICFG;
+	if (strcasestr(base, "atf"))
+		return FWUP_IMAGE_ATFUEFI;
+	if (strcasestr(base, "aptiov"))
+		return FWUP_IMAGE_UEFI;
+	return 0;
+}
+
+/*
+ * For an image without a header, going by its name is the only check of
+ * its type we can make: one named for another component is refused
+ * unless forced, and one whose name doesn't say is let through.
+ */
+static int
+check_filename(fwup_source_t *src, const char *name, bool force)
+{
+	uint32_t type = type_from_filename(src->filename);
+	size_t i;
+
+	if (!type)
+		return 0;
+	for (i = 0; i < sizeof(request_types) / sizeof(request_types[0]); i++) {
+		if (strcmp(request_types[i].request, name))
+			continue;
+		if (request_types[i].type == type ||
+		    request_types[i].type == FWUP_IMAGE_SINGLE)
+			return 0;
+		if (force) {
+			fwup_warn("%s: its name says %s, which doesn't match %s; flashing it anyway",
+				  src->filename, type_name(type), name);
+			return 0;
+		}
+		fwup_warn("%s: its name says %s, which doesn't match %s; use --force if the image is right",
+			  src->filename, type_name(type), name);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Check the header against the request before anything is uploaded, so
+ * a truncated or mismatched image fails now rather than after the whole
+ * transfer.  Images without a header we know, which is every image
+ * Ampere ships, can only be checked by name; firmware has the final word
+ * on those, and the operator is told so.
+ */
+int
+fwup_image_preflight(fwup_source_t *src, const char *name, bool force,
+		     fwup_image_info_t *info)
+{
+	fwup_image_header_t hdr;
+	fwup_image_version_t ver;
+	const uint8_t *head;
+	size_t got, i;
+	uint32_t crc;
+	uint64_t image_size;
+
+	memset(info, '\0', sizeof(*info));
+
+	if (fwup_source_peek(src, sizeof(hdr), &head, &got) < 0)
+		return -1;
+	if (got < sizeof(hdr) ||
+	    le32_to_cpu(((const fwup_image_header_t *)head)->magic) != FWUP_IMAGE_MAGIC) {
+		if (check_filename(src, name, force) < 0)
+			return -1;
+		fwup_info("%s has no image header; its length and contents are left to firmware to check",
+			  src->filename);
+		goto digest;
+	}
+	memcpy(&hdr, head, sizeof(hdr));
+
+	crc = hdr.header_crc;
+	hdr.header_crc = 0;
+	if (le32_to_cpu(crc) != efi_crc32(&hdr, sizeof(hdr))) {
+		fwup_warn("%s: image header is corrupt", src->filename);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	info->has_header = true;
+	info->image_type = le32_to_cpu(hdr.image_type);
+	image_size = le64_to_cpu(hdr.image_size);
+
+	if (le32_to_cpu(hdr.header_size) < sizeof(hdr) ||
+	    image_size < le32_to_cpu(hdr.header_size) +
+			 (uint64_t)le32_to_cpu(hdr.signature_size) ||
+	    image_size > UINT32_MAX) {
+		fwup_warn("%s: image header is inconsistent", src->filename);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (le32_to_cpu(hdr.flags) & FWUP_IMAGE_VERSIONED) {
+		if (le32_to_cpu(hdr.header_size) < sizeof(hdr) + sizeof(ver) ||
+		    fwup_source_peek(src, sizeof(hdr) + sizeof(ver), &head,
+				     &got) < 0 ||
+		    got < sizeof(hdr) + sizeof(ver)) {
+			fwup_warn("%s: image version is missing", src->filename);
+			errno = EBADMSG;
+			return -1;
+		}
+		memcpy(&ver, head + sizeof(hdr), sizeof(ver));
+		if (le32_to_cpu(ver.version_crc) !=
+		    efi_crc32(ver.version, sizeof(ver.version))) {
+			fwup_warn("%s: image version is corrupt", src->filename);
+			errno = EBADMSG;
+			return -1;
+		}
+		info->has_version = true;
+		memcpy(info->version, ver.version, sizeof(ver.version));
+		info->version[sizeof(ver.version)] = '\0';
+	}
+
+	for (i = 0; i < sizeof(request_types) / sizeof(request_types[0]); i++) {
+		if (strcmp(request_types[i].request, name))
+			continue;
+		if (request_types[i].type != info->image_type) {
+			fwup_warn("%s: image type %s does not match %s",
+				  src->filename, type_name(info->image_type),
+				  name);
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	}
+
+	if (src->size_known && src->size != image_size) {
+		fwup_warn("%s: %s, header says %" PRIu64 " bytes but there are %zu",
+			  src->filename,
+			  src->size < image_size ? "image is truncated" : "trailing data after image",
+			  image_size, src->size);
+		errno = EBADMSG;
+		return -1;
+	}
+	if (!src->size_known) {
+		/* A stream is held to this when it ends. */
+		src->size = image_size;
+		src->size_known = true;
+	}
+
+digest:
+	if (src->mapped) {
+		if (fwup_image_digest(src->map, src->size, &info->digest) < 0)
+			return -1;
+		info->has_digest = true;
+		/* Keep the page cache; just don't hold it all resident. */
+		madvise(src->map, src->size, MADV_DONTNEED);
+		if (efi_get_verbose())
+			fwup_info("image digest 0x%08x", info->digest);
+	}
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - upload journal for resuming interrupted transfers
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+#define JOURNAL_MAGIC	0x4a574641	/* "AFWJ" */
+#define JOURNAL_VERSION	1
+
+/*
+ * One fixed-size record, rewritten in place after every acknowledged
+ * chunk.  It's well under a sector, and the trailing CRC catches the
+ * rare torn write, in which case we simply start over.
+ */
+struct journal_record {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t digest;
+	uint32_t chunk_size;
+	uint64_t image_size;
+	uint64_t acked;
+	char name[64];
+	uint32_t crc;
+} PACKED;
+
+static int
+make_parent_dir(const char *path)
+{
+	char *dir = strdupa(path);
+	int rc;
+
+	dir = dirname(dir);
+	rc = mkdir(dir, 0700);
+	if (rc < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int
+read_record(int fd, struct journal_record *rec)
+{
+	ssize_t sz;
+
+	sz = pread(fd, rec, sizeof(*rec), 0);
+	if (sz != sizeof(*rec))
+		return -1;
+	if (le32_to_cpu(rec->magic) != JOURNAL_MAGIC ||
+	    le32_to_cpu(rec->version) != JOURNAL_VERSION)
+		return -1;
+	if (le32_to_cpu(rec->crc) != efi_crc32(rec, offsetof(struct journal_record, crc)))
+		return -1;
+	return 0;
+}
+
+static int
+write_record(fwup_journal_t *journal)
+{
+	struct journal_record rec;
+
+	memset(&rec, '\0', sizeof(rec));
+	rec.magic = cpu_to_le32(JOURNAL_MAGIC);
+	rec.version = cpu_to_le32(JOURNAL_VERSION);
+	rec.digest = cpu_to_le32(journal->digest);
+	rec.chunk_size = cpu_to_le32(journal->chunk_size);
+	rec.image_size = cpu_to_le64(journal->image_size);
+	rec.acked = cpu_to_le64(journal->acked);
+	strncpy(rec.name, journal->name, sizeof(rec.name) - 1);
+	rec.crc = cpu_to_le32(efi_crc32(&rec, offsetof(struct journal_record, crc)));
+
+	if (pwrite(journal->fd, &rec, sizeof(rec), 0) != sizeof(rec))
+		return -1;
+	return fdatasync(journal->fd);
+}
+
+/*
+ * Open (or create) the journal at path.  If it describes this same image
+ * and request, *resume is set to the last offset we know the firmware
+ * accepted and *chunk_size to the size used then; otherwise both are 0.
+ */
+int
+fwup_journal_open(fwup_journal_t *journal, const char *path, const char *name,
+		  uint32_t digest, size_t image_size, size_t *resume,
+		  size_t *chunk_size)
+{
+	struct journal_record rec;
+
+	memset(journal, '\0', sizeof(*journal));
+	journal->fd = -1;
+	*resume = 0;
+	*chunk_size = 0;
+
+	if (make_parent_dir(path) < 0)
+		return -1;
+
+	journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (journal->fd < 0)
+		return -1;
+
+	journal->path = strdup(path);
+	if (!journal->path) {
+		close(journal->fd);
+		journal->fd = -1;
+		return -1;
+	}
+	strncpy(journal->name, name, sizeof(journal->name) - 1);
+	journal->digest = digest;
+	journal->image_size = image_size;
+
+	if (read_record(journal->fd, &rec) == 0 &&
+	    le32_to_cpu(rec.digest) == digest &&
+	    le64_to_cpu(rec.image_size) == image_size &&
+	    !strncmp(rec.name, name, sizeof(rec.name)) &&
+	    le64_to_cpu(rec.acked) <= image_size) {
+		*resume = le64_to_cpu(rec.acked);
+		*chunk_size = le32_to_cpu(rec.chunk_size);
+	}
+	return 0;
+}
+
+int
+fwup_journal_ack(fwup_journal_t *journal, size_t chunk_size, size_t acked)
+{
+	if (!journal || journal->fd < 0)
+		return 0;
+
+	journal->chunk_size = chunk_size;
+	journal->acked = acked;
+	return write_record(journal);
+}
+
+/*
+ * Drop the journal once the request has been handed to firmware; keep
+ * it otherwise so the next run can pick up where this one stopped.
+ */
+void
+fwup_journal_close(fwup_journal_t *journal, bool complete)
+{
+	if (journal->fd >= 0) {
+		close(journal->fd);
+		journal->fd = -1;
+	}
+	if (journal->path) {
+		if (complete)
+			unlink(journal->path);
+		free(journal->path);
+		journal->path = NULL;
+	}
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - pacing uploads on busy nodes
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/* From linux/ioprio.h, which not every libc's headers carry. */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+
+/* Sleep in slices, so cancelling doesn't wait out a long pause. */
+#define PACE_SLICE_NS		(100 * 1000 * 1000ULL)
+
+/*
+ * Move the calling thread, and the threads it starts from now on, which
+ * inherit all three, onto the housekeeping CPU at idle priority.  None
+ * of it is fatal; an upload that can't be confined is still paced.
+ */
+void
+fwup_pacer_begin(fwup_pacer_t *pacer, const fwup_pace_t *pace)
+{
+	struct sched_param param = { .sched_priority = 0, };
+	cpu_set_t cpus;
+	int rc;
+
+	memset(pacer, '\0', sizeof(*pacer));
+	pacer->pace = pace;
+	pacer->ioprio = -1;
+	pacer->start_ns = fwup_now_ns();
+
+	if (pace->cpu >= 0) {
+		pacer->have_affinity = pthread_getaffinity_np(pthread_self(),
+				sizeof(pacer->affinity), &pacer->affinity) == 0;
+		CPU_ZERO(&cpus);
+		CPU_SET(pace->cpu, &cpus);
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rc != 0) {
+			errno = rc;
+			fwup_warn("can't move the upload to CPU %d: %m",
+				  pace->cpu);
+			pacer->have_affinity = false;
+		}
+	}
+
+	pacer->have_sched = pthread_getschedparam(pthread_self(),
+			&pacer->policy, &pacer->param) == 0;
+	rc = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (rc != 0) {
+		errno = rc;
+		fwup_warn("can't lower the upload's CPU priority: %m");
+		pacer->have_sched = false;
+	}
+
+	pacer->ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (pacer->ioprio >= 0 &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+		fwup_warn("can't lower the upload's I/O priority: %m");
+		pacer->ioprio = -1;
+	}
+}
+
+/*
+ * A chunk took busy_ns to write, all of it in firmware.  Sleep until both
+ * the rate and the duty cycle allow the next one.
+ */
+void
+fwup_pacer_chunk(fwup_pacer_t *pacer, size_t size, uint64_t busy_ns,
+		 volatile bool *cancel)
+{
+	const fwup_pace_t *pace = pacer->pace;
+	uint64_t now, due = 0, step;
+	int saved_errno = errno;
+	struct timespec ts;
+
+	pacer->sent += size;
+	pacer->stall_ns += busy_ns;
+	if (busy_ns > pacer->max_stall_ns)
+		pacer->max_stall_ns = busy_ns;
+	pacer->chunks++;
+	if (!pace->rate && !pace->duty)
+		return;
+
+	now = fwup_now_ns();
+	if (pace->rate)
+		due = pacer->start_ns +
+		      (uint64_t)((double)pacer->sent * 1e9 / pace->rate);
+	if (pace->duty && pace->duty < 100 &&
+	    now + busy_ns * (100 - pace->duty) / pace->duty > due)
+		due = now + busy_ns * (100 - pace->duty) / pace->duty;
+
+	while (now < due && !(cancel && *cancel)) {
+		step = due - now < PACE_SLICE_NS ? due - now : PACE_SLICE_NS;
+		ts.tv_sec = step / 1000000000ULL;
+		ts.tv_nsec = step % 1000000000ULL;
+		nanosleep(&ts, NULL);
+		pacer->slept_ns += fwup_now_ns() - now;
+		now = fwup_now_ns();
+	}
+	errno = saved_errno;
+}
+
+/*
+ * Put the thread back the way it was; a daemon or library thread goes on
+ * to do other things.
+ */
+void
+fwup_pacer_end(fwup_pacer_t *pacer)
+{
+	if (pacer->have_affinity)
+		pthread_setaffinity_np(pthread_self(), sizeof(pacer->affinity),
+				       &pacer->affinity);
+	if (pacer->have_sched)
+		pthread_setschedparam(pthread_self(), pacer->policy,
+				      &pacer->param);
+	if (pacer->ioprio >= 0)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, pacer->ioprio);
+	pacer->have_affinity = pacer->have_sched = false;
+	pacer->ioprio = -1;
+}
+
+// vim:fenc=utf-8:tw=75:noet
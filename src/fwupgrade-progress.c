@@ -0,0 +1,534 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - progress rendering
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fwupgrade.h"
+
+/*
+ * Progress is drawn from its own thread so that neither the uploader nor
+ * the status poller ever block on the terminal.  Producers only bump the
+ * shared state and signal; the renderer redraws from a snapshot.
+ */
+struct screen {
+	fwup_phase_t phase;
+	bool header;
+	bool counting;		/* showing KiB, total not known yet */
+	unsigned int shown;
+};
+
+static void
+draw(struct screen *scr, fwup_progress_t *snap)
+{
+	unsigned int pct;
+
+	switch (snap->phase) {
+	case FWUP_PHASE_UPLOAD:
+		if (!snap->total) {
+			/* Streamed input of unknown length: count KiB. */
+			fprintf(stdout, "\rUploading %s: %zu KiB",
+				snap->name, snap->uploaded / 1024);
+			scr->phase = FWUP_PHASE_UPLOAD;
+			scr->counting = true;
+			break;
+		}
+		pct = snap->uploaded * 100 / snap->total;
+		if (scr->phase != FWUP_PHASE_UPLOAD || scr->counting) {
+			fprintf(stdout, "%sUploading %s: %2u%%%s",
+				scr->counting ? "\r" : "", snap->name, pct,
+				scr->counting ? "\033[K" : "");
+			scr->counting = false;
+			scr->phase = FWUP_PHASE_UPLOAD;
+		} else if (pct != scr->shown) {
+			fprintf(stdout, "\b\b\b%2u%%", pct);
+		}
+		scr->shown = pct;
+		break;
+	case FWUP_PHASE_FLASH:
+		if (scr->phase == FWUP_PHASE_UPLOAD)
+			fprintf(stdout, "\n");
+		if (scr->phase != FWUP_PHASE_FLASH) {
+			fprintf(stdout, "Upgrading %s ", snap->component);
+			scr->phase = FWUP_PHASE_FLASH;
+			scr->header = false;
+		}
+		if (snap->percent == 0)
+			break;
+		if (!scr->header) {
+			fprintf(stdout, "processed: %2u%%", snap->percent);
+			scr->header = true;
+		} else if (snap->percent != scr->shown) {
+			fprintf(stdout, "\b\b\b%2u%%", snap->percent);
+		}
+		scr->shown = snap->percent;
+		break;
+	default:
+		if (scr->phase == FWUP_PHASE_UPLOAD)
+			fprintf(stdout, "\n");
+		scr->phase = snap->phase;
+		break;
+	}
+	fflush(stdout);
+}
+
+static void *
+render(void *arg)
+{
+	fwup_progress_t *progress = arg;
+	struct screen scr = { .phase = FWUP_PHASE_INIT, };
+	unsigned int seen = 0;
+	fwup_progress_t snap;
+	bool stop;
+
+	pthread_mutex_lock(&progress->lock);
+	for (;;) {
+		while (progress->generation == seen && !progress->stop)
+			pthread_cond_wait(&progress->cond, &progress->lock);
+		seen = progress->generation;
+		stop = progress->stop;
+		memcpy(&snap, progress, sizeof(snap));
+		pthread_mutex_unlock(&progress->lock);
+
+		draw(&scr, &snap);
+
+		pthread_mutex_lock(&progress->lock);
+		progress->drawn = seen;
+		pthread_cond_broadcast(&progress->cond);
+		if (stop)
+			break;
+	}
+	pthread_mutex_unlock(&progress->lock);
+	return NULL;
+}
+
+static const char * const phase_names[] = {
+	[FWUP_PHASE_INIT] = "init",
+	[FWUP_PHASE_UPLOAD] = "upload",
+	[FWUP_PHASE_REQUEST] = "request",
+	[FWUP_PHASE_FLASH] = "flash",
+	[FWUP_PHASE_DONE] = "done",
+};
+
+static void
+json_string(FILE *out, const char *str)
+{
+	const unsigned char *c;
+
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+	fputc('"', out);
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(out, "\\u%04x", *c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+/*
+ * Every event carries the monotonic clock and the time since this
+ * component started, in seconds.  Called with the lock held.
+ */
+static void
+event_begin(fwup_progress_t *progress, const char *event, uint64_t now)
+{
+	fprintf(progress->events, "{\"event\":\"%s\",\"t\":%.6f,\"elapsed\":%.6f,\"request\":",
+		event, now / 1e9,
+		(now - progress->phase_ns[FWUP_PHASE_INIT]) / 1e9);
+	json_string(progress->events, progress->name);
+}
+
+static void
+event_end(fwup_progress_t *progress)
+{
+	fputs("}\n", progress->events);
+	fflush(progress->events);
+}
+
+static void
+event_eta(fwup_progress_t *progress, double remaining, double rate)
+{
+	if (rate > 0)
+		fprintf(progress->events, ",\"eta_s\":%.1f", remaining / rate);
+	else
+		fputs(",\"eta_s\":null", progress->events);
+}
+
+amp_fwup_state_t
+fwup_phase_state(fwup_phase_t phase)
+{
+	switch (phase) {
+	case FWUP_PHASE_INIT:
+		return AMP_FWUP_STARTING;
+	case FWUP_PHASE_UPLOAD:
+		return AMP_FWUP_UPLOADING;
+	case FWUP_PHASE_REQUEST:
+		return AMP_FWUP_REQUESTING;
+	case FWUP_PHASE_FLASH:
+	case FWUP_PHASE_DONE:
+	default:
+		return AMP_FWUP_FLASHING;
+	}
+}
+
+/*
+ * Copy the state to the status page.  Called with the lock held, which
+ * also keeps this the only writer.
+ */
+static void
+publish(fwup_progress_t *progress, amp_fwup_state_t state, int error)
+{
+	amp_fwup_status_t status;
+
+	if (!progress->shared)
+		return;
+
+	memset(&status, '\0', sizeof(status));
+	status.state = state;
+	status.percent = progress->percent;
+	status.uploaded = progress->uploaded;
+	status.total = progress->total;
+	status.error = error;
+	if (progress->name)
+		strncpy(status.request, progress->name,
+			sizeof(status.request) - 1);
+	strncpy(status.component, progress->component,
+		sizeof(status.component) - 1);
+	fwup_shared_publish(progress->shared, &status);
+}
+
+/*
+ * Note when a phase first began, and report the change.  The event is
+ * stamped now, even when the phase began a little earlier, so that
+ * events stay in time order.  Called with the lock held.
+ */
+static bool
+enter_phase(fwup_progress_t *progress, fwup_phase_t phase, uint64_t when)
+{
+	if (!progress->phase_ns[phase])
+		progress->phase_ns[phase] = when;
+	if (progress->phase == phase)
+		return false;
+
+	progress->phase = phase;
+	if (phase != FWUP_PHASE_DONE)
+		publish(progress, fwup_phase_state(phase), 0);
+	if (progress->events) {
+		event_begin(progress, "phase", fwup_now_ns());
+		fprintf(progress->events, ",\"phase\":\"%s\"",
+			phase_names[phase]);
+		event_end(progress);
+	}
+	return true;
+}
+
+/*
+ * How long a phase lasted: until the next one that happened began, or
+ * until now.
+ */
+static double
+phase_seconds(fwup_progress_t *progress, fwup_phase_t phase)
+{
+	uint64_t start = progress->phase_ns[phase], end = 0;
+	unsigned int i;
+
+	if (!start)
+		return 0;
+	for (i = phase + 1; i <= FWUP_PHASE_DONE && !end; i++)
+		end = progress->phase_ns[i];
+	if (!end)
+		end = fwup_now_ns();
+	return (end - start) / 1e9;
+}
+
+/*
+ * Set up the shared state without a renderer, for callers that only
+ * query it or that want events.
+ */
+void
+fwup_progress_init(fwup_progress_t *progress, const char *name)
+{
+	memset(progress, '\0', sizeof(*progress));
+	pthread_mutex_init(&progress->lock, NULL);
+	pthread_cond_init(&progress->cond, NULL);
+	progress->name = name;
+	progress->phase_ns[FWUP_PHASE_INIT] = fwup_now_ns();
+}
+
+/*
+ * Publish every update to the status page from now on.
+ */
+void
+fwup_progress_publish(fwup_progress_t *progress, fwup_shared_t *shared)
+{
+	pthread_mutex_lock(&progress->lock);
+	progress->shared = shared;
+	publish(progress, fwup_phase_state(progress->phase), 0);
+	pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * Write every update to events as a JSON line, starting with an "init"
+ * event for image if there is one.  Use instead of a renderer.
+ */
+void
+fwup_progress_events(fwup_progress_t *progress, FILE *events,
+		     const char *image)
+{
+	pthread_mutex_lock(&progress->lock);
+	progress->events = events;
+	if (image) {
+		event_begin(progress, "init",
+			    progress->phase_ns[FWUP_PHASE_INIT]);
+		fputs(",\"image\":", events);
+		json_string(events, image);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+int
+fwup_progress_start(fwup_progress_t *progress, const char *name)
+{
+	int rc;
+
+	fwup_progress_init(progress, name);
+
+	rc = pthread_create(&progress->thread, NULL, render, progress);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	progress->running = true;
+	return 0;
+}
+
+/*
+ * Switch phase and wait until the renderer has caught up, so the caller
+ * can print to the same terminal without interleaving.
+ */
+void
+fwup_progress_phase(fwup_progress_t *progress, fwup_phase_t phase)
+{
+	unsigned int generation;
+
+	pthread_mutex_lock(&progress->lock);
+	enter_phase(progress, phase, fwup_now_ns());
+	generation = ++progress->generation;
+	pthread_cond_broadcast(&progress->cond);
+	while (progress->running && (int)(progress->drawn - generation) < 0)
+		pthread_cond_wait(&progress->cond, &progress->lock);
+	pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * How the chunk size was arrived at: "probed", "requested", "journal"
+ * or "reused", and how long that took.
+ */
+void
+fwup_progress_probe(fwup_progress_t *progress, const char *backend,
+		    size_t chunk_size, const char *how, uint64_t latency_ns)
+{
+	pthread_mutex_lock(&progress->lock);
+	if (progress->events) {
+		event_begin(progress, "probe", fwup_now_ns());
+		fputs(",\"backend\":", progress->events);
+		json_string(progress->events, backend);
+		fprintf(progress->events, ",\"chunk_size\":%zu,\"how\":\"%s\",\"latency_us\":%.1f",
+			chunk_size, how, latency_ns / 1e3);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * A chunk has been written; latency_ns is how long firmware took with
+ * it, which is also how long firmware held a CPU for it, and is counted
+ * as its stall.  The upload is timed from the start of its first chunk,
+ * so a resumed upload's rate only counts what this run sent.
+ */
+void
+fwup_progress_chunk(fwup_progress_t *progress, size_t offset, size_t size,
+		    uint64_t latency_ns, size_t total)
+{
+	uint64_t now = fwup_now_ns();
+	double elapsed, rate;
+
+	pthread_mutex_lock(&progress->lock);
+	if (!progress->phase_ns[FWUP_PHASE_UPLOAD])
+		progress->upload_base = offset;
+	enter_phase(progress, FWUP_PHASE_UPLOAD, now - latency_ns);
+	progress->uploaded = offset + size;
+	progress->total = total;
+	progress->stall_ns += latency_ns;
+	if (latency_ns > progress->max_stall_ns)
+		progress->max_stall_ns = latency_ns;
+	progress->generation++;
+	pthread_cond_broadcast(&progress->cond);
+	publish(progress, AMP_FWUP_UPLOADING, 0);
+
+	if (progress->events) {
+		elapsed = (now - progress->phase_ns[FWUP_PHASE_UPLOAD]) / 1e9;
+		rate = elapsed > 0 ?
+			(progress->uploaded - progress->upload_base) / elapsed : 0;
+		event_begin(progress, "chunk", now);
+		fprintf(progress->events, ",\"offset\":%zu,\"bytes\":%zu,\"latency_us\":%.1f,\"stall_us\":%.1f,\"uploaded\":%zu",
+			offset, size, latency_ns / 1e3, latency_ns / 1e3,
+			progress->uploaded);
+		if (total)
+			fprintf(progress->events, ",\"total\":%zu", total);
+		else
+			fputs(",\"total\":null", progress->events);
+		fprintf(progress->events, ",\"mb_per_s\":%.2f", rate / 1e6);
+		event_eta(progress, total > progress->uploaded ?
+				    (double)(total - progress->uploaded) : 0,
+			  total ? rate : 0);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+void
+fwup_progress_flash(fwup_progress_t *progress, const char *component,
+		    unsigned int percent)
+{
+	uint64_t now = fwup_now_ns();
+	double elapsed, rate;
+	unsigned int last;
+	bool changed;
+
+	pthread_mutex_lock(&progress->lock);
+	last = progress->percent;
+	changed = enter_phase(progress, FWUP_PHASE_FLASH, now);
+	strncpy(progress->component, component,
+		sizeof(progress->component) - 1);
+	progress->percent = percent;
+	progress->generation++;
+	pthread_cond_broadcast(&progress->cond);
+	if (changed || percent != last)
+		publish(progress, AMP_FWUP_FLASHING, 0);
+
+	if (progress->events && (changed || percent != last)) {
+		elapsed = (now - progress->phase_ns[FWUP_PHASE_FLASH]) / 1e9;
+		rate = elapsed > 0 ? percent / elapsed : 0;
+		event_begin(progress, "flash", now);
+		fputs(",\"component\":", progress->events);
+		json_string(progress->events, component);
+		fprintf(progress->events, ",\"percent\":%u,\"pct_per_s\":%.2f",
+			percent, rate);
+		event_eta(progress, 100.0 - (percent < 100 ? percent : 100), rate);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+void
+fwup_progress_message(fwup_progress_t *progress, bool warning,
+		      const char *message)
+{
+	pthread_mutex_lock(&progress->lock);
+	if (progress->events) {
+		event_begin(progress, "message", fwup_now_ns());
+		fprintf(progress->events, ",\"level\":\"%s\",\"text\":",
+			warning ? "warning" : "info");
+		json_string(progress->events, message);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * The outcome, with how long each phase took.  component and status are
+ * what firmware reported last, empty if it never got that far.
+ */
+void
+fwup_progress_result(fwup_progress_t *progress, const char *component,
+		     const char *status, int error)
+{
+	uint64_t now = fwup_now_ns();
+	double upload;
+
+	pthread_mutex_lock(&progress->lock);
+	enter_phase(progress, FWUP_PHASE_DONE, now);
+	if (!error)
+		progress->percent = 100;
+	publish(progress, !error ? AMP_FWUP_SUCCEEDED :
+			  error == ECANCELED ? AMP_FWUP_CANCELLED :
+			  AMP_FWUP_FAILED, error);
+	if (progress->events) {
+		upload = phase_seconds(progress, FWUP_PHASE_UPLOAD);
+		event_begin(progress, "result", now);
+		fputs(",\"component\":", progress->events);
+		json_string(progress->events, component[0] ? component : NULL);
+		fputs(",\"status\":", progress->events);
+		json_string(progress->events, status[0] ? status : NULL);
+		fprintf(progress->events, ",\"ok\":%s,\"errno\":%d,\"error\":",
+			error ? "false" : "true", error);
+		json_string(progress->events, error ? strerror(error) : NULL);
+		fprintf(progress->events, ",\"prepare_s\":%.3f,\"upload_s\":%.3f,\"request_s\":%.3f,\"flash_s\":%.3f,\"total_s\":%.3f,\"upload_mb_per_s\":%.2f,\"stall_s\":%.3f,\"max_stall_ms\":%.3f",
+			phase_seconds(progress, FWUP_PHASE_INIT), upload,
+			phase_seconds(progress, FWUP_PHASE_REQUEST),
+			phase_seconds(progress, FWUP_PHASE_FLASH),
+			(progress->phase_ns[FWUP_PHASE_DONE] -
+			 progress->phase_ns[FWUP_PHASE_INIT]) / 1e9,
+			upload > 0 ? (progress->uploaded - progress->upload_base) /
+				     upload / 1e6 : 0,
+			progress->stall_ns / 1e9, progress->max_stall_ns / 1e6);
+		event_end(progress);
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * One line of phase timings, for --stats.
+ */
+void
+fwup_progress_summary(fwup_progress_t *progress, FILE *out)
+{
+	double upload;
+
+	pthread_mutex_lock(&progress->lock);
+	upload = phase_seconds(progress, FWUP_PHASE_UPLOAD);
+	fprintf(out, "amp_fwupgrade: %s: prepare %.2f s, upload %.2f s (%.1f MB/s, CPU stalled %.3f s, at most %.1f ms a chunk), request %.2f s, flash %.2f s, total %.2f s\n",
+		progress->name, phase_seconds(progress, FWUP_PHASE_INIT),
+		upload, upload > 0 ? (progress->uploaded - progress->upload_base) /
+				     upload / 1e6 : 0,
+		progress->stall_ns / 1e9, progress->max_stall_ns / 1e6,
+		phase_seconds(progress, FWUP_PHASE_REQUEST),
+		phase_seconds(progress, FWUP_PHASE_FLASH),
+		((progress->phase_ns[FWUP_PHASE_DONE] ?
+		  progress->phase_ns[FWUP_PHASE_DONE] : fwup_now_ns()) -
+		 progress->phase_ns[FWUP_PHASE_INIT]) / 1e9);
+	pthread_mutex_unlock(&progress->lock);
+}
+
+void
+fwup_progress_stop(fwup_progress_t *progress)
+{
+	if (progress->running) {
+		pthread_mutex_lock(&progress->lock);
+		progress->stop = true;
+		pthread_cond_broadcast(&progress->cond);
+		pthread_mutex_unlock(&progress->lock);
+
+		pthread_join(progress->thread, NULL);
+		progress->running = false;
+	}
+	pthread_cond_destroy(&progress->cond);
+	pthread_mutex_destroy(&progress->lock);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - progress published to shared memory
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * One writer, many readers.  The writer holds an exclusive flock() on the
+ * file for as long as it publishes, so a second amp_fwupgrade doesn't
+ * scribble over the first one's state; readers take no lock at all and
+ * rely on the sequence count instead.
+ */
+#define READ_ATTEMPTS	1000
+
+static size_t
+page_size(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	return page > 0 && (size_t)page > sizeof(amp_fwup_status_t) ?
+		(size_t)page : sizeof(amp_fwup_status_t);
+}
+
+int
+fwup_shared_open(fwup_shared_t *shared, const char *path)
+{
+	char *dir;
+	void *map;
+	int fd;
+
+	shared->fd = -1;
+	shared->page = NULL;
+
+	dir = dirname(strdupa(path));
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		if (errno == EWOULDBLOCK)
+			errno = EBUSY;
+		goto err;
+	}
+	if (ftruncate(fd, page_size()) < 0)
+		goto err;
+	map = mmap(NULL, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+
+	shared->fd = fd;
+	shared->page = map;
+	/* Keep a sequence count readers may already have seen going. */
+	if (shared->page->magic != AMP_FWUP_STATUS_MAGIC ||
+	    shared->page->version != AMP_FWUP_STATUS_VERSION ||
+	    (shared->page->sequence & 1))
+		memset(shared->page, '\0', sizeof(*shared->page));
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+void
+fwup_shared_publish(fwup_shared_t *shared, const amp_fwup_status_t *status)
+{
+	amp_fwup_status_t *page = shared->page;
+	uint32_t seq;
+
+	if (!page)
+		return;
+
+	seq = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->sequence, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	page->magic = AMP_FWUP_STATUS_MAGIC;
+	page->version = AMP_FWUP_STATUS_VERSION;
+	page->pid = getpid();
+	page->state = status->state;
+	page->percent = status->percent;
+	page->uploaded = status->uploaded;
+	page->total = status->total;
+	page->error = status->error;
+	page->updated_ns = fwup_now_ns();
+	memcpy(page->request, status->request, sizeof(page->request));
+	memcpy(page->component, status->component, sizeof(page->component));
+
+	__atomic_store_n(&page->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+fwup_shared_close(fwup_shared_t *shared)
+{
+	if (shared->page)
+		munmap(shared->page, page_size());
+	if (shared->fd >= 0)
+		close(shared->fd);
+	shared->page = NULL;
+	shared->fd = -1;
+}
+
+/*
+ * Take a consistent copy of a published page.  The writer only holds
+ * the count odd for a few stores, so a reader that keeps catching it
+ * mid-write has most likely found a writer that died there.
+ */
+int
+fwup_shared_read(const char *path, amp_fwup_status_t *status)
+{
+	const amp_fwup_status_t *page;
+	uint32_t before, after;
+	struct stat sb;
+	int attempt;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)sb.st_size < sizeof(*page)) {
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	map = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	page = map;
+
+	for (attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+		before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(status, page, sizeof(*status));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+		if (before == after)
+			break;
+	}
+	munmap(map, sizeof(*page));
+
+	if (attempt == READ_ATTEMPTS) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (status->magic != AMP_FWUP_STATUS_MAGIC ||
+	    status->version != AMP_FWUP_STATUS_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
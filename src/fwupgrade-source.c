@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - image input
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * Read until len bytes or end of input.  Returns the byte count, which
+ * is short only at the end, or -1.
+ */
+static ssize_t
+read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t sz;
+
+	while (done < len) {
+		sz = read(fd, buf + done, len - done);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (sz == 0)
+			break;
+		done += sz;
+	}
+	return done;
+}
+
+static int
+stream_read(fwup_source_t *src, uint8_t *buf, size_t len, size_t *got)
+{
+	ssize_t sz;
+
+	*got = 0;
+	if (src->eof)
+		return 0;
+
+	sz = read_full(src->fd, buf, len);
+	if (sz < 0)
+		return -1;
+	src->pos += sz;
+	*got = sz;
+	if ((size_t)sz == len)
+		return 0;
+
+	src->eof = true;
+	if (src->decoder && fwup_decompress_end(src) < 0)
+		return -1;
+	if (src->size_known && src->size != src->pos) {
+		/* Shorter or longer than its header promised. */
+		errno = EBADMSG;
+		return -1;
+	}
+	src->size = src->pos;
+	src->size_known = true;
+	return 0;
+}
+
+/*
+ * Open filename, or stdin for "-".
+ */
+int
+fwup_source_open(fwup_source_t *src, const char *filename)
+{
+	uint8_t magic[FWUP_MAGIC_MAX];
+	struct stat statbuf;
+	ssize_t sz;
+
+	memset(src, '\0', sizeof(*src));
+	src->filename = filename;
+
+	if (!strcmp(filename, "-"))
+		src->fd = dup(STDIN_FILENO);
+	else
+		src->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (src->fd < 0)
+		return -1;
+
+	memset(&statbuf, '\0', sizeof (statbuf));
+	if (fstat(src->fd, &statbuf) < 0)
+		goto err;
+
+	/*
+	 * Sniff for compression.  On a stream the bytes can't be put back,
+	 * so they either prime the decoder or start the head.
+	 */
+	if (S_ISREG(statbuf.st_mode))
+		sz = pread(src->fd, magic, sizeof(magic), 0);
+	else
+		sz = read_full(src->fd, magic, sizeof(magic));
+	if (sz < 0)
+		goto err;
+	src->format = fwup_decompress_format(magic, sz);
+	if (src->format) {
+		if (fwup_decompress_start(src, S_ISREG(statbuf.st_mode) ? NULL : magic,
+					  S_ISREG(statbuf.st_mode) ? 0 : sz) < 0)
+			goto err;
+		return 0;
+	}
+
+	if (!S_ISREG(statbuf.st_mode)) {
+		src->head = malloc(sizeof(magic));
+		if (!src->head)
+			goto err;
+		memcpy(src->head, magic, sz);
+		src->head_len = src->pos = sz;
+		src->eof = (size_t)sz < sizeof(magic);
+		if (src->eof) {
+			src->size = sz;
+			src->size_known = true;
+		}
+		return 0;
+	}
+
+	if (statbuf.st_size == 0) {
+		errno = ENODATA;
+		goto err;
+	}
+
+	/*
+	 * Don't MAP_POPULATE: the upload pipeline faults each chunk in
+	 * just ahead of its write, so the first byte goes out right away.
+	 */
+	src->map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE,
+			src->fd, 0);
+	if (src->map == MAP_FAILED) {
+		src->map = NULL;
+		goto err;
+	}
+	madvise(src->map, statbuf.st_size, MADV_SEQUENTIAL);
+	posix_fadvise(src->fd, 0, statbuf.st_size, POSIX_FADV_SEQUENTIAL);
+	src->mapped = true;
+	src->size = statbuf.st_size;
+	src->size_known = true;
+	return 0;
+err:
+	close(src->fd);
+	src->fd = -1;
+	return -1;
+}
+
+/*
+ * Make the first len bytes (fewer if the image is shorter) available at
+ * *data.  These stay valid until the source is closed.
+ */
+int
+fwup_source_peek(fwup_source_t *src, size_t len, const uint8_t **data,
+		 size_t *got)
+{
+	uint8_t *head;
+	size_t sz;
+
+	if (src->mapped) {
+		*data = src->map;
+		*got = len < src->size ? len : src->size;
+		return 0;
+	}
+
+	if (len > src->head_len && src->pos > src->head_len) {
+		/* Already streamed past the head; it can't grow any more. */
+		errno = ESPIPE;
+		return -1;
+	}
+
+	if (len > src->head_len && !src->eof) {
+		head = realloc(src->head, len);
+		if (!head)
+			return -1;
+		src->head = head;
+		if (stream_read(src, src->head + src->head_len,
+				len - src->head_len, &sz) < 0)
+			return -1;
+		src->head_len += sz;
+	}
+
+	*data = src->head;
+	*got = len < src->head_len ? len : src->head_len;
+	return 0;
+}
+
+/*
+ * Get up to len bytes at offset, at the end only fewer, with *got == 0
+ * past the end.  Mapped images are returned in place; streams are copied
+ * into buf and must be read in order.
+ */
+int
+fwup_source_get(fwup_source_t *src, size_t offset, size_t len, uint8_t *buf,
+		const uint8_t **data, size_t *got)
+{
+	uint8_t discard[4096];
+	size_t done = 0;
+	size_t sz;
+
+	if (src->mapped) {
+		*got = 0;
+		*data = src->map + offset;
+		if (offset >= src->size)
+			return 0;
+		*got = src->size - offset < len ? src->size - offset : len;
+		/* Start reading the chunk after this one. */
+		if (offset + *got < src->size)
+			readahead(src->fd, offset + *got, len);
+		return 0;
+	}
+
+	if (offset < src->head_len) {
+		done = src->head_len - offset < len ? src->head_len - offset : len;
+		memcpy(buf, src->head + offset, done);
+	}
+	if (done == len || (src->eof && offset + done >= src->pos)) {
+		*data = buf;
+		*got = done;
+		return 0;
+	}
+
+	if (offset + done < src->pos) {
+		errno = ESPIPE;
+		return -1;
+	}
+	while (offset + done > src->pos && !src->eof) {
+		sz = offset + done - src->pos;
+		if (stream_read(src, discard,
+				sz < sizeof(discard) ? sz : sizeof(discard),
+				&sz) < 0)
+			return -1;
+	}
+
+	if (stream_read(src, buf + done, len - done, &sz) < 0)
+		return -1;
+	*data = buf;
+	*got = done + sz;
+	return 0;
+}
+
+/*
+ * The range has been uploaded; let the kernel have its pages back.  The
+ * upload is in order, so a page the range ends in is done with as soon
+ * as the range reaches its end, even if it started in the chunk before.
+ */
+void
+fwup_source_done(fwup_source_t *src, size_t offset, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t start, end;
+
+	if (!src->mapped)
+		return;
+
+	start = offset & ~(page - 1);
+	end = (offset + len) & ~(page - 1);
+	if (offset + len == src->size)
+		end = offset + len;
+	if (end <= start)
+		return;
+	madvise(src->map + start, end - start, MADV_DONTNEED);
+	posix_fadvise(src->fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+void
+fwup_source_close(fwup_source_t *src)
+{
+	if (src->decoder) {
+		/* Unblocks the decoder if we stopped reading early. */
+		if (src->fd >= 0)
+			shutdown(src->fd, SHUT_RDWR);
+		fwup_decompress_end(src);
+	}
+	if (src->map)
+		munmap(src->map, src->size);
+	src->map = NULL;
+	if (src->fd >= 0)
+		close(src->fd);
+	src->fd = -1;
+	free(src->head);
+	src->head = NULL;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - firmware status polling
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * Flashing takes minutes, and during most of it nothing changes.  Rather
+ * than a fixed 50 ms tick, the poller backs off while the percentage is
+ * stuck, paces itself to the observed rate once it moves, and tightens
+ * again close to the end.  The status variable is kept open with
+ * efi_variable_open(), so each check is a single read; on efivarfs an
+ * inotify watch wakes us early whenever the kernel does see the file
+ * change.
+ */
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+close_handles(fwup_status_t *st)
+{
+	if (st->wd >= 0 && st->ifd >= 0)
+		inotify_rm_watch(st->ifd, st->wd);
+	st->wd = -1;
+	efi_variable_close(st->var);
+	st->var = NULL;
+}
+
+static int
+open_handles(fwup_status_t *st)
+{
+	efi_guid_t *guid = &st->guid;
+
+	if (efi_variable_open(st->guid, st->name, 0644, &st->var) < 0) {
+		st->var = NULL;
+		return -1;
+	}
+	if (st->ifd < 0)
+		return 0;
+
+	if (!st->path &&
+	    asprintf(&st->path, "%s%s-" GUID_FORMAT, fwup_efivarfs_path(),
+		     st->name, guid->a, guid->b, guid->c, bswap_16(guid->d),
+		     guid->e[0], guid->e[1], guid->e[2], guid->e[3],
+		     guid->e[4], guid->e[5]) < 0) {
+		st->path = NULL;
+		return 0;
+	}
+
+	st->wd = inotify_add_watch(st->ifd, st->path,
+				   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+				   IN_DELETE_SELF | IN_MOVE_SELF);
+	return 0;
+}
+
+int
+fwup_status_open(fwup_status_t *st, efi_guid_t guid, const char *name)
+{
+	memset(st, '\0', sizeof(*st));
+	st->guid = guid;
+	st->name = name;
+	st->ifd = -1;
+	st->wd = -1;
+	st->wake_fd = -1;
+	st->interval = FWUP_POLL_MIN_MS;
+	st->last_percent = -1;
+	st->last_change = now_ms();
+
+	if (!strcmp(efi_variables_backend(), "efivarfs"))
+		st->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (open_handles(st) < 0)
+		close_handles(st);
+	return 0;
+}
+
+void
+fwup_status_close(fwup_status_t *st)
+{
+	close_handles(st);
+	if (st->ifd >= 0)
+		close(st->ifd);
+	st->ifd = -1;
+	free(st->path);
+	st->path = NULL;
+}
+
+/*
+ * Read the status string into st->buf and return it NUL terminated.
+ */
+int
+fwup_status_read(fwup_status_t *st, char **status)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	int rc;
+
+	if (!st->var && open_handles(st) < 0) {
+		close_handles(st);
+		return -1;
+	}
+
+	rc = efi_variable_read(st->var, &data, &data_size, &attributes);
+	if (rc < 0 || data_size == 0) {
+		/* The variable was replaced or went away; look it up again. */
+		close_handles(st);
+		if (rc == 0)
+			errno = ENODATA;
+		return -1;
+	}
+	if (data_size > sizeof(st->buf) - 1)
+		data_size = sizeof(st->buf) - 1;
+	memcpy(st->buf, data, data_size);
+	st->buf[data_size] = '\0';
+	*status = st->buf;
+	return 0;
+}
+
+/*
+ * Feed the latest flash percentage back so the next interval can adapt.
+ */
+void
+fwup_status_update(fwup_status_t *st, int percent)
+{
+	uint64_t now = now_ms();
+	unsigned int interval;
+
+	if (percent != st->last_percent) {
+		/*
+		 * Aim for about two polls per percentage step at the rate
+		 * we just observed.
+		 */
+		if (st->last_percent >= 0 && percent > st->last_percent)
+			interval = (now - st->last_change) /
+				   (percent - st->last_percent) / 2;
+		else
+			interval = FWUP_POLL_MIN_MS;
+		st->last_percent = percent;
+		st->last_change = now;
+	} else {
+		interval = st->interval * 2;
+	}
+
+	if (percent >= FWUP_POLL_TIGHTEN_PCT && interval > FWUP_POLL_NEAR_MS)
+		interval = FWUP_POLL_NEAR_MS;
+	if (interval < FWUP_POLL_MIN_MS)
+		interval = FWUP_POLL_MIN_MS;
+	if (interval > FWUP_POLL_MAX_MS)
+		interval = FWUP_POLL_MAX_MS;
+	st->interval = interval;
+}
+
+/*
+ * Sleep until the next poll is due, the status file changes or somebody
+ * pokes wake_fd.
+ */
+void
+fwup_status_wait(fwup_status_t *st)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = st->wd >= 0 ? st->ifd : -1, .events = POLLIN, },
+		{ .fd = st->wake_fd, .events = POLLIN, },
+	};
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+	int rc;
+
+	if (pfd[0].fd < 0 && pfd[1].fd < 0) {
+		usleep(st->interval * 1000);
+		return;
+	}
+
+	rc = poll(pfd, 2, st->interval);
+	if (rc > 0 && (pfd[0].revents & POLLIN)) {
+		ssize_t sz = read(st->ifd, events, sizeof(events));
+		char *p = events;
+
+		while (sz > 0 && p < events + sz) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+				close_handles(st);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+// vim:fenc=utf-8:tw=75:noet
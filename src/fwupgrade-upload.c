@@ -0,0 +1,613 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Ampere FW upgrade - chunked image upload
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "fwupgrade.h"
+
+/*
+ * The upload is split into two stages.  A producer thread checksums chunk
+ * N+1 of the image, which also faults its pages in, while the calling
+ * thread is blocked in the efivarfs write of chunk N.  Firmware services
+ * each SetVariable synchronously, so without this the CPU sits idle for
+ * the whole trap.  Chunks are handed to efi_variable_write() in place,
+ * with any header or trailer as separate iovecs, so a mapped image is
+ * never copied here; a streamed one is read into the slot's buffer.  The
+ * upload variables are opened once, on the first write, so each chunk
+ * costs its writes and nothing else.
+ * In a sparse or delta upload the producer also marks the chunks that
+ * are all fill or unchanged from the reference, and those are never
+ * written.
+ */
+struct slot {
+	uint8_t *buf;		/* streams only */
+	const uint8_t *payload;
+	size_t offset;
+	size_t size;
+	uint32_t crc;
+	int error;		/* errno from reading the image */
+	bool elided;
+	bool unchanged;
+	bool eof;
+	bool ready;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct slot slots[FWUP_PIPELINE_DEPTH];
+	bool abort;
+	fwup_upload_t *up;
+};
+
+static void *
+producer(void *arg)
+{
+	struct pipeline *pl = arg;
+	fwup_upload_t *up = pl->up;
+	size_t offset = up->start;
+	unsigned int n;
+	bool last = false;
+
+	for (n = 0; !last; n++) {
+		struct slot *s = &pl->slots[n % FWUP_PIPELINE_DEPTH];
+		const uint8_t *payload = NULL;
+		uint32_t crc = 0;
+		size_t size = 0;
+		bool elided = false, unchanged = false;
+		bool full;
+		int error = 0;
+
+		pthread_mutex_lock(&pl->lock);
+		while (s->ready && !pl->abort)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		if (pl->abort) {
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pl->lock);
+
+		if (fwup_source_get(up->src, offset, up->chunk_size, s->buf,
+				    &payload, &size) < 0)
+			error = errno;
+		else if (offset + size > UINT32_MAX)
+			error = EFBIG;
+
+		/*
+		 * Not the last one, which tells firmware the size.  In a delta
+		 * upload firmware starts from the reference, not from fill, so
+		 * a fill chunk over it is left out only if the reference has
+		 * fill there too, and that is already an unchanged one.
+		 */
+		full = !error && size == up->chunk_size &&
+		       up->src->size_known && offset + size < up->src->size;
+		if (full && up->ref && offset + size <= up->ref_size &&
+		    !memcmp(payload, up->ref + offset, size))
+			unchanged = true;
+		else if (full && up->sparse &&
+			 (!up->ref || offset >= up->ref_size) &&
+			 fwup_is_fill(payload, size, up->fill))
+			elided = true;
+		else if (!error && size)
+			crc = efi_crc32(payload, size);
+		last = error || size == 0;
+
+		pthread_mutex_lock(&pl->lock);
+		s->payload = payload;
+		s->offset = offset;
+		s->size = size;
+		s->crc = crc;
+		s->error = error;
+		s->elided = elided;
+		s->unchanged = unchanged;
+		s->eof = size == 0;
+		s->ready = true;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+
+		offset += size;
+	}
+
+	return NULL;
+}
+
+/*
+ * Whether len bytes at data are all fill.  Erased flash is most of a
+ * padded image, so this runs over a lot of it: it compares 64 bytes at a
+ * time as words, which the compiler turns into vector compares, and gives
+ * up at the first block holding anything else.
+ */
+bool
+fwup_is_fill(const uint8_t *data, size_t len, uint8_t fill)
+{
+	uint64_t pattern = 0x0101010101010101ULL * fill;
+	uint64_t acc, word;
+	size_t i = 0, j;
+
+	for (; i + 64 <= len; i += 64) {
+		acc = 0;
+		for (j = 0; j < 64; j += sizeof(word)) {
+			memcpy(&word, data + i + j, sizeof(word));
+			acc |= word ^ pattern;
+		}
+		if (acc)
+			return false;
+	}
+	for (; i < len; i++) {
+		if (data[i] != fill)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Note a chunk left out of a sparse upload, merging it with the range
+ * before when they touch.
+ */
+static int
+add_elided(fwup_upload_t *up, size_t offset, size_t size)
+{
+	fwup_elided_range_t *last, *elided;
+
+	up->elided_bytes += size;
+	if (up->nelided) {
+		last = &up->elided[up->nelided - 1];
+		if (le32_to_cpu(last->offset) + le32_to_cpu(last->length) == offset) {
+			last->length = cpu_to_le32(le32_to_cpu(last->length) + size);
+			return 0;
+		}
+	}
+	elided = realloc(up->elided, (up->nelided + 1) * sizeof(*elided));
+	if (!elided)
+		return -1;
+	up->elided = elided;
+	up->elided[up->nelided].offset = cpu_to_le32(offset);
+	up->elided[up->nelided].length = cpu_to_le32(size);
+	up->nelided++;
+	return 0;
+}
+
+/*
+ * Sleep before the next attempt and return true if there is one left.
+ *
+ * EAGAIN, EBUSY, EINTR and EIO are what the kernel hands back for a
+ * firmware that is momentarily busy or failed the flash write.  With a
+ * CRC trailer, a refused chunk comes back as EINVAL (EFI_CRC_ERROR has
+ * no errno of its own), so that becomes retryable too.
+ */
+bool
+fwup_retry(unsigned int *attempt, int error, bool crc_checked)
+{
+	unsigned long delay;
+
+	switch (error) {
+	case EAGAIN:
+	case EBUSY:
+	case EINTR:
+	case EIO:
+		break;
+	case EINVAL:
+		if (crc_checked)
+			break;
+		/* fall through */
+	default:
+		return false;
+	}
+
+	if (*attempt >= FWUP_RETRY_ATTEMPTS)
+		return false;
+
+	delay = (unsigned long)FWUP_RETRY_BASE_US << *attempt;
+	if (delay > FWUP_RETRY_MAX_US)
+		delay = FWUP_RETRY_MAX_US;
+	*attempt += 1;
+	usleep(delay);
+	return true;
+}
+
+static int
+write_var(fwup_upload_t *up, efi_variable_handle_t **var, const char *name,
+	  const struct iovec *iov, int iovcnt)
+{
+	if (!*var && efi_variable_open(up->guid, name, 0644, var) < 0)
+		return -1;
+	return efi_variable_write(*var, iov, iovcnt, FWUP_ATTRS);
+}
+
+static int
+write_chunk(fwup_upload_t *up, size_t offset, const uint8_t *payload,
+	    size_t size, uint32_t crc)
+{
+	fwup_record_header_t hdr;
+	uint32_t offset32 = offset;
+	uint32_t trailer = cpu_to_le32(crc);
+	struct iovec iov[2];
+	int rc;
+
+	if (up->record) {
+		hdr.magic = cpu_to_le32(FWUP_RECORD_MAGIC);
+		hdr.offset = cpu_to_le32(offset);
+		hdr.length = cpu_to_le32(size);
+		hdr.sequence = cpu_to_le32(up->sequence);
+		hdr.crc = cpu_to_le32(crc);
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *)payload;
+		iov[1].iov_len = size;
+		return write_var(up, &up->record_var, FWUP_UPLOAD_RECORD,
+				 iov, 2);
+	}
+
+	iov[0].iov_base = &offset32;
+	iov[0].iov_len = sizeof(offset32);
+	rc = write_var(up, &up->offset_var, FWUP_SET_UPLOAD_OFFSET, iov, 1);
+	if (rc < 0)
+		return rc;
+
+	iov[0].iov_base = (void *)payload;
+	iov[0].iov_len = size;
+	iov[1].iov_base = &trailer;
+	iov[1].iov_len = sizeof(trailer);
+	return write_var(up, &up->data_var, FWUP_CONTINUE_UPLOAD, iov,
+			 up->chunk_crc ? 2 : 1);
+}
+
+/*
+ * Write one chunk, retrying just this chunk on transient errors.  The
+ * offset is written again on every attempt, since firmware may have
+ * advanced or reset it when it refused the data.  While probing, EINVAL
+ * means "too big" rather than a CRC mismatch.
+ */
+static int
+send_chunk(fwup_upload_t *up, size_t offset, const uint8_t *payload,
+	   size_t size, uint32_t crc, bool probing)
+{
+	unsigned int attempt = 0;
+	int rc;
+
+	for (;;) {
+		rc = write_chunk(up, offset, payload, size, crc);
+		if (rc == 0) {
+			up->sequence++;
+			return 0;
+		}
+		if (!fwup_retry(&attempt, errno, up->chunk_crc && !probing))
+			return rc;
+		up->retries++;
+		if (efi_get_verbose())
+			fwup_warn("chunk 0x%08zx failed (%m), retry %u",
+				  offset, attempt);
+	}
+}
+
+/*
+ * Largest chunk the kernel interface can carry, before asking firmware.
+ */
+static size_t
+backend_limit(void)
+{
+	const char *backend = efi_variables_backend();
+	struct statfs buf;
+	size_t limit = FWUP_CHUNK_SIZE_MAX;
+
+	if (!strcmp(backend, "vars"))
+		return FWUP_VARS_XFER_SIZE;
+	if (strcmp(backend, "efivarfs"))
+		return limit;
+
+	/*
+	 * efivarfs reports the remaining variable store through statfs().
+	 * UpgradeContinueUpload is replaced on every chunk, so leave room
+	 * for the old and the new copy to coexist.
+	 */
+	memset(&buf, '\0', sizeof(buf));
+	if (statfs(fwup_efivarfs_path(), &buf) == 0 && buf.f_blocks != 0 &&
+	    (size_t)buf.f_bavail * buf.f_bsize / 2 < limit)
+		limit = (size_t)buf.f_bavail * buf.f_bsize / 2;
+
+	return limit;
+}
+
+/*
+ * Pick the largest chunk size the backend and firmware will accept.
+ *
+ * The probe is a real write of the first chunk, so when it succeeds the
+ * upload continues from there rather than sending it again.  Firmware
+ * refusing a variable that big shows up as ENOSPC (EFI_OUT_OF_RESOURCES)
+ * or EINVAL (EFI_INVALID_PARAMETER); anything else is a genuine error.
+ */
+int
+fwup_negotiate_chunk_size(fwup_upload_t *up, size_t requested)
+{
+	size_t limit = backend_limit();
+	const uint8_t *head;
+	size_t size, xfer, got;
+	uint64_t start, latency = 0;
+	int rc;
+
+	if (requested) {
+		up->chunk_size = requested;
+		fwup_info("Transfer size %zu bytes (requested)",
+			  up->chunk_size);
+		return 0;
+	}
+
+	for (size = FWUP_CHUNK_SIZE_MAX; size > limit; size /= 2)
+		;
+	if (size < FWUP_CHUNK_SIZE_MIN)
+		size = FWUP_CHUNK_SIZE_MIN;
+
+	/* Small images go out in a single write of the request variable. */
+	xfer = size < FWUP_MAX_XFER_SIZE ? size : FWUP_MAX_XFER_SIZE;
+	if (fwup_source_peek(up->src, xfer + 1, &head, &got) < 0) {
+		fwup_warn("reading %s: %m", up->src->filename);
+		return -1;
+	}
+	if (got <= xfer) {
+		up->chunk_size = size;
+		return 0;
+	}
+
+	up->start = 0;
+	for (;;) {
+		if (fwup_source_peek(up->src, size, &head, &xfer) < 0) {
+			fwup_warn("reading %s: %m", up->src->filename);
+			return -1;
+		}
+
+		start = fwup_now_ns();
+		rc = send_chunk(up, 0, head, xfer, efi_crc32(head, xfer), true);
+		latency = fwup_now_ns() - start;
+		if (up->pacer)
+			fwup_pacer_chunk(up->pacer, rc == 0 ? xfer : 0,
+					 latency, up->cancel);
+		if (rc == 0) {
+			up->start = xfer;
+			break;
+		}
+		if ((errno != ENOSPC && errno != EINVAL) ||
+		    size / 2 < FWUP_CHUNK_SIZE_MIN) {
+			fwup_warn("writing the first chunk: %m");
+			return -1;
+		}
+		if (efi_get_verbose())
+			fwup_warn("%zu byte chunk refused (%m), backing off",
+				  size);
+		size /= 2;
+	}
+
+	up->chunk_size = size;
+	fwup_info("Transfer size %zu bytes (%s)", up->chunk_size,
+		  efi_variables_backend());
+	fwup_journal_ack(up->journal, up->chunk_size, up->start);
+	if (up->progress)
+		fwup_progress_chunk(up->progress, 0, up->start, latency,
+				    up->src->size_known ? up->src->size : 0);
+	return 0;
+}
+
+/*
+ * Firmware keeps the last UpgradeSetUploadOffset we wrote; the chunk at
+ * that offset may not have landed, but everything below it has.
+ */
+int
+fwup_firmware_offset(efi_guid_t guid, size_t *offset)
+{
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	uint32_t offset32;
+	int rc;
+
+	rc = efi_get_variable_into(guid, FWUP_SET_UPLOAD_OFFSET,
+				   (uint8_t *)&offset32, sizeof(offset32),
+				   &data_size, &attributes);
+	if (rc < 0 && errno == ERANGE)
+		errno = EINVAL;
+	if (rc < 0)
+		return rc;
+	if (data_size != sizeof(offset32)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*offset = offset32;
+	return 0;
+}
+
+/*
+ * Optional protocol features are advertised by firmware as a bitmask in
+ * UpgradeCapabilities.  Firmware that predates it has none of them.
+ */
+int
+fwup_firmware_caps(efi_guid_t guid, uint32_t *caps)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	uint32_t caps32 = 0;
+	int rc;
+
+	*caps = 0;
+	rc = efi_get_variable(guid, FWUP_CAPABILITIES, &data, &data_size,
+			      &attributes);
+	if (rc < 0)
+		return errno == ENOENT ? 0 : rc;
+	memcpy(&caps32, data, data_size < sizeof(caps32) ? data_size : sizeof(caps32));
+	free(data);
+	*caps = le32_to_cpu(caps32);
+	return 0;
+}
+
+/*
+ * What firmware says its staging buffer holds, for a delta upload.
+ */
+int
+fwup_firmware_staging(efi_guid_t guid, fwup_staging_t *staging)
+{
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	int rc;
+
+	rc = efi_get_variable_into(guid, FWUP_STAGING_DIGEST,
+				   (uint8_t *)staging, sizeof(*staging),
+				   &data_size, &attributes);
+	if (rc < 0 && errno == ERANGE)
+		errno = EINVAL;
+	if (rc < 0)
+		return rc;
+	if (data_size != sizeof(*staging)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+fwup_upload_chunks(fwup_upload_t *up)
+{
+	struct pipeline pl;
+	pthread_t thread;
+	size_t up_loaded = up->start;
+	uint64_t start, latency;
+	unsigned int n;
+	int saved_errno;
+	int ret = -1;
+	int rc;
+	int i;
+
+	if (up->chunk_size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&pl, '\0', sizeof(pl));
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.cond, NULL);
+	pl.up = up;
+
+	for (i = 0; i < FWUP_PIPELINE_DEPTH && !up->src->mapped; i++) {
+		pl.slots[i].buf = malloc(up->chunk_size);
+		if (!pl.slots[i].buf)
+			goto err_free;
+	}
+
+	rc = pthread_create(&thread, NULL, producer, &pl);
+	if (rc != 0) {
+		errno = rc;
+		goto err_free;
+	}
+
+	for (n = 0; ; n++) {
+		struct slot *s = &pl.slots[n % FWUP_PIPELINE_DEPTH];
+		size_t offset, size;
+		bool unchanged, elided;
+
+		pthread_mutex_lock(&pl.lock);
+		while (!s->ready)
+			pthread_cond_wait(&pl.cond, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+
+		if (s->error) {
+			errno = s->error;
+			fwup_warn("reading %s: %m", up->src->filename);
+			goto err_join;
+		}
+		if (s->eof)
+			break;
+
+		if (up->cancel && *up->cancel) {
+			errno = ECANCELED;
+			goto err_join;
+		}
+
+		/* The producer refills the slot as soon as it is released. */
+		offset = s->offset;
+		size = s->size;
+		unchanged = s->unchanged;
+		elided = s->elided;
+
+		start = fwup_now_ns();
+		if (unchanged) {
+			up->unchanged_bytes += size;
+			rc = 0;
+		} else if (elided)
+			rc = add_elided(up, offset, size);
+		else
+			rc = send_chunk(up, offset, s->payload, size, s->crc,
+					false);
+		latency = fwup_now_ns() - start;
+		if (rc < 0) {
+			fwup_warn("writing chunk 0x%08zx: %m", offset);
+			goto err_join;
+		}
+		if (efi_get_verbose() > 1)
+			fwup_warn("chunk 0x%08zx+0x%zx %s 0x%08x, stalled %.1f ms",
+				  offset, size,
+				  unchanged ? "unchanged, crc32" :
+				  elided ? "elided, fill" : "crc32",
+				  elided ? up->fill : s->crc, latency / 1e6);
+
+		fwup_source_done(up->src, offset, size);
+		up_loaded += size;
+		if (fwup_journal_ack(up->journal, up->chunk_size, up_loaded) < 0 &&
+		    efi_get_verbose())
+			fwup_warn("could not update journal: %m");
+
+		pthread_mutex_lock(&pl.lock);
+		s->ready = false;
+		pthread_cond_broadcast(&pl.cond);
+		pthread_mutex_unlock(&pl.lock);
+
+		if (up->progress)
+			fwup_progress_chunk(up->progress, offset, size, latency,
+					    up->src->size_known ?
+						up->src->size : 0);
+
+		/* Skipped chunks cost firmware nothing to pace for. */
+		if (up->pacer && !unchanged && !elided)
+			fwup_pacer_chunk(up->pacer, size, latency, up->cancel);
+	}
+
+	ret = 0;
+err_join:
+	saved_errno = errno;
+	pthread_mutex_lock(&pl.lock);
+	pl.abort = true;
+	pthread_cond_broadcast(&pl.cond);
+	pthread_mutex_unlock(&pl.lock);
+	pthread_join(thread, NULL);
+	errno = saved_errno;
+err_free:
+	saved_errno = errno;
+	for (i = 0; i < FWUP_PIPELINE_DEPTH; i++)
+		free(pl.slots[i].buf);
+	pthread_cond_destroy(&pl.cond);
+	pthread_mutex_destroy(&pl.lock);
+	errno = saved_errno;
+	return ret;
+}
+
+/*
+ * Close the upload variables; the request variable is written by name.
+ */
+void
+fwup_upload_close(fwup_upload_t *up)
+{
+	efi_variable_close(up->offset_var);
+	efi_variable_close(up->data_var);
+	efi_variable_close(up->record_var);
+	up->offset_var = up->data_var = up->record_var = NULL;
+}
+
+// vim:fenc=utf-8:tw=75:noet
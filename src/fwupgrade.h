@@ -0,0 +1,545 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * fwupgrade.h - interfaces shared between the amp_fwupgrade stages
+ * Copyright 2021 Ampere Computing LLC.
+ */
+
+#ifndef AMP_FWUPGRADE_H
+#define AMP_FWUPGRADE_H 1
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "efivar.h"
+#include <efivar/amp_fwupgrade.h>
+
+#define FWUP_GUID_STR		"38b9ed29-d7c6-4bf4-9678-9da058bd2e99"
+#define FWUP_SET_UPLOAD_OFFSET	"UpgradeSetUploadOffset"
+#define FWUP_CONTINUE_UPLOAD	"UpgradeContinueUpload"
+#define FWUP_UPLOAD_RECORD	"UpgradeUploadRecord"
+#define FWUP_CAPABILITIES	"UpgradeCapabilities"
+#define FWUP_FIRMWARE_VERSIONS	"UpgradeFirmwareVersions"
+#define FWUP_ELIDED_RANGES	"UpgradeElidedRanges"
+#define FWUP_STAGING_DIGEST	"UpgradeStagingDigest"
+#define FWUP_DELTA_BASE		"UpgradeDeltaBase"
+
+/*
+ * Bits in UpgradeCapabilities.
+ */
+#define FWUP_CAP_RECORD		0x00000001	/* UpgradeUploadRecord */
+#define FWUP_CAP_SPARSE		0x00000002	/* staging starts out filled */
+#define FWUP_CAP_ELIDED_MAP	0x00000004	/* UpgradeElidedRanges */
+#define FWUP_CAP_FILL_BYTE	0x00000008	/* fill byte in bits 8-15 */
+#define FWUP_CAP_DELTA		0x00000010	/* UpgradeDeltaBase */
+
+#define FWUP_CAP_FILL(caps)	(((caps) & FWUP_CAP_FILL_BYTE) ?	\
+				 ((caps) >> 8) & 0xff : 0xff)
+
+#define FWUP_ATTRS	(EFI_VARIABLE_NON_VOLATILE |		\
+			 EFI_VARIABLE_RUNTIME_ACCESS |		\
+			 EFI_VARIABLE_BOOTSERVICE_ACCESS)
+
+#define FWUP_MAX_XFER_SIZE	(1024 * 1024)
+
+/*
+ * Messages from the upgrade stages.  The tool prints them, info to
+ * stdout and warnings to stderr; a library session hands the ones from
+ * its own thread to the caller instead.
+ */
+typedef void (*fwup_message_fn)(bool warning, const char *message,
+				void *data);
+
+extern void fwup_set_message_sink(fwup_message_fn fn, void *data);
+extern void fwup_info(const char *fmt, ...)
+	__attribute__((__format__ (printf, 1, 2)));
+extern void fwup_warn(const char *fmt, ...)
+	__attribute__((__format__ (printf, 1, 2)));
+
+static inline const char *
+fwup_efivarfs_path(void)
+{
+	const char *path = secure_getenv("EFIVARFS_PATH");
+
+	return path ? path : "/sys/firmware/efi/efivars/";
+}
+
+static inline uint64_t
+fwup_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Bounds for chunk size negotiation.  The legacy sysfs "vars" interface
+ * can't take more than 1024 bytes of data per variable.
+ */
+#define FWUP_CHUNK_SIZE_MIN	1024
+#define FWUP_CHUNK_SIZE_MAX	(8 * 1024 * 1024)
+#define FWUP_VARS_XFER_SIZE	1024
+
+/*
+ * Number of staging buffers the upload pipeline cycles through.  Two is
+ * enough to keep the producer one chunk ahead of the efivarfs write.
+ */
+#define FWUP_PIPELINE_DEPTH	2
+
+/*
+ * The published status page, see amp_fwupgrade.h.
+ */
+typedef struct {
+	int fd;
+	amp_fwup_status_t *page;
+} fwup_shared_t;
+
+extern int fwup_shared_open(fwup_shared_t *shared, const char *path);
+extern void fwup_shared_publish(fwup_shared_t *shared,
+				const amp_fwup_status_t *status);
+extern void fwup_shared_close(fwup_shared_t *shared);
+extern int fwup_shared_read(const char *path, amp_fwup_status_t *status);
+
+/*
+ * Progress state, shared between the uploader, the status poller and the
+ * renderer thread.  Writers update it with fwup_progress_*() and the
+ * renderer redraws whenever it changes.  With events set there is no
+ * renderer; every update is written out as a JSON line as it happens
+ * instead, so none are coalesced.  With shared set, every update is
+ * also published to the status page.
+ */
+typedef enum {
+	FWUP_PHASE_INIT = 0,
+	FWUP_PHASE_UPLOAD,
+	FWUP_PHASE_REQUEST,
+	FWUP_PHASE_FLASH,
+	FWUP_PHASE_DONE,
+} fwup_phase_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	unsigned int generation;
+	unsigned int drawn;
+
+	fwup_phase_t phase;
+	const char *name;
+	char component[64];
+	size_t total;
+	size_t uploaded;
+	unsigned int percent;
+
+	FILE *events;			/* JSON lines, or NULL */
+	fwup_shared_t *shared;		/* status page, or NULL */
+	uint64_t phase_ns[FWUP_PHASE_DONE + 1];	/* when each phase began */
+	size_t upload_base;		/* already uploaded when it began */
+	uint64_t stall_ns;		/* time spent in chunk writes */
+	uint64_t max_stall_ns;
+} fwup_progress_t;
+
+extern void fwup_progress_init(fwup_progress_t *progress, const char *name);
+extern int fwup_progress_start(fwup_progress_t *progress, const char *name);
+extern void fwup_progress_phase(fwup_progress_t *progress, fwup_phase_t phase);
+extern void fwup_progress_flash(fwup_progress_t *progress,
+				const char *component, unsigned int percent);
+extern void fwup_progress_stop(fwup_progress_t *progress);
+
+extern amp_fwup_state_t fwup_phase_state(fwup_phase_t phase);
+extern void fwup_progress_publish(fwup_progress_t *progress,
+				  fwup_shared_t *shared);
+extern void fwup_progress_events(fwup_progress_t *progress, FILE *events,
+				 const char *image);
+extern void fwup_progress_probe(fwup_progress_t *progress,
+				const char *backend, size_t chunk_size,
+				const char *how, uint64_t latency_ns);
+extern void fwup_progress_chunk(fwup_progress_t *progress, size_t offset,
+				size_t size, uint64_t latency_ns, size_t total);
+extern void fwup_progress_message(fwup_progress_t *progress, bool warning,
+				  const char *message);
+extern void fwup_progress_result(fwup_progress_t *progress,
+				 const char *component, const char *status,
+				 int error);
+extern void fwup_progress_summary(fwup_progress_t *progress, FILE *out);
+
+/*
+ * Retry policy for transient firmware errors: bounded exponential
+ * backoff, starting at FWUP_RETRY_BASE_US and doubling up to
+ * FWUP_RETRY_MAX_US, for at most FWUP_RETRY_ATTEMPTS retries.
+ */
+#define FWUP_RETRY_ATTEMPTS	6
+#define FWUP_RETRY_BASE_US	10000
+#define FWUP_RETRY_MAX_US	1000000
+
+extern bool fwup_retry(unsigned int *attempt, int error, bool crc_checked);
+
+/*
+ * Status polling.  Intervals are in milliseconds; once the flash gets
+ * to FWUP_POLL_TIGHTEN_PCT we never wait longer than FWUP_POLL_NEAR_MS.
+ */
+#define FWUP_POLL_MIN_MS	50
+#define FWUP_POLL_MAX_MS	2000
+#define FWUP_POLL_NEAR_MS	200
+#define FWUP_POLL_TIGHTEN_PCT	95
+#define FWUP_STATUS_MAX		256
+
+typedef struct {
+	efi_guid_t guid;
+	const char *name;
+	char *path;
+	efi_variable_handle_t *var;
+	int ifd;
+	int wd;
+	int wake_fd;		/* readable to cut a wait short, or -1 */
+	unsigned int interval;
+	int last_percent;
+	uint64_t last_change;
+	char buf[FWUP_STATUS_MAX];
+} fwup_status_t;
+
+extern int fwup_status_open(fwup_status_t *st, efi_guid_t guid,
+			    const char *name);
+extern int fwup_status_read(fwup_status_t *st, char **status);
+extern void fwup_status_update(fwup_status_t *st, int percent);
+extern void fwup_status_wait(fwup_status_t *st);
+extern void fwup_status_close(fwup_status_t *st);
+
+/*
+ * Image helpers.
+ */
+#define FWUP_DIGEST_SEGMENT	(1024 * 1024)
+#define FWUP_DIGEST_THREADS	8
+
+extern int fwup_image_digest(const uint8_t *data, size_t data_size,
+			     uint32_t *digest);
+
+/*
+ * Header at the front of a signed image.  All fields are little endian;
+ * image_size covers the header, payload and signature, and header_crc is
+ * the EFI CRC32 of the header with header_crc itself zeroed.
+ */
+#define FWUP_IMAGE_MAGIC	0x49574641	/* "AFWI" */
+
+#define FWUP_IMAGE_ATFUEFI	1
+#define FWUP_IMAGE_UEFI		2
+#define FWUP_IMAGE_UEFICFG	3
+#define FWUP_IMAGE_SCP		4
+#define FWUP_IMAGE_SINGLE	5
+
+typedef struct {
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t image_type;
+	uint32_t flags;
+	uint64_t image_size;
+	uint32_t signature_size;
+	uint32_t header_crc;
+} PACKED fwup_image_header_t;
+
+/*
+ * With FWUP_IMAGE_VERSIONED in flags, a version record follows the
+ * header, within header_size: the NUL padded ASCII version and its EFI
+ * CRC32.  Firmware lists the versions it runs in UpgradeFirmwareVersions,
+ * one "<component>,<version>" line per component, named as in the
+ * status variable.
+ */
+#define FWUP_IMAGE_VERSIONED	0x00000001
+#define FWUP_VERSION_MAX	32
+
+typedef struct {
+	char version[FWUP_VERSION_MAX];
+	uint32_t version_crc;
+} PACKED fwup_image_version_t;
+
+typedef struct {
+	bool has_header;
+	uint32_t image_type;
+	bool has_digest;
+	uint32_t digest;
+	bool has_version;
+	char version[FWUP_VERSION_MAX + 1];
+} fwup_image_info_t;
+
+/*
+ * Image input.  Regular files are mapped and handed out in place, with
+ * readahead in front of the upload and pages dropped behind it.  Pipes
+ * and stdin are read into the caller's chunk buffers; only the head of
+ * the image, which the probe and the final request write need again, is
+ * kept, so memory stays at a few chunks whatever the image size.
+ * Compressed images are streams fed by a decoder thread.
+ */
+typedef struct {
+	int fd;
+	const char *filename;
+	bool mapped;
+	uint8_t *map;
+	size_t size;		/* only valid once size_known */
+	bool size_known;
+
+	uint8_t *head;		/* streams: first head_len bytes */
+	size_t head_len;
+	size_t pos;		/* streams: bytes read from fd so far */
+	bool eof;
+
+	const char *format;	/* compression, or NULL */
+	void *decoder;
+} fwup_source_t;
+
+extern int fwup_source_open(fwup_source_t *src, const char *filename);
+extern int fwup_source_peek(fwup_source_t *src, size_t len,
+			    const uint8_t **data, size_t *got);
+extern int fwup_source_get(fwup_source_t *src, size_t offset, size_t len,
+			   uint8_t *buf, const uint8_t **data, size_t *got);
+extern void fwup_source_done(fwup_source_t *src, size_t offset, size_t len);
+extern void fwup_source_close(fwup_source_t *src);
+
+/*
+ * Decompression of zstd and xz images, by magic number.
+ */
+#define FWUP_MAGIC_MAX		6
+
+extern const char *fwup_decompress_format(const uint8_t *magic, size_t len);
+extern int fwup_decompress_start(fwup_source_t *src, const uint8_t *prefix,
+				 size_t prefix_len);
+extern int fwup_decompress_end(fwup_source_t *src);
+
+extern int fwup_image_preflight(fwup_source_t *src, const char *name,
+				bool force, fwup_image_info_t *info);
+extern bool fwup_request_known(const char *name);
+extern const char *fwup_request_component(const char *name);
+extern int fwup_running_version(const char *component, char *version,
+				size_t size);
+
+/*
+ * Upload journal, so an interrupted upload can resume where it stopped.
+ */
+#define FWUP_JOURNAL_DIR	"/var/lib/amp_fwupgrade"
+
+typedef struct {
+	int fd;
+	char *path;
+	char name[64];
+	uint32_t digest;
+	size_t image_size;
+	size_t chunk_size;
+	size_t acked;
+} fwup_journal_t;
+
+extern int fwup_journal_open(fwup_journal_t *journal, const char *path,
+			     const char *name, uint32_t digest,
+			     size_t image_size, size_t *resume,
+			     size_t *chunk_size);
+extern int fwup_journal_ack(fwup_journal_t *journal, size_t chunk_size,
+			    size_t acked);
+extern void fwup_journal_close(fwup_journal_t *journal, bool complete);
+
+/*
+ * Chunked upload through UpgradeSetUploadOffset / UpgradeContinueUpload.
+ *
+ * With chunk_crc set, every UpgradeContinueUpload payload carries a
+ * trailing little-endian EFI CRC32 of the chunk, which firmware checks
+ * and refuses on mismatch so that just that chunk gets sent again.
+ */
+#define FWUP_CRC_TRAILER_SIZE	sizeof(uint32_t)
+
+/*
+ * Single-record protocol: offset, length, sequence number and payload
+ * CRC travel in front of the payload in one UpgradeUploadRecord write,
+ * replacing the UpgradeSetUploadOffset + UpgradeContinueUpload pair.
+ * Only used when firmware advertises FWUP_CAP_RECORD.
+ */
+#define FWUP_RECORD_MAGIC	0x52574641	/* "AFWR" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t sequence;
+	uint32_t crc;
+} PACKED fwup_record_header_t;
+
+/*
+ * Sparse upload: when firmware starts every upload from a staging buffer
+ * already filled with its fill byte (FWUP_CAP_SPARSE), chunks made of
+ * nothing else needn't be sent.  The last chunk always is, so firmware
+ * learns the image size.  Firmware with FWUP_CAP_ELIDED_MAP is then told
+ * which ranges were left out, as an array of these in
+ * UpgradeElidedRanges, written before the request.
+ */
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+} PACKED fwup_elided_range_t;
+
+/*
+ * Pacing, for nodes still running customer work.  A SetVariable() write
+ * holds a CPU in firmware until it is done, so a paced upload writes at
+ * idle CPU and I/O priority, optionally from one housekeeping CPU, and
+ * sleeps between chunks to stay under rate bytes a second and to spend
+ * at most duty percent of the time writing.  Since Linux 4.20 the kernel
+ * makes the firmware call from its efi_rts_wq worker while the writer
+ * sleeps, so cpu places the writer but not the call, and the writer's
+ * own CPU time says nothing about it.  A chunk's stall is therefore the
+ * wall-clock time its write took; it is measured whether or not the
+ * upload is paced.
+ */
+typedef struct {
+	uint64_t rate;			/* bytes a second, 0 for no limit */
+	unsigned int duty;		/* percent, 0 for no limit */
+	int cpu;			/* -1 for any */
+} fwup_pace_t;
+
+typedef struct {
+	const fwup_pace_t *pace;
+	uint64_t start_ns;
+	uint64_t sent;
+	uint64_t stall_ns;
+	uint64_t max_stall_ns;
+	uint64_t slept_ns;
+	unsigned long chunks;
+
+	/* The thread as it was, for fwup_pacer_end(). */
+	bool have_affinity;
+	cpu_set_t affinity;
+	bool have_sched;
+	int policy;
+	struct sched_param param;
+	int ioprio;
+} fwup_pacer_t;
+
+extern void fwup_pacer_begin(fwup_pacer_t *pacer, const fwup_pace_t *pace);
+extern void fwup_pacer_chunk(fwup_pacer_t *pacer, size_t size,
+			     uint64_t busy_ns, volatile bool *cancel);
+extern void fwup_pacer_end(fwup_pacer_t *pacer);
+
+typedef struct {
+	efi_guid_t guid;
+	const char *name;
+	fwup_source_t *src;
+	size_t chunk_size;
+	size_t start;
+	bool chunk_crc;
+	bool record;
+	bool sparse;
+	uint8_t fill;
+	const uint8_t *ref;		/* delta reference, or NULL */
+	size_t ref_size;
+	fwup_pacer_t *pacer;		/* NULL for full speed */
+	fwup_progress_t *progress;
+	fwup_journal_t *journal;
+	volatile bool *cancel;
+
+	uint32_t sequence;
+	unsigned int retries;
+	fwup_elided_range_t *elided;
+	size_t nelided;
+	size_t elided_bytes;
+	size_t unchanged_bytes;
+	efi_variable_handle_t *offset_var;	/* opened by the first write */
+	efi_variable_handle_t *data_var;
+	efi_variable_handle_t *record_var;
+} fwup_upload_t;
+
+/*
+ * Delta upload: firmware with FWUP_CAP_DELTA reports what its staging
+ * buffer holds in UpgradeStagingDigest.  When that is the image we last
+ * uploaded, writing UpgradeDeltaBase has firmware start the next upload
+ * from it, and chunks the same as in that image at the same offset
+ * needn't be sent.  As in a sparse upload, the last chunk always is.
+ */
+typedef struct {
+	uint32_t digest;	/* fwup_image_digest() of the contents */
+	uint32_t reserved;
+	uint64_t size;
+} PACKED fwup_staging_t;
+
+typedef struct {
+	uint32_t digest;	/* the staging contents to start from */
+	uint32_t reserved;
+	uint64_t base_size;
+	uint64_t image_size;	/* the image about to be uploaded */
+} PACKED fwup_delta_base_t;
+
+#define FWUP_CACHE_DIR		FWUP_JOURNAL_DIR "/cache"
+
+typedef struct {
+	uint8_t *map;
+	size_t size;
+	uint32_t digest;
+} fwup_delta_t;
+
+extern int fwup_delta_open(fwup_delta_t *delta, const char *dir,
+			   const char *request);
+extern void fwup_delta_close(fwup_delta_t *delta);
+extern int fwup_delta_remember(const char *dir, const char *request,
+			       const fwup_source_t *src, uint32_t digest);
+
+extern bool fwup_is_fill(const uint8_t *data, size_t len, uint8_t fill);
+extern int fwup_firmware_staging(efi_guid_t guid, fwup_staging_t *staging);
+extern int fwup_firmware_caps(efi_guid_t guid, uint32_t *caps);
+extern int fwup_firmware_offset(efi_guid_t guid, size_t *offset);
+extern int fwup_negotiate_chunk_size(fwup_upload_t *up, size_t requested);
+extern int fwup_upload_chunks(fwup_upload_t *up);
+extern void fwup_upload_close(fwup_upload_t *up);
+
+/*
+ * One component's upgrade: check the image, upload it, hand the request
+ * to firmware and follow the flash through the status variable.  Shared
+ * by the tool and libamp_fwupgrade; errors come back as -1 and errno,
+ * never as an exit.  Setting cancel (and poking wake_fd) stops it at the
+ * next chunk or status poll with ECANCELED.
+ */
+typedef struct {
+	const char *name;		/* request variable */
+	const char *filename;		/* image, or "-" for stdin */
+	size_t chunk_size;		/* 0 to negotiate */
+	size_t negotiated;		/* reused when set; the size used */
+	bool chunk_crc;
+	bool single_record;
+	bool resume;
+	bool sparse;
+	bool delta;
+	bool force;			/* flash even if already current */
+	const char *journal_path;	/* NULL for the default */
+	const char *cache_dir;		/* delta references; NULL for the default */
+	const fwup_pace_t *pace;	/* NULL for full speed */
+	fwup_progress_t *progress;
+	volatile bool cancel;
+	int wake_fd;
+
+	fwup_source_t src;
+	bool src_open;
+	fwup_image_info_t info;
+	bool current;			/* skipped, firmware runs it already */
+	char component[64];		/* from the final status */
+	char result[FWUP_STATUS_MAX];
+} fwup_upgrade_t;
+
+extern int fwup_upgrade_open(fwup_upgrade_t *upg);
+extern int fwup_upgrade_send(fwup_upgrade_t *upg);
+extern int fwup_upgrade_poll(fwup_upgrade_t *upg);
+extern void fwup_upgrade_close(fwup_upgrade_t *upg);
+
+/*
+ * Daemon mode: one process owns the upgrade variables and runs the
+ * upgrades other amp_fwupgrade invocations hand it over a Unix socket.
+ */
+#define FWUP_DAEMON_SOCKET	"/run/amp_fwupgrade/socket"
+
+extern int fwup_daemon_run(const char *path, const char *status_file,
+			   const fwup_pace_t *pace);
+extern bool fwup_daemon_running(const char *path);
+extern int fwup_daemon_request(const char *path, const char *request,
+			       const char *image, size_t chunk_size,
+			       uint32_t flags, FILE *out);
+
+#endif /* AMP_FWUPGRADE_H */
+
+// vim:fenc=utf-8:tw=75:noet
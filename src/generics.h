@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 static DIR *dir;
@@ -168,6 +169,199 @@ generic_append_variable(efi_guid_t guid, const char *name,
 	return rc;
 }
 
+/* for backends that can only take one buffer, gather the pieces into one */
+static int UNUSED FLATTEN
+generic_set_variable_iov(efi_guid_t guid, const char *name,
+			 const struct iovec *iov, int iovcnt,
+			 uint32_t attributes, mode_t mode)
+{
+	int rc;
+	int i;
+	uint8_t *data;
+	size_t data_size = 0;
+	size_t pos = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > SIZE_MAX - data_size) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		data_size += iov[i].iov_len;
+	}
+
+	data = malloc(data_size ? data_size : 1);
+	if (!data) {
+		efi_error("malloc(%zu) failed", data_size);
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(data + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	rc = efi_set_variable(guid, name, data, data_size, attributes, mode);
+	if (rc < 0)
+		efi_error("efi_set_variable failed");
+	free(data);
+	return rc;
+}
+
+/* for backends that can only hand out a copy, copy that into buf */
+static int UNUSED FLATTEN
+generic_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			  size_t bufsize, size_t *needed, uint32_t *attributes)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	int rc;
+
+	rc = efi_get_variable(guid, name, &data, &data_size, attributes);
+	if (rc < 0)
+		return rc;
+	*needed = data_size;
+	if (data_size > bufsize) {
+		free(data);
+		errno = ERANGE;
+		return -1;
+	}
+	if (data_size)
+		memcpy(buf, data, data_size);
+	free(data);
+	return 0;
+}
+
+/* for backends that keep nothing open, read by name into the handle */
+static int UNUSED FLATTEN
+generic_read_variable(efi_variable_handle_t *handle, uint8_t **data,
+		      size_t *data_size, uint32_t *attributes)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	int rc;
+
+	rc = efi_get_variable(handle->guid, handle->name, &buf, &size,
+			      attributes);
+	if (rc < 0)
+		return rc;
+	free(handle->buf);
+	handle->buf = buf;
+	handle->alloc = size;
+	*data = buf;
+	*data_size = size;
+	return 0;
+}
+
+/*
+ * Both backends keep a variable as "<name>-<guid>" in one directory.
+ * Walk it once, asking the backend for the size and attributes of each
+ * entry in the namespace guid (or every one, if it's NULL), and hand back
+ * a single allocation holding the entries and their names.  Variables
+ * deleted while we look are left out.
+ */
+typedef int (*variable_metadata_fn)(int dfd, const char *entry,
+				    size_t *size, uint32_t *attributes);
+
+static int UNUSED
+generic_get_variables_metadata(int dfd, const efi_guid_t *guid,
+			       variable_metadata_fn read_metadata,
+			       efi_variable_metadata_t **entries,
+			       size_t *n_entries)
+{
+	const size_t guidlen = GUID_FORMAT_LENGTH;
+	efi_variable_metadata_t *vars = NULL, *new_vars, *ret;
+	size_t n = 0, alloc = 0, names = 0, i;
+	struct dirent *de;
+	int errno_value;
+	char *pos;
+	DIR *d;
+	int fd;
+	int rc = -1;
+
+	fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(\".\", O_DIRECTORY) failed");
+		return -1;
+	}
+	d = fdopendir(fd);
+	if (!d) {
+		errno_value = errno;
+		close(fd);
+		errno = errno_value;
+		efi_error("fdopendir() failed");
+		return -1;
+	}
+
+	while ((errno = 0, de = readdir(d)) != NULL) {
+		size_t namelen = strlen(de->d_name);
+		efi_guid_t entry_guid;
+		size_t size = 0;
+		uint32_t attributes = 0;
+
+		if (namelen < guidlen + 2 ||
+		    de->d_name[namelen - guidlen - 1] != '-' ||
+		    text_to_guid(de->d_name + namelen - guidlen,
+				 &entry_guid) < 0)
+			continue;
+		if (guid && memcmp(guid, &entry_guid, sizeof(entry_guid)))
+			continue;
+
+		if (read_metadata(dfd, de->d_name, &size, &attributes) < 0) {
+			if (errno == ENOENT)
+				continue;
+			efi_error("reading the metadata of %s failed",
+				  de->d_name);
+			goto err;
+		}
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			new_vars = realloc(vars, alloc * sizeof(*vars));
+			if (!new_vars) {
+				efi_error("realloc() failed");
+				goto err;
+			}
+			vars = new_vars;
+		}
+		vars[n].name = strndup(de->d_name, namelen - guidlen - 1);
+		if (!vars[n].name) {
+			efi_error("strndup() failed");
+			goto err;
+		}
+		vars[n].guid = entry_guid;
+		vars[n].size = size;
+		vars[n].attributes = attributes;
+		names += namelen - guidlen;
+		n++;
+	}
+	if (errno) {
+		efi_error("readdir() failed");
+		goto err;
+	}
+
+	ret = malloc(n * sizeof(*ret) + names + 1);
+	if (!ret) {
+		efi_error("malloc() failed");
+		goto err;
+	}
+	pos = (char *)(ret + n);
+	for (i = 0; i < n; i++) {
+		ret[i] = vars[i];
+		ret[i].name = pos;
+		pos = stpcpy(pos, vars[i].name) + 1;
+	}
+	*entries = ret;
+	*n_entries = n;
+	rc = 0;
+err:
+	errno_value = errno;
+	for (i = 0; i < n; i++)
+		free(vars[i].name);
+	free(vars);
+	closedir(d);
+	errno = errno_value;
+	return rc;
+}
+
 #endif /* LIBEFIVAR_GENERIC_NEXT_VARIABLE_NAME_H */
 #endif /* EFIVAR_BUILD_ENVIRONMENT */
 
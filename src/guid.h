@@ -14,6 +14,8 @@
 #include "efivar_endian.h"
 
 #define GUID_FORMAT "%08x-%04x-%04x-%04x-%02x%02x%02x%02x%02x%02x"
+/* the length of a GUID printed with GUID_FORMAT, without the NUL */
+#define GUID_FORMAT_LENGTH 36
 
 static inline int
 real_isspace(char c)
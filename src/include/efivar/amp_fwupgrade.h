@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * libamp_fwupgrade - firmware upgrades on Ampere platforms
+ * Copyright 2021 Ampere Computing LLC.
+ */
+#ifndef LIBAMP_FWUPGRADE_H
+#define LIBAMP_FWUPGRADE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An upgrade runs on its own thread from amp_fwup_start() until firmware
+ * reports the flash finished.  Nothing in here exits or prints; errors
+ * come back as -1 with errno set, and messages go to the log callback.
+ * Firmware takes one upgrade at a time, so only one handle per process
+ * can be running.
+ */
+typedef struct amp_fwup amp_fwup_t;
+
+typedef enum {
+	AMP_FWUP_STARTING = 0,		/* checking the image */
+	AMP_FWUP_UPLOADING,
+	AMP_FWUP_REQUESTING,		/* handing the image to firmware */
+	AMP_FWUP_FLASHING,
+	AMP_FWUP_SUCCEEDED,
+	AMP_FWUP_FAILED,
+	AMP_FWUP_CANCELLED,
+} amp_fwup_state_t;
+
+typedef struct {
+	amp_fwup_state_t state;
+	size_t uploaded;		/* bytes */
+	size_t total;			/* bytes, 0 while unknown */
+	unsigned int percent;		/* flash progress from firmware */
+	int error;			/* errno once FAILED or CANCELLED */
+} amp_fwup_progress_t;
+
+#define AMP_FWUP_CHUNK_CRC	0x00000001
+#define AMP_FWUP_SINGLE_RECORD	0x00000002
+#define AMP_FWUP_RESUME		0x00000004
+#define AMP_FWUP_FORCE		0x00000008
+#define AMP_FWUP_SPARSE		0x00000010
+#define AMP_FWUP_DELTA		0x00000020
+
+typedef void (*amp_fwup_done_t)(amp_fwup_t *fwup, void *data);
+typedef void (*amp_fwup_log_t)(amp_fwup_t *fwup, int warning,
+			       const char *message, void *data);
+
+typedef struct {
+	const char *request;		/* e.g. "UpgradeSCPRequest" */
+	const char *image;		/* path, or "-" for stdin */
+	size_t chunk_size;		/* 0 to negotiate */
+	uint32_t flags;			/* AMP_FWUP_* */
+	const char *journal;		/* NULL for the default */
+	amp_fwup_done_t done;		/* called on the upgrade thread */
+	amp_fwup_log_t message;
+	void *data;
+} amp_fwup_options_t;
+
+extern int amp_fwup_start(const amp_fwup_options_t *options,
+			  amp_fwup_t **fwup)
+			 __attribute__((__nonnull__ (1, 2)));
+extern int amp_fwup_progress(amp_fwup_t *fwup, amp_fwup_progress_t *progress)
+			    __attribute__((__nonnull__ (1, 2)));
+extern int amp_fwup_fd(amp_fwup_t *fwup)
+		      __attribute__((__nonnull__ (1)));
+extern int amp_fwup_cancel(amp_fwup_t *fwup)
+			  __attribute__((__nonnull__ (1)));
+extern int amp_fwup_wait(amp_fwup_t *fwup)
+			__attribute__((__nonnull__ (1)));
+extern const char *amp_fwup_message(amp_fwup_t *fwup)
+				   __attribute__((__nonnull__ (1)));
+extern void amp_fwup_free(amp_fwup_t *fwup);
+
+/*
+ * While it runs, amp_fwupgrade publishes how far it has got in a page
+ * at AMP_FWUP_STATUS_FILE, so any number of local readers can follow it
+ * without touching the firmware.  The page is updated under a sequence
+ * count which is odd while a write is under way: read the count, copy
+ * the page, and read the count again, and retry unless both reads gave
+ * the same even number.  amp_fwup_status_read() does that.  The last
+ * state is left behind when amp_fwupgrade exits; pid says whose it was.
+ * Fields are in host byte order.
+ */
+#define AMP_FWUP_STATUS_FILE	"/run/amp_fwupgrade/status"
+#define AMP_FWUP_STATUS_MAGIC	0x53574641	/* "AFWS" */
+#define AMP_FWUP_STATUS_VERSION	1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	uint32_t pid;
+	uint32_t state;			/* amp_fwup_state_t */
+	uint32_t percent;
+	uint64_t uploaded;
+	uint64_t total;
+	int32_t error;
+	uint32_t reserved;
+	uint64_t updated_ns;		/* CLOCK_MONOTONIC */
+	char request[64];
+	char component[64];
+} amp_fwup_status_t;
+
+extern int amp_fwup_status_read(const char *path, amp_fwup_status_t *status)
+				__attribute__((__nonnull__ (2)));
+
+#endif /* LIBAMP_FWUPGRADE_H */
+
+// vim:fenc=utf-8:tw=75:noet
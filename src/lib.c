@@ -28,6 +28,21 @@ struct efi_var_operations default_ops = {
 
 struct efi_var_operations *ops = NULL;
 
+/*
+ * Backends look variables up relative to a store directory they opened
+ * earlier.  When that finds nothing, the store may have been mounted or
+ * remounted since; if the backend says so, it has switched to the new
+ * one, and the call is made once more.
+ */
+#define retry_if_store_changed(ops_, call_)				\
+	({								\
+		int rc_ = (call_);					\
+		if (rc_ < 0 && errno == ENOENT &&			\
+		    (ops_)->store_changed && (ops_)->store_changed())	\
+			rc_ = (call_);					\
+		rc_;							\
+	})
+
 int NONNULL(2, 3) PUBLIC
 VERSION(_efi_set_variable, _efi_set_variable@libefivar.so.0)
 _efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
@@ -86,6 +101,150 @@ efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		 size_t data_size, uint32_t attributes, mode_t mode)
 	ALIAS(_efi_set_variable_mode);
 
+int NONNULL(2) PUBLIC
+efi_set_variable_iov(efi_guid_t guid, const char *name,
+		     const struct iovec *iov, int iovcnt,
+		     uint32_t attributes, mode_t mode)
+{
+	int rc;
+	if (iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt && !iov)) {
+		efi_error("invalid iovec count %d", iovcnt);
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ops->set_variable_iov) {
+		rc = generic_set_variable_iov(guid, name, iov, iovcnt,
+					      attributes, mode);
+		if (rc < 0)
+			efi_error("generic_set_variable_iov() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+	rc = ops->set_variable_iov(guid, name, iov, iovcnt, attributes, mode);
+	if (rc < 0)
+		efi_error("ops->set_variable_iov() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+/*
+ * A handle resolves the variable once, so that repeated reads and writes
+ * of it cost a system call each.  Backends that can't keep anything open
+ * fall back to the by-name calls.
+ */
+int NONNULL(2, 4) PUBLIC
+efi_variable_open(efi_guid_t guid, const char *name, mode_t mode,
+		  efi_variable_handle_t **handlep)
+{
+	efi_variable_handle_t *handle;
+	int rc;
+
+	handle = calloc(1, sizeof(*handle));
+	if (!handle) {
+		efi_error("calloc failed");
+		return -1;
+	}
+	handle->ops = ops;
+	handle->guid = guid;
+	handle->mode = mode;
+	handle->rfd = handle->wfd = handle->del_fd = -1;
+	handle->name = strdup(name);
+	if (!handle->name) {
+		efi_error("strdup failed");
+		free(handle);
+		return -1;
+	}
+
+	if (ops->open_variable) {
+		rc = ops->open_variable(handle);
+		if (rc < 0) {
+			efi_error("ops->open_variable() failed");
+			efi_variable_close(handle);
+			return rc;
+		}
+	}
+	efi_error_clear();
+	*handlep = handle;
+	return 0;
+}
+
+/*
+ * *data points into the handle, and stays valid until the next read or
+ * efi_variable_close().
+ */
+int NONNULL(1, 2, 3, 4) PUBLIC
+efi_variable_read(efi_variable_handle_t *handle, uint8_t **data,
+		  size_t *data_size, uint32_t *attributes)
+{
+	int rc;
+
+	if (!handle->ops->read_variable) {
+		rc = generic_read_variable(handle, data, data_size,
+					   attributes);
+		if (rc < 0)
+			efi_error("generic_read_variable() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+	rc = retry_if_store_changed(handle->ops,
+			handle->ops->read_variable(handle, data, data_size,
+						   attributes));
+	if (rc < 0)
+		efi_error("ops->read_variable() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_write(efi_variable_handle_t *handle, const struct iovec *iov,
+		   int iovcnt, uint32_t attributes)
+{
+	int rc;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt && !iov)) {
+		efi_error("invalid iovec count %d", iovcnt);
+		errno = EINVAL;
+		return -1;
+	}
+	if (!handle->ops->write_variable) {
+		rc = efi_set_variable_iov(handle->guid, handle->name, iov,
+					  iovcnt, attributes, handle->mode);
+		if (rc < 0)
+			efi_error("efi_set_variable_iov() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+	rc = retry_if_store_changed(handle->ops,
+			handle->ops->write_variable(handle, iov, iovcnt,
+						    attributes));
+	if (rc < 0)
+		efi_error("ops->write_variable() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+void PUBLIC
+efi_variable_close(efi_variable_handle_t *handle)
+{
+	int saved_errno = errno;
+
+	if (!handle)
+		return;
+	if (handle->ops->close_variable)
+		handle->ops->close_variable(handle);
+	free(handle->buf);
+	free(handle->path);
+	free(handle->name);
+	free(handle);
+	errno = saved_errno;
+}
+
 int NONNULL(2, 3) PUBLIC
 efi_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			size_t data_size, uint32_t attributes)
@@ -117,7 +276,7 @@ efi_del_variable(efi_guid_t guid, const char *name)
 		errno = ENOSYS;
 		return -1;
 	}
-	rc = ops->del_variable(guid, name);
+	rc = retry_if_store_changed(ops, ops->del_variable(guid, name));
 	if (rc < 0)
 		efi_error("ops->del_variable() failed");
 	else
@@ -135,7 +294,9 @@ efi_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 		errno = ENOSYS;
 		return -1;
 	}
-	rc = ops->get_variable(guid, name, data, data_size, attributes);
+	rc = retry_if_store_changed(ops,
+			ops->get_variable(guid, name, data, data_size,
+					  attributes));
 	if (rc < 0)
 		efi_error("ops->get_variable failed");
 	else
@@ -143,6 +304,40 @@ efi_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	return rc;
 }
 
+/*
+ * Read the variable's data into the caller's buffer.  *needed is set to
+ * its size either way; a buffer too small for it fails with ERANGE.
+ */
+int NONNULL(2, 5, 6) PUBLIC
+efi_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+		      size_t bufsize, size_t *needed, uint32_t *attributes)
+{
+	int rc;
+
+	if (!buf && bufsize) {
+		efi_error("invalid parameter 'buf'");
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ops->get_variable_into) {
+		rc = generic_get_variable_into(guid, name, buf, bufsize,
+					       needed, attributes);
+		if (rc < 0)
+			efi_error("generic_get_variable_into() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+	rc = retry_if_store_changed(ops,
+			ops->get_variable_into(guid, name, buf, bufsize,
+					       needed, attributes));
+	if (rc < 0)
+		efi_error("ops->get_variable_into() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
 int NONNULL(2, 3) PUBLIC
 efi_get_variable_attributes(efi_guid_t guid, const char *name,
 			    uint32_t *attributes)
@@ -153,7 +348,8 @@ efi_get_variable_attributes(efi_guid_t guid, const char *name,
 		errno = ENOSYS;
 		return -1;
 	}
-	rc = ops->get_variable_attributes(guid, name, attributes);
+	rc = retry_if_store_changed(ops,
+			ops->get_variable_attributes(guid, name, attributes));
 	if (rc < 0)
 		efi_error("ops->get_variable_attributes() failed");
 	else
@@ -177,7 +373,8 @@ efi_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 		errno = ENOSYS;
 		return -1;
 	}
-	rc = ops->get_variable_size(guid, name, size);
+	rc = retry_if_store_changed(ops,
+			ops->get_variable_size(guid, name, size));
 	if (rc < 0)
 		efi_error("ops->get_variable_size() failed");
 	else
@@ -185,6 +382,33 @@ efi_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 	return rc;
 }
 
+/*
+ * The name, size and attributes of every variable in the namespace guid,
+ * or in all of them if guid is NULL, without copying out their data.
+ * The entries and their names are one allocation for the caller to
+ * free().
+ */
+int NONNULL(2, 3) PUBLIC
+efi_get_variables_metadata(const efi_guid_t *guid,
+			   efi_variable_metadata_t **entries, size_t *n_entries)
+{
+	int rc;
+	if (!ops->get_variables_metadata) {
+		efi_error("get_variables_metadata() is not implemented");
+		errno = ENOSYS;
+		return -1;
+	}
+	/* a listing can't tell a stale store from an empty one */
+	if (ops->store_changed)
+		ops->store_changed();
+	rc = ops->get_variables_metadata(guid, entries, n_entries);
+	if (rc < 0)
+		efi_error("ops->get_variables_metadata() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
 int NONNULL(1, 2) PUBLIC
 efi_get_next_variable_name(efi_guid_t **guid, char **name)
 {
@@ -211,7 +435,8 @@ efi_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 		errno = ENOSYS;
 		return -1;
 	}
-	rc = ops->chmod_variable(guid, name, mode);
+	rc = retry_if_store_changed(ops,
+			ops->chmod_variable(guid, name, mode));
 	if (rc < 0)
 		efi_error("ops->chmod_variable() failed");
 	else
@@ -227,6 +452,12 @@ efi_variables_supported(void)
 	return 1;
 }
 
+const char PUBLIC *
+efi_variables_backend(void)
+{
+	return ops->name;
+}
+
 static void CONSTRUCTOR libefivar_init(void);
 
 static void CONSTRUCTOR
@@ -8,7 +8,16 @@
 #define LIBEFIVAR_LIB_H 1
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define GUID_FORMAT "%08x-%04x-%04x-%04x-%02x%02x%02x%02x%02x%02x"
 
@@ -17,20 +26,176 @@ struct efi_var_operations {
 	int (*probe)(void);
 	int (*set_variable)(efi_guid_t guid, const char *name, uint8_t *data,
 			    size_t data_size, uint32_t attributes, mode_t mode);
+	int (*set_variable_iov)(efi_guid_t guid, const char *name,
+				const struct iovec *iov, int iovcnt,
+				uint32_t attributes, mode_t mode);
 	int (*del_variable)(efi_guid_t guid, const char *name);
 	int (*get_variable)(efi_guid_t guid, const char *name, uint8_t **data,
 			    size_t *data_size, uint32_t *attributes);
+	int (*get_variable_into)(efi_guid_t guid, const char *name,
+				 uint8_t *buf, size_t bufsize, size_t *needed,
+				 uint32_t *attributes);
 	int (*get_variable_attributes)(efi_guid_t guid, const char *name,
 				       uint32_t *attributes);
 	int (*get_variable_size)(efi_guid_t guid, const char *name,
 				 size_t *size);
 	int (*get_next_variable_name)(efi_guid_t **guid, char **name);
+	int (*get_variables_metadata)(const efi_guid_t *guid,
+				      efi_variable_metadata_t **entries,
+				      size_t *n_entries);
 	int (*append_variable)(efi_guid_t guid, const char *name,
 			       uint8_t *data, size_t data_size,
 			       uint32_t attributes);
 	int (*chmod_variable)(efi_guid_t guid, const char *name, mode_t mode);
+	int (*open_variable)(efi_variable_handle_t *handle);
+	int (*read_variable)(efi_variable_handle_t *handle, uint8_t **data,
+			     size_t *data_size, uint32_t *attributes);
+	int (*write_variable)(efi_variable_handle_t *handle,
+			      const struct iovec *iov, int iovcnt,
+			      uint32_t attributes);
+	void (*close_variable)(efi_variable_handle_t *handle);
+	int (*store_changed)(void);
 };
 
+/*
+ * An open variable, see efi_variable_open().  The backend keeps whatever
+ * it resolved once here: its path relative to the variable store,
+ * descriptors and the inode they refer to, and the file flags to put
+ * back on close.  rfd and wfd read and write the variable; vars also
+ * keeps its del_var control file open in del_fd.  buf holds the last
+ * read and is reused for gathering writes.
+ */
+struct efi_variable_handle {
+	struct efi_var_operations *ops;
+	efi_guid_t guid;
+	char *name;
+	mode_t mode;
+
+	char *path;
+	int rfd;
+	int wfd;
+	int del_fd;
+	dev_t dev;
+	ino_t ino;
+	unsigned long orig_flags;
+	bool restore_flags;
+
+	uint8_t *buf;
+	size_t alloc;
+};
+
+static inline int UNUSED
+handle_reserve(efi_variable_handle_t *handle, size_t size)
+{
+	uint8_t *buf;
+
+	if (size <= handle->alloc)
+		return 0;
+	buf = realloc(handle->buf, size);
+	if (!buf)
+		return -1;
+	handle->buf = buf;
+	handle->alloc = size;
+	return 0;
+}
+
+/*
+ * Backends open their variable store directory once and reach every
+ * variable with openat() and friends relative to it, rather than having
+ * the kernel walk the whole path on every call.  The directory is cached
+ * along with the path it was opened from and what that path named then;
+ * a different path, or the store being mounted or remounted since (see
+ * store_dir_changed()), opens it again.  A store_dir is never modified
+ * once published, and one that is replaced is left open, since another
+ * thread may still be using its descriptor.
+ */
+struct store_dir {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	char path[];
+};
+
+static inline int UNUSED
+open_store_dir(const char *path, struct store_dir **dirp,
+	       struct store_dir *old)
+{
+	size_t len = strlen(path) + 1;
+	struct store_dir *dir;
+	int errno_value;
+	struct stat st;
+
+	dir = malloc(sizeof(*dir) + len);
+	if (!dir)
+		return -1;
+	dir->fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd < 0 || fstat(dir->fd, &st) < 0) {
+		errno_value = errno;
+		if (dir->fd >= 0)
+			close(dir->fd);
+		free(dir);
+		errno = errno_value;
+		return -1;
+	}
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	memcpy(dir->path, path, len);
+
+	/* a thread that loses the race to replace old uses the winner's */
+	if (!__atomic_compare_exchange_n(dirp, &old, dir, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(dir->fd);
+		free(dir);
+		return old->fd;
+	}
+	return dir->fd;
+}
+
+static inline int UNUSED
+get_store_dirfd(const char *path, struct store_dir **dirp)
+{
+	struct store_dir *dir = __atomic_load_n(dirp, __ATOMIC_ACQUIRE);
+
+	if (dir && !strcmp(dir->path, path))
+		return dir->fd;
+	return open_store_dir(path, dirp, dir);
+}
+
+/*
+ * A lookup relative to the cached directory found nothing.  If path names
+ * a different directory now, because the store was mounted or remounted
+ * after we opened it, switch to that and return 1 so the caller looks
+ * again.  errno is left alone for a caller with nothing to retry.
+ */
+static inline int UNUSED
+store_dir_changed(const char *path, struct store_dir **dirp)
+{
+	struct store_dir *dir = __atomic_load_n(dirp, __ATOMIC_ACQUIRE);
+	int errno_value = errno;
+	struct stat st;
+	int rc = 0;
+
+	if (stat(path, &st) == 0 &&
+	    (!dir || strcmp(dir->path, path) ||
+	     dir->dev != st.st_dev || dir->ino != st.st_ino) &&
+	    open_store_dir(path, dirp, dir) >= 0)
+		rc = 1;
+	errno = errno_value;
+	return rc;
+}
+
+static inline void UNUSED
+put_store_dir(struct store_dir **dirp)
+{
+	struct store_dir *dir = __atomic_exchange_n(dirp, NULL,
+						    __ATOMIC_ACQ_REL);
+
+	if (dir) {
+		close(dir->fd);
+		free(dir);
+	}
+}
+
 typedef unsigned long efi_status_t;
 
 extern struct efi_var_operations vars_ops;
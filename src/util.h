@@ -48,29 +48,40 @@
 #define unlikely(x) (__branch_check__(x, 0, __builtin_constant_p(x)))
 #endif
 
+/*
+ * Read all of fd into a buffer allocated here, with a NUL appended; the
+ * size returned counts it.  The buffer starts out big enough for what
+ * fstat() says is left of a regular file, which is all of an efivarfs
+ * variable, and doubles when that turns out to be short, as it is for
+ * sysfs files that don't know their size.
+ */
 static inline int UNUSED
 read_file(int fd, uint8_t **result, size_t *bufsize)
 {
-	uint8_t *p;
 	size_t size = 4096;
 	size_t filesize = 0;
 	ssize_t s = 0;
 	uint8_t *buf, *newbuf;
+	struct stat st;
+	off_t pos;
 
-	if (!(newbuf = calloc(size, sizeof (uint8_t)))) {
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos >= 0 && st.st_size > pos &&
+		    (uintmax_t)(st.st_size - pos) < SSIZE_MAX)
+			size = st.st_size - pos + 1;
+	}
+
+	if (!(buf = malloc(size))) {
 		efi_error("could not allocate memory");
-		*result = buf = NULL;
+		*result = NULL;
 		*bufsize = 0;
 		return -1;
 	}
-	buf = newbuf;
 
 	do {
-		p = buf + filesize;
-		/* size - filesize shouldn't exceed SSIZE_MAX because we're
-		 * only allocating 4096 bytes at a time and we're checking that
-		 * before doing so. */
-		s = read(fd, p, size - filesize);
+		/* size - filesize can't exceed SSIZE_MAX; see below. */
+		s = read(fd, buf + filesize, size - filesize);
 		if (s < 0 && errno == EAGAIN) {
 			/*
 			 * if we got EAGAIN, there's a good chance we've hit
@@ -82,7 +93,7 @@ read_file(int fd, uint8_t **result, size_t *bufsize)
 		} else if (s < 0) {
 			int saved_errno = errno;
 			free(buf);
-			*result = buf = NULL;
+			*result = NULL;
 			*bufsize = 0;
 			errno = saved_errno;
 			efi_error("could not read from file");
@@ -95,40 +106,38 @@ read_file(int fd, uint8_t **result, size_t *bufsize)
 		if (filesize >= size) {
 			/* See if we're going to overrun and return an error
 			 * instead. */
-			if (size > (size_t)-1 - 4096) {
+			if (size > SSIZE_MAX / 2) {
 				free(buf);
-				*result = buf = NULL;
+				*result = NULL;
 				*bufsize = 0;
 				errno = ENOMEM;
 				efi_error("could not read from file");
 				return -1;
 			}
-			newbuf = realloc(buf, size + 4096);
+			newbuf = realloc(buf, size * 2);
 			if (newbuf == NULL) {
 				int saved_errno = errno;
 				free(buf);
-				*result = buf = NULL;
+				*result = NULL;
 				*bufsize = 0;
 				errno = saved_errno;
 				efi_error("could not allocate memory");
 				return -1;
 			}
 			buf = newbuf;
-			memset(buf + size, '\0', 4096);
-			size += 4096;
+			size *= 2;
 		}
 	} while (1);
 
-	newbuf = realloc(buf, filesize+1);
-	if (!newbuf) {
-		free(buf);
-		*result = buf = NULL;
-		efi_error("could not allocate memory");
-		return -1;
+	/* The loop only ends with room left, so the NUL always fits. */
+	buf[filesize] = '\0';
+	if (size - filesize > 4096) {
+		newbuf = realloc(buf, filesize + 1);
+		if (newbuf)
+			buf = newbuf;
 	}
-	newbuf[filesize] = '\0';
-	*result = newbuf;
-	*bufsize = filesize+1;
+	*result = buf;
+	*bufsize = filesize + 1;
 	return 0;
 }
 
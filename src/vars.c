@@ -20,18 +20,63 @@
 #include "efivar.h"
 
 static const char default_vars_path[] = "/sys/firmware/efi/vars/";
+static struct store_dir *vars_dir;
 
 static const char *
 get_vars_path(void)
 {
-	static const char *path;
-	if (path)
-		return path;
-
-	path = getenv("VARS_PATH");
-	if (!path)
-		path = default_vars_path;
-	return path;
+	const char *path = getenv("VARS_PATH");
+
+	return path ? path : default_vars_path;
+}
+
+static void DESTRUCTOR
+fini_vars_dir(void)
+{
+	put_store_dir(&vars_dir);
+}
+
+static int
+get_vars_dirfd(void)
+{
+	int dfd = get_store_dirfd(get_vars_path(), &vars_dir);
+
+	if (dfd < 0)
+		efi_error("open(%s, O_PATH) failed", get_vars_path());
+	return dfd;
+}
+
+static int
+vars_store_changed(void)
+{
+	return store_dir_changed(get_vars_path(), &vars_dir);
+}
+
+/*
+ * Each variable is a directory "<name>-<guid>" of files; file names one
+ * of them, or the directory itself when NULL.  The result goes in a
+ * buffer of VARS_NAME_SIZE on the stack.
+ */
+#define VARS_NAME_SIZE	(NAME_MAX + sizeof("/attributes"))
+
+static int
+make_vars_name(char *buf, efi_guid_t guid, const char *name,
+	       const char *file)
+{
+	int rc;
+
+	rc = snprintf(buf, VARS_NAME_SIZE, "%s-" GUID_FORMAT "%s%s", name,
+		      guid.a, guid.b, guid.c, bswap_16(guid.d),
+		      guid.e[0], guid.e[1], guid.e[2],
+		      guid.e[3], guid.e[4], guid.e[5],
+		      file ? "/" : "", file ? file : "");
+	if (rc < 0)
+		return -1;
+	if ((size_t)rc >= VARS_NAME_SIZE) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
 }
 
 
@@ -164,13 +209,13 @@ err:
 }
 
 static int
-get_size_from_file(const char *filename, size_t *retsize)
+get_size_from_file(int dfd, const char *filename, size_t *retsize)
 {
 	uint8_t *buf = NULL;
 	size_t bufsize = -1;
 	int errno_value;
 	int ret = -1;
-	int fd = open(filename, O_RDONLY);
+	int fd = openat(dfd, filename, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		efi_error("open(%s, O_RDONLY) failed", filename);
 		goto err;
@@ -228,57 +273,139 @@ vars_probe(void)
 static int
 vars_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 {
-	int errno_value;
-	int ret = -1;
+	char path[VARS_NAME_SIZE];
+	int dfd = get_vars_dirfd();
+	int rc;
 
-	char *path = NULL;
-	int rc = asprintf(&path, "%s%s-"GUID_FORMAT"/size", get_vars_path(),
-			  name, guid.a, guid.b, guid.c, bswap_16(guid.d),
-			  guid.e[0], guid.e[1], guid.e[2], guid.e[3],
-			  guid.e[4], guid.e[5]);
+	if (dfd < 0)
+		return -1;
+	rc = make_vars_name(path, guid, name, "size");
 	if (rc < 0) {
-		efi_error("asprintf failed");
-		goto err;
+		efi_error("make_vars_name failed");
+		return -1;
 	}
 
 	size_t retsize = 0;
-	rc = get_size_from_file(path, &retsize);
-	if (rc >= 0) {
-		ret = 0;
-		*size = retsize;
-	} else if (rc < 0) {
+	rc = get_size_from_file(dfd, path, &retsize);
+	if (rc < 0) {
 		efi_error("get_size_from_file(%s) failed", path);
+		return -1;
 	}
-err:
-	errno_value = errno;
+	*size = retsize;
+	return 0;
+}
+
+/*
+ * raw_var is the whole kernel structure, data and all, in one read of a
+ * fixed size, so it fits on the stack.
+ */
+typedef union {
+	efi_kernel_variable_64_t var64;
+	efi_kernel_variable_32_t var32;
+	uint8_t raw[sizeof(efi_kernel_variable_64_t) + 1];
+} vars_raw_var_t;
 
-	if (path)
-		free(path);
+static int
+read_raw_var(int dfd, const char *path, vars_raw_var_t *var,
+	     size_t *data_size, uint32_t *attributes, const uint8_t **data)
+{
+	size_t size = is_64bit() ? sizeof(var->var64) : sizeof(var->var32);
+	int errno_value;
+	ssize_t sz;
+	int fd;
+
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s, O_RDONLY) failed", path);
+		return -1;
+	}
 
+	/* See vars_get_variable() about the rate limiter. */
+	if (geteuid() != 0)
+		usleep(10000);
+	do {
+		sz = read(fd, var->raw, sizeof(var->raw));
+	} while (sz < 0 && (errno == EINTR || errno == EAGAIN));
+	errno_value = errno;
+	close(fd);
 	errno = errno_value;
-	return ret;
+	if (sz < 0) {
+		efi_error("read(%s) failed", path);
+		return -1;
+	}
+	if ((size_t)sz != size) {
+		errno = EFBIG;
+		efi_error("file size is wrong for %s-bit variable (%zd of %zd)",
+			  is_64bit() ? "64" : "32", sz, size);
+		return -1;
+	}
+
+	if (is_64bit()) {
+		*data_size = var->var64.DataSize;
+		*attributes = var->var64.Attributes;
+		*data = var->var64.Data;
+	} else {
+		*data_size = var->var32.DataSize;
+		*attributes = var->var32.Attributes;
+		*data = var->var32.Data;
+	}
+	if (*data_size > sizeof(var->var64.Data)) {
+		errno = EFBIG;
+		efi_error("variable data size is too large (%zd of 1024)",
+			  *data_size);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vars_read_metadata(int dfd, const char *entry, size_t *size,
+		   uint32_t *attributes)
+{
+	char path[VARS_NAME_SIZE];
+	const uint8_t *data;
+	vars_raw_var_t var;
+	int rc;
+
+	rc = snprintf(path, sizeof(path), "%s/raw_var", entry);
+	if (rc < 0 || (size_t)rc >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		efi_error("variable name too long: %s", entry);
+		return -1;
+	}
+	return read_raw_var(dfd, path, &var, size, attributes, &data);
 }
 
 static int
 vars_get_variable_attributes(efi_guid_t guid, const char *name,
 			    uint32_t *attributes)
 {
-	int ret = -1;
-
-	uint8_t *data;
-	size_t data_size;
-	uint32_t attribs;
+	char path[VARS_NAME_SIZE];
+	size_t size;
+	int dfd;
 
-	ret = efi_get_variable(guid, name, &data, &data_size, &attribs);
-	if (ret < 0) {
-		efi_error("efi_get_variable() failed");
-		return ret;
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (make_vars_name(path, guid, name, NULL) < 0) {
+		efi_error("make_vars_name failed");
+		return -1;
 	}
+	return vars_read_metadata(dfd, path, &size, attributes);
+}
 
-	*attributes = attribs;
-	if (data)
-		free(data);
-	return ret;
+static int
+vars_get_variables_metadata(const efi_guid_t *guid,
+			    efi_variable_metadata_t **entries,
+			    size_t *n_entries)
+{
+	int dfd;
+
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		return -1;
+	return generic_get_variables_metadata(dfd, guid, vars_read_metadata,
+					      entries, n_entries);
 }
 
 static int
@@ -289,7 +416,8 @@ vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	int ret = -1;
 	uint8_t *buf = NULL;
 	size_t bufsize = -1;
-	char *path = NULL;
+	char path[VARS_NAME_SIZE];
+	int dfd;
 	int rc;
 	int fd = -1;
 	int ratelimit;
@@ -303,17 +431,16 @@ vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	 */
 	ratelimit = geteuid() == 0 ? 0 : 10000;
 
-	rc = asprintf(&path, "%s%s-" GUID_FORMAT "/raw_var",
-			  get_vars_path(),
-			  name, guid.a, guid.b, guid.c, bswap_16(guid.d),
-			  guid.e[0], guid.e[1], guid.e[2],
-			  guid.e[3], guid.e[4], guid.e[5]);
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		goto err;
+	rc = make_vars_name(path, guid, name, "raw_var");
 	if (rc < 0) {
-		efi_error("asprintf failed");
+		efi_error("make_vars_name failed");
 		goto err;
 	}
 
-	fd = open(path, O_RDONLY);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		efi_error("open(%s, O_RDONLY) failed", path);
 		goto err;
@@ -378,36 +505,64 @@ err:
 	if (fd >= 0)
 		close(fd);
 
-	if (path)
-		free(path);
-
 	errno = errno_value;
 	return ret;
 }
 
+/*
+ * raw_var is a fixed-size kernel structure, so it's read onto the stack
+ * and only the data is copied out.
+ */
+static int
+vars_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+		       size_t bufsize, size_t *needed, uint32_t *attributes)
+{
+	char path[VARS_NAME_SIZE];
+	const uint8_t *data;
+	vars_raw_var_t var;
+	int dfd;
+
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		return -1;
+	if (make_vars_name(path, guid, name, "raw_var") < 0) {
+		efi_error("make_vars_name failed");
+		return -1;
+	}
+
+	if (read_raw_var(dfd, path, &var, needed, attributes, &data) < 0)
+		return -1;
+	if (*needed > bufsize) {
+		errno = ERANGE;
+		return -1;
+	}
+	if (*needed)
+		memcpy(buf, data, *needed);
+	return 0;
+}
+
 static int
 vars_del_variable(efi_guid_t guid, const char *name)
 {
 	int errno_value;
 	int ret = -1;
-	char *path = NULL;
+	char path[VARS_NAME_SIZE];
+	int dfd;
 	int rc;
 	int fd = -1;
 	uint8_t *buf = NULL;
 	size_t buf_size = 0;
-	char *delvar;
 
-	rc = asprintf(&path, "%s%s-" GUID_FORMAT "/raw_var",
-			  get_vars_path(),
-			  name, guid.a, guid.b, guid.c, bswap_16(guid.d),
-			  guid.e[0], guid.e[1], guid.e[2],
-			  guid.e[3], guid.e[4], guid.e[5]);
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		goto err;
+	rc = make_vars_name(path, guid, name, "raw_var");
 	if (rc < 0) {
-		efi_error("asprintf failed");
+		efi_error("make_vars_name failed");
 		goto err;
 	}
 
-	fd = open(path, O_RDONLY);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		efi_error("open(%s, O_RDONLY) failed", path);
 		goto err;
@@ -430,15 +585,10 @@ vars_del_variable(efi_guid_t guid, const char *name)
 		goto err;
 	}
 
-	if (asprintfa(&delvar, "%s%s", get_vars_path(), "del_var") < 0) {
-		efi_error("asprintfa() failed");
-		goto err;
-	}
-
 	close(fd);
-	fd = open(delvar, O_WRONLY);
+	fd = openat(dfd, "del_var", O_WRONLY | O_CLOEXEC);
 	if (fd < 0) {
-		efi_error("open(%s, O_WRONLY) failed", delvar);
+		efi_error("open(%sdel_var, O_WRONLY) failed", get_vars_path());
 		goto err;
 	}
 
@@ -456,45 +606,32 @@ err:
 	if (fd >= 0)
 		close(fd);
 
-	if (path)
-		free(path);
-
 	errno = errno_value;
 	return ret;
 }
 
 static int
-_vars_chmod_variable(char *path, mode_t mode)
+_vars_chmod_variable(int dfd, efi_guid_t guid, const char *name, mode_t mode)
 {
 	mode_t mask = umask(umask(0));
-	size_t len = strlen(path);
-	char c = path[len - 5];
-	path[len - 5] = '\0';
+	char path[VARS_NAME_SIZE];
 
 	char *files[] = {
-		"", "attributes", "data", "guid", "raw_var", "size", NULL
+		NULL, "attributes", "data", "guid", "raw_var", "size"
 		};
 
 	int saved_errno = 0;
 	int ret = 0;
-	for (int i = 0; files[i] != NULL; i++) {
-		char *new_path = NULL;
-		int rc = asprintf(&new_path, "%s/%s", path, files[i]);
-		if (rc > 0) {
-			rc = chmod(new_path, mode & ~mask);
-			if (rc < 0) {
-				if (saved_errno == 0)
-					saved_errno = errno;
-				ret = -1;
-			}
-			free(new_path);
-		} else if (rc < 0) {
+	for (unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		int rc = make_vars_name(path, guid, name, files[i]);
+		if (rc >= 0)
+			rc = fchmodat(dfd, path, mode & ~mask, 0);
+		if (rc < 0) {
 			if (saved_errno == 0)
 				saved_errno = errno;
 			ret = -1;
 		}
 	}
-	path[len - 5] = c;
 	errno = saved_errno;
 	return ret;
 }
@@ -507,20 +644,13 @@ vars_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 		return -1;
 	}
 
-	char *path;
-	int rc = asprintf(&path, "%s%s-" GUID_FORMAT, get_vars_path(),
-			  name, guid.a, guid.b, guid.c, bswap_16(guid.d),
-			  guid.e[0], guid.e[1], guid.e[2], guid.e[3],
-			  guid.e[4], guid.e[5]);
-	if (rc < 0) {
-		efi_error("asprintf failed");
+	int dfd = get_vars_dirfd();
+	if (dfd < 0)
 		return -1;
-	}
 
-	rc = _vars_chmod_variable(path, mode);
+	int rc = _vars_chmod_variable(dfd, guid, name, mode);
 	int saved_errno = errno;
 	efi_error("_vars_chmod_variable() failed");
-	free(path);
 	errno = saved_errno;
 	return rc;
 }
@@ -529,10 +659,11 @@ static int
 vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		 size_t data_size, uint32_t attributes, mode_t mode)
 {
+	char path[VARS_NAME_SIZE];
 	int errno_value;
-	size_t len;
 	int ret = -1;
 	int fd = -1;
+	int dfd;
 
 	if (strlen(name) > 1024) {
 		efi_error("variable name size is too large (%zd of 1024)",
@@ -547,30 +678,22 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 
-	char *path;
-	int rc = asprintf(&path, "%s%s-" GUID_FORMAT "/data", get_vars_path(),
-			  name, guid.a, guid.b, guid.c, bswap_16(guid.d),
-			  guid.e[0], guid.e[1], guid.e[2], guid.e[3],
-			  guid.e[4], guid.e[5]);
+	dfd = get_vars_dirfd();
+	if (dfd < 0)
+		return -1;
+	int rc = make_vars_name(path, guid, name, "data");
 	if (rc < 0) {
-		efi_error("asprintf failed");
+		efi_error("make_vars_name failed");
 		goto err;
 	}
 
-	len = rc;
-
-	if (!access(path, F_OK)) {
+	if (!faccessat(dfd, path, F_OK, 0)) {
 		rc = efi_del_variable(guid, name);
 		if (rc < 0) {
 			efi_error("efi_del_variable failed");
 			goto err;
 		}
 	}
-	char *newvar;
-	if (asprintfa(&newvar, "%s%s", get_vars_path(), "new_var") < 0) {
-		efi_error("asprintfa failed");
-		goto err;
-	}
 
 	if (is_64bit()) {
 		efi_kernel_variable_64_t var64 = {
@@ -584,9 +707,10 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			var64.VariableName[i] = name[i];
 		memcpy(var64.Data, data, data_size);
 
-		fd = open(newvar, O_WRONLY);
+		fd = openat(dfd, "new_var", O_WRONLY | O_CLOEXEC);
 		if (fd < 0) {
-			efi_error("open(%s, O_WRONLY) failed", newvar);
+			efi_error("open(%snew_var, O_WRONLY) failed",
+				  get_vars_path());
 			goto err;
 		}
 
@@ -602,9 +726,10 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			var32.VariableName[i] = name[i];
 		memcpy(var32.Data, data, data_size);
 
-		fd = open(newvar, O_WRONLY);
+		fd = openat(dfd, "new_var", O_WRONLY | O_CLOEXEC);
 		if (fd < 0) {
-			efi_error("open(%s, O_WRONLY) failed", newvar);
+			efi_error("open(%snew_var, O_WRONLY) failed",
+				  get_vars_path());
 			goto err;
 		}
 
@@ -619,14 +744,10 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	/* this is inherently racy, but there's no way to do it correctly with
 	 * this kernel API.  Fortunately, all directory contents get created
 	 * with root.root ownership and an effective umask of 177 */
-	path[len-5] = '\0';
-	_vars_chmod_variable(path, mode);
+	_vars_chmod_variable(dfd, guid, name, mode);
 err:
 	errno_value = errno;
 
-	if (path)
-		free(path);
-
 	if (fd >= 0)
 		close(fd);
 
@@ -634,6 +755,218 @@ err:
 	return ret;
 }
 
+/*
+ * A handle keeps raw_var open for reading, and new_var and del_var for
+ * writing.  Each write recreates the variable's directory, so raw_var is
+ * opened again afterwards.
+ */
+static int
+vars_open_raw_var(efi_variable_handle_t *handle)
+{
+	if (handle->rfd >= 0)
+		close(handle->rfd);
+	handle->rfd = openat(get_vars_dirfd(), handle->path,
+			     O_RDONLY | O_CLOEXEC);
+	if (handle->rfd < 0) {
+		efi_error("open(%s, O_RDONLY) failed", handle->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vars_open_variable(efi_variable_handle_t *handle)
+{
+	char path[VARS_NAME_SIZE];
+
+	if (strlen(handle->name) > 1024) {
+		efi_error("variable name size is too large (%zd of 1024)",
+			  strlen(handle->name));
+		errno = EINVAL;
+		return -1;
+	}
+	if (get_vars_dirfd() < 0)
+		return -1;
+	if (make_vars_name(path, handle->guid, handle->name, "raw_var") < 0) {
+		efi_error("make_vars_name failed");
+		return -1;
+	}
+	handle->path = strdup(path);
+	if (!handle->path) {
+		efi_error("strdup failed");
+		return -1;
+	}
+	if (vars_open_raw_var(handle) < 0 && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+static int
+vars_read_variable(efi_variable_handle_t *handle, uint8_t **data,
+		   size_t *data_size, uint32_t *attributes)
+{
+	size_t size = is_64bit() ? sizeof(efi_kernel_variable_64_t)
+				 : sizeof(efi_kernel_variable_32_t);
+	ssize_t sz;
+
+	if (handle->rfd < 0 && vars_open_raw_var(handle) < 0)
+		return -1;
+	if (handle_reserve(handle, size + 1) < 0) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	/* See vars_get_variable() about the rate limiter. */
+	if (geteuid() != 0)
+		usleep(10000);
+
+	do {
+		sz = pread(handle->rfd, handle->buf, size + 1, 0);
+	} while (sz < 0 && errno == EINTR);
+	if (sz < 0) {
+		efi_error("pread(%s) failed", handle->path);
+		return -1;
+	}
+	if ((size_t)sz != size) {
+		errno = EFBIG;
+		efi_error("file size is wrong for %s-bit variable (%zd of %zd)",
+			  is_64bit() ? "64" : "32", sz, size);
+		return -1;
+	}
+
+	if (is_64bit()) {
+		efi_kernel_variable_64_t *var64 = (void *)handle->buf;
+
+		*data = var64->Data;
+		*data_size = var64->DataSize;
+		*attributes = var64->Attributes;
+	} else {
+		efi_kernel_variable_32_t *var32 = (void *)handle->buf;
+
+		*data = var32->Data;
+		*data_size = var32->DataSize;
+		*attributes = var32->Attributes;
+	}
+	if (*data_size > 1024) {
+		errno = EFBIG;
+		efi_error("variable data size is too large (%zd of 1024)",
+			  *data_size);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vars_open_control(int *fd, const char *file)
+{
+	if (*fd >= 0)
+		return 0;
+	*fd = openat(get_vars_dirfd(), file, O_WRONLY | O_CLOEXEC);
+	if (*fd < 0) {
+		efi_error("open(%s%s, O_WRONLY) failed", get_vars_path(), file);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The same kernel structure as vars_set_variable() writes, built in the
+ * handle.  del_var only looks at its name and GUID, so deleting the old
+ * variable needs no read of it first.
+ */
+static int
+vars_write_variable(efi_variable_handle_t *handle, const struct iovec *iov,
+		    int iovcnt, uint32_t attributes)
+{
+	size_t size = is_64bit() ? sizeof(efi_kernel_variable_64_t)
+				 : sizeof(efi_kernel_variable_32_t);
+	mode_t mask = umask(umask(0));
+	size_t data_size = 0;
+	uint16_t *name;
+	uint8_t *pos;
+	ssize_t rc;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 1024 - data_size) {
+			efi_error("variable data size is too large (>%zd of 1024)",
+				  data_size + iov[i].iov_len);
+			errno = ENOSPC;
+			return -1;
+		}
+		data_size += iov[i].iov_len;
+	}
+
+	if (vars_open_control(&handle->wfd, "new_var") < 0 ||
+	    (handle->rfd >= 0 &&
+	     vars_open_control(&handle->del_fd, "del_var") < 0))
+		return -1;
+	if (handle_reserve(handle, size + 1) < 0) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	memset(handle->buf, '\0', size);
+	if (is_64bit()) {
+		efi_kernel_variable_64_t *var64 = (void *)handle->buf;
+
+		var64->VendorGuid = handle->guid;
+		var64->DataSize = data_size;
+		var64->Attributes = attributes;
+		pos = var64->Data;
+	} else {
+		efi_kernel_variable_32_t *var32 = (void *)handle->buf;
+
+		var32->VendorGuid = handle->guid;
+		var32->DataSize = data_size;
+		var32->Attributes = attributes;
+		pos = var32->Data;
+	}
+	/* VariableName comes first in both, at the start of the buffer */
+	name = (uint16_t *)handle->buf;
+	for (i = 0; handle->name[i] != '\0'; i++)
+		name[i] = handle->name[i];
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	if (handle->rfd >= 0) {
+		close(handle->rfd);
+		handle->rfd = -1;
+		rc = pwrite(handle->del_fd, handle->buf, size, 0);
+		if (rc < 0) {
+			efi_error("write() to del_var failed");
+			return -1;
+		}
+	}
+	rc = pwrite(handle->wfd, handle->buf, size, 0);
+	if (rc < 0) {
+		efi_error("write() to new_var failed");
+		return -1;
+	}
+
+	if (vars_open_raw_var(handle) < 0 && errno != ENOENT)
+		return -1;
+	/* new variables are created 0600; see vars_set_variable() */
+	if ((handle->mode & ~mask) != 0600)
+		_vars_chmod_variable(get_vars_dirfd(), handle->guid,
+				     handle->name, handle->mode);
+	return 0;
+}
+
+static void
+vars_close_variable(efi_variable_handle_t *handle)
+{
+	if (handle->rfd >= 0)
+		close(handle->rfd);
+	if (handle->wfd >= 0)
+		close(handle->wfd);
+	if (handle->del_fd >= 0)
+		close(handle->del_fd);
+	handle->rfd = handle->wfd = handle->del_fd = -1;
+}
+
 static int
 vars_get_next_variable_name(efi_guid_t **guid, char **name)
 {
@@ -651,10 +984,17 @@ struct efi_var_operations vars_ops = {
 	.set_variable = vars_set_variable,
 	.del_variable = vars_del_variable,
 	.get_variable = vars_get_variable,
+	.get_variable_into = vars_get_variable_into,
 	.get_variable_attributes = vars_get_variable_attributes,
 	.get_variable_size = vars_get_variable_size,
 	.get_next_variable_name = vars_get_next_variable_name,
+	.get_variables_metadata = vars_get_variables_metadata,
 	.chmod_variable = vars_chmod_variable,
+	.open_variable = vars_open_variable,
+	.read_variable = vars_read_variable,
+	.write_variable = vars_write_variable,
+	.close_variable = vars_close_variable,
+	.store_changed = vars_store_changed,
 };
 
 // vim:fenc=utf-8:tw=75:noet